@@ -2,8 +2,9 @@
 #include "assembler.h"
 #include "bloom.h"
 #include "kmer.h"
-#include "kmerhash.h"
+#include "kmerindex.h"
 #include "misc.h"
+#include "refindex.h"
 #include "seqenc.h"
 #include "twobit.h"
 #include "sam/bam.h"
@@ -12,6 +13,7 @@
 #include <string.h>
 #include <math.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 /* k-mer used for de bruijn graph assembly */
 static const size_t assemble_k = 25;
@@ -37,15 +39,107 @@ static const size_t seeds_n = 200000;
 static const size_t bloom_n = 4000000;
 static const size_t bloom_m = 8;
 
+/* Number of parts the bloom filter is split into, so that k-mers can be
+ * counted in parallel, since version 5. */
+static const size_t bloom_shards = 64;
+
+/* Since version 5, the bloom filter is blocked, and sized by the number of
+ * reads assembled, with about 96 cells for each, enough to hold every k-mer
+ * of a 100nt read should they all be distinct, as at low coverage. */
+static const size_t bloom_bytes_per_read = 300;
+
 /* Number of reads to be used for assembly. */
 size_t quip_assembly_n = 2500000;
 
+/* Most memory in bytes used to count k-mers for assembly, since version 5. */
+size_t quip_assembly_mem = 384 * 1024 * 1024;
+
+
+/* Since version 5, contigs are put to use a fixed number of chunks after the
+ * last read to be assembled, one for every this many reads assembled (and at
+ * least one), as both ends must switch at the same read. */
+static const size_t assembly_lag_reads = 40000;
+
+
+static size_t assembly_lag_chunks(void)
+{
+    size_t n = quip_assembly_n / assembly_lag_reads;
+    return n > 0 ? n : 1;
+}
+
+
+/* Allocate the bloom filter used to count k-mers. It determines the contigs
+ * made, so the decoder must allocate the same as the encoder. */
+static bloom_t* alloc_bloom(uint8_t quip_version)
+{
+    if (quip_version < 5) return bloom_alloc(bloom_n, bloom_m, 1);
+
+    size_t bytes = quip_assembly_mem;
+    if (quip_assembly_n < bytes / bloom_bytes_per_read) {
+        bytes = quip_assembly_n * bloom_bytes_per_read;
+    }
+
+    return bloom_alloc_blocked(bytes, bloom_shards);
+}
+
+
+/* Work done on a thread of its own. */
+typedef struct background_t_
+{
+    void (*f)(void*);
+    void* arg;
+
+    pthread_t thread;
+
+    /* started and not yet joined */
+    bool running;
+} background_t;
+
+
+static void* background_thread(void* arg)
+{
+    background_t* bg = (background_t*) arg;
+    bg->f(bg->arg);
+    return NULL;
+}
+
+
+static void background_start(background_t* bg, void (*f)(void*), void* arg)
+{
+    bg->f = f;
+    bg->arg = arg;
+
+    int ret = pthread_create(&bg->thread, NULL, background_thread, bg);
+    if (ret != 0) {
+        quip_error("pthread_create error: %s", strerror(ret));
+    }
+
+    bg->running = true;
+}
+
+
+/* Wait for the work to finish, if it is running. */
+static void background_join(background_t* bg)
+{
+    if (!bg->running) return;
+
+    int ret = pthread_join(bg->thread, NULL);
+    if (ret != 0) {
+        quip_error("pthread_join error: %s", strerror(ret));
+    }
+
+    bg->running = false;
+}
+
 
 struct assembler_t_
 {
     /* actually assemble something */
     bool assemble;
 
+    /* code contigs once assembled, so the decoder need not assemble them */
+    bool store_contigs;
+
     /* quip version field */
     uint8_t quip_version;
 
@@ -63,43 +157,58 @@ struct assembler_t_
     /* k-mer table used for assembly */
     bloom_t* B;
 
-    /* k-mer table used for alignment */
-    kmerhash_t* H;
+    /* k-mer index used for alignment, built with the contigs */
+    kmerindex_t* I;
 
     /* nucleotide sequence encoder */
     seqenc_t* seqenc;
 
-    /* assembled contigs and their reverse complements */
+    /* assembled contigs */
     twobit_t* supercontig;
-    twobit_t* supercontig_rc;
 
     /* reference, for reference based alignment */
     const seqmap_t* ref;
 
+    /* index of the reference used to map unaligned reads, built when the
+     * first is seen, or NULL */
+    refindex_t* refindex;
+    bool refindex_built;
+
     /* Number of reads before assembly is triggered. */
     size_t assembly_pending_n;
 
+    /* Since version 5, contigs are made in the background, and reads are
+     * coded without them until the start of the chunk given by
+     * assembly_lag_chunks, when they are waited for if need be. */
+    background_t assembly;
+
+    /* chunks left to start before contigs are used */
+    size_t assembly_lag;
+
     /* statistics used in verbose reporting */
     uint64_t stat_n;
     uint64_t stat_aligned_count;
     uint64_t stat_assemble_count;
+    uint64_t stat_dup_count;
+    uint64_t stat_mapped_count;
 };
 
 
-static void build_kmer_hash(assembler_t* A);
-
-
 assembler_t* assembler_alloc(
         quip_writer_t   writer,
         void*           writer_data,
         bool            assemble,
+        bool            store_contigs,
         uint8_t         quip_version,
-        const seqmap_t* ref)
+        const seqenc_params_t* seq_params,
+        const seqmap_t* ref,
+        const bam_header_t* header)
 {
     assembler_t* A = malloc_or_die(sizeof(assembler_t));
     memset(A, 0, sizeof(assembler_t));
 
     A->assemble = assemble;
+    A->store_contigs = store_contigs;
     A->quip_version = quip_version;
 
     A->writer = writer;
@@ -113,13 +222,13 @@ assembler_t* assembler_alloc(
         memset(A->seeds, 0, seeds_n * sizeof(twobit_t*));
         A->seeds_len = 0;
 
-        A->B = bloom_alloc(bloom_n, bloom_m);
+        A->B = alloc_bloom(quip_version);
         A->x = twobit_alloc();
-        A->H = kmerhash_alloc();
         A->assembly_pending_n = quip_assembly_n;
     }
 
-    A->seqenc = seqenc_alloc_encoder(writer, writer_data, ref);
+    A->seqenc = seqenc_alloc_encoder(writer, writer_data, quip_version,
+                                     seq_params, ref, header);
 
     return A;
 }
@@ -129,6 +238,8 @@ void assembler_free(assembler_t* A)
 {
     if (A == NULL) return;
 
+    background_join(&A->assembly);
+
     size_t i;
     for (i = 0; i < A->seeds_len; ++i) {
         twobit_free(A->seeds[i]);
@@ -136,16 +247,17 @@ void assembler_free(assembler_t* A)
     free(A->seeds);
 
     bloom_free(A->B);
-    kmerhash_free(A->H);
+    kmerindex_free(A->I);
     twobit_free(A->x);
     seqenc_free(A->seqenc);
     twobit_free(A->supercontig);
-    twobit_free(A->supercontig_rc);
+    refindex_free(A->refindex);
     free(A);
 }
 
 
-/* Count the number of occurrences of each k-mer in a read x */
+/* Count the number of occurrences of each k-mer in a read x. Counts are queued
+ * until the contigs are made. */
 static void count_kmers(bloom_t* B, const twobit_t* seq)
 {
     size_t i, seqlen;
@@ -158,7 +270,7 @@ static void count_kmers(bloom_t* B, const twobit_t* seq)
 
         if (i + 1 >= assemble_k) {
             y = kmer_canonical(x, assemble_k);
-            bloom_add(B, y, 1);
+            bloom_push(B, y);
         }
     }
 }
@@ -168,8 +280,8 @@ static void count_kmers(bloom_t* B, const twobit_t* seq)
  * encode the sequence. Return true if an alignment was found. */
 static bool align_read(assembler_t* A, const unsigned char* seq_str, const twobit_t* seq)
 {
-    /* We only consider the first few seed hits found in the hash table. The
-     * should be in an approximately random order. */
+    /* We only consider the first few seed hits found in the index, which are
+     * those nearest the start of the supercontig. */
     static const size_t max_seeds = 100;
 
     /* position of the seed with the subject and query sequence, resp. */
@@ -181,17 +293,16 @@ static bool align_read(assembler_t* A, const unsigned char* seq_str, const twobi
     uint8_t strand;
 
     /* positions matching the seed k-mer */
-    kmer_pos_t* pos;
+    const kmer_pos_t* pos;
     size_t poslen;
 
-    twobit_t* contig;
-
     /* optimal alignment found so far */
     double   best_aln_score = HUGE_VAL;
     uint32_t best_spos = 0;
     uint8_t  best_strand = 0;
 
     double aln_score;
+    uint32_t mismatch;
 
     /* Don't try to align any reads that are shorter than the seed length */
     qlen = twobit_len(seq);
@@ -215,7 +326,7 @@ static bool align_read(assembler_t* A, const unsigned char* seq_str, const twobi
                 align_k);
         y = kmer_canonical(x, align_k);
 
-        poslen = kmerhash_get(A->H, y, &pos);
+        poslen = kmerindex_get(A->I, y, &pos);
         poslen = poslen > max_seeds ? max_seeds : poslen;
 
 
@@ -247,9 +358,18 @@ static bool align_read(assembler_t* A, const unsigned char* seq_str, const twobi
                 continue;
             }
 
-            contig = strand == 0 ? A->supercontig : A->supercontig_rc;
+            /* the reverse strand is compared by reverse complementing the
+             * read instead */
+            if (strand == 0) {
+                mismatch = twobit_mismatch_count(
+                    A->supercontig, seq, spos - qpos, max_mismatch);
+            }
+            else {
+                mismatch = twobit_mismatch_count_rc(
+                    A->supercontig, seq, slen - (spos - qpos) - qlen, max_mismatch);
+            }
 
-            aln_score = (double) twobit_mismatch_count(contig, seq, spos - qpos, max_mismatch) / (double) qlen;
+            aln_score = (double) mismatch / (double) qlen;
 
             if (aln_score <= max_align_score &&
                 aln_score < best_aln_score)
@@ -274,22 +394,62 @@ static bool align_read(assembler_t* A, const unsigned char* seq_str, const twobi
 }
 
 
+/* Choose the nucleotide with which to extend a contig, given the counts of
+ * each of the four k-mers that would follow, each itself followed by the
+ * counts of the four that could follow it, setting *nt_best, or return false
+ * if there is no extension. */
+static bool choose_extension(uint8_t quip_version, const unsigned int* cnts,
+                             kmer_t* nt_best)
+{
+    unsigned int cnt, cnt2, cnt_best = 0, cnt2_best;
+    kmer_t nt, nt2;
+    for (nt = 0; nt < 4; ++nt) {
+        cnt = cnts[5 * nt];
+
+        /* Look ahead two k-mers for a somewhat better
+         * greedy choice. */
+        cnt2_best = 0;
+        for (nt2 = 0; nt2 < 4; ++nt2) {
+            cnt2 = cnts[5 * nt + 1 + nt2];
+            if (cnt2 > cnt2_best) cnt2_best = cnt2;
+        }
+
+        /* Version 4 never extended contigs, and must be decoded as it
+         * was written. */
+        if ((quip_version == 2 && cnt + cnt2_best > cnt_best) ||
+            ((quip_version == 3 || quip_version >= 5) &&
+             cnt > 0 && cnt + cnt2_best > cnt_best)) {
+            cnt_best = cnt + cnt2_best;
+            *nt_best = nt;
+        }
+    }
+
+    return cnt_best > 0;
+}
+
+
 static void make_contig(uint8_t quip_version, bloom_t* B,
                         twobit_t* seed, twobit_t* contig)
 {
     twobit_clear(contig);
 
+    /* The k-mers counted to choose each extension, and their counts, looked
+     * up together so that cache misses overlap. */
+    kmer_t xs[20];
+    unsigned int cnts[20];
+
     /* delete all kmers in the seed */
     kmer_t x = twobit_get_kmer_rev(seed, 0, assemble_k);
-    size_t i;
-    for (i = assemble_k; i < twobit_len(seed); ++i) {
-        bloom_ldec(B, kmer_canonical((x << 2) | twobit_get(seed, i), assemble_k));
+    size_t i, j;
+    for (i = assemble_k; i < twobit_len(seed); i += j) {
+        for (j = 0; j < 20 && i + j < twobit_len(seed); ++j) {
+            xs[j] = kmer_canonical((x << 2) | twobit_get(seed, i + j), assemble_k);
+        }
+        bloom_ldec_many(B, xs, j);
     }
 
     /* expand the contig as far left as possible */
-    unsigned int cnt, cnt2, cnt_best, cnt2_best;
-
-    kmer_t nt, nt2, nt_best = 0, xc, y, z;
+    kmer_t nt, nt2, nt_best = 0, y, z;
 
     /* Greedily append nucleotides to the contig using
      * approximate k-mer counts stored in the bloom filter. */
@@ -298,32 +458,22 @@ static void make_contig(uint8_t quip_version, bloom_t* B,
         bloom_ldec(B, kmer_canonical(x, assemble_k));
 
         x = (x >> 2) & assemble_kmer_mask;
-        cnt_best = 0;
         for (nt = 0; nt < 4; ++nt) {
             y = nt << (2 * (assemble_k - 1));
-            xc = kmer_canonical(x | y, assemble_k);
-            cnt = bloom_get(B, xc);
+            xs[5 * nt] = kmer_canonical(x | y, assemble_k);
 
-            /* Look ahead two k-mers for a somewhat better
-             * greedy choice. */
-            cnt2_best = 0;
             for (nt2 = 0; nt2 < 4; ++nt2) {
                 z = (nt2 << (2 * (assemble_k - 1))) |
                     (nt  << (2 * (assemble_k - 2))) |
                     (x >> 2);
                 z &= assemble_kmer_mask;
-                cnt2 = bloom_get(B, kmer_canonical(z, assemble_k));
-                if (cnt2 > cnt2_best) cnt2_best = cnt2;
-            }
-
-            if ((quip_version == 2 && cnt + cnt2_best > cnt_best) ||
-                (quip_version == 3 && cnt > 0 && cnt + cnt2_best > cnt_best)) {
-                cnt_best = cnt + cnt2_best;
-                nt_best  = nt;
+                xs[5 * nt + 1 + nt2] = kmer_canonical(z, assemble_k);
             }
         }
 
-        if (cnt_best > 0) {
+        bloom_get_many(B, xs, cnts, 20);
+
+        if (choose_extension(quip_version, cnts, &nt_best)) {
             y = nt_best << (2 * (assemble_k - 1));
             x = x | y;
             twobit_append_kmer(contig, nt_best, 1);
@@ -339,27 +489,19 @@ static void make_contig(uint8_t quip_version, bloom_t* B,
         bloom_ldec(B, kmer_canonical(x, assemble_k));
 
         x = (x << 2) & assemble_kmer_mask;
-        cnt_best = 0;
         for (nt = 0; nt < 4; ++nt) {
-            xc = kmer_canonical(x | nt, assemble_k);
-            cnt = bloom_get(B, xc);
+            xs[5 * nt] = kmer_canonical(x | nt, assemble_k);
 
-            cnt2_best = 0;
             for (nt2 = 0; nt2 < 4; ++nt2) {
                 z = (x << 2) | (nt << 2) | nt2;
                 z &= assemble_kmer_mask;
-                cnt2 = bloom_get(B, kmer_canonical(z, assemble_k));
-                if (cnt2 > cnt2_best) cnt2_best = cnt2;
-            }
-
-            if ((quip_version == 2 && cnt + cnt2_best > cnt_best) ||
-                (quip_version == 3 && cnt > 0 && cnt + cnt2_best > cnt_best)) {
-                cnt_best = cnt + cnt2_best;
-                nt_best  = nt;
+                xs[5 * nt + 1 + nt2] = kmer_canonical(z, assemble_k);
             }
         }
 
-        if (cnt_best > 0) {
+        bloom_get_many(B, xs, cnts, 20);
+
+        if (choose_extension(quip_version, cnts, &nt_best)) {
             x = x | nt_best;
             twobit_append_kmer(contig, nt_best, 1);
         }
@@ -373,10 +515,13 @@ static void make_contig(uint8_t quip_version, bloom_t* B,
 static void make_contigs(
     uint8_t quip_version,
     twobit_t** supercontig,
-    twobit_t** supercontig_rc,
     bloom_t* B,
     twobit_t** seeds, size_t n)
 {
+    if (quip_verbose) fprintf(stderr, "counting k-mers ... ");
+    bloom_flush(B);
+    if (quip_verbose) fprintf(stderr, "done.\n");
+
     if (quip_verbose) fprintf(stderr, "assembling contigs ...\n");
 
     *supercontig = twobit_alloc();
@@ -401,29 +546,37 @@ static void make_contigs(
 
     twobit_free(contig);
 
-    *supercontig_rc = twobit_alloc_n(twobit_len(*supercontig));
-    twobit_revcomp(*supercontig_rc, *supercontig);
-
     if (quip_verbose) fprintf(stderr, "done. (%zu contigs, %zunt)\n",
                               contig_cnt, twobit_len(*supercontig));
 }
 
-static void build_kmer_hash(assembler_t* A)
+static void build_kmer_index(assembler_t* A)
 {
-    kmerhash_clear(A->H);
+    kmerindex_free(A->I);
 
     size_t len = twobit_len(A->supercontig);
-    size_t pos;
+    size_t n = len >= align_k ? len - align_k + 1 : 0;
+    kmer_t*     ys = malloc_or_die((n + 1) * sizeof(kmer_t));
+    kmer_pos_t* ps = malloc_or_die((n + 1) * sizeof(kmer_pos_t));
+
+    /* Each canonical k-mer is stored with its position, or, if it is the
+     * reverse complement that occurs, minus one more than that. */
+    size_t pos, i = 0;
     kmer_t x = 0, y;
     for (pos = 0; pos < len; ++pos) {
         x = ((x << 2) | twobit_get(A->supercontig, pos)) & align_kmer_mask;
 
         if (pos + 1 >= align_k) {
             y = kmer_canonical(x, align_k);
-            if (x == y) kmerhash_put(A->H, y, pos + 1 - align_k);
-            else        kmerhash_put(A->H, y, - (int32_t) (pos + 2 - align_k));
+            ys[i] = y;
+            if (x == y) ps[i++] = pos + 1 - align_k;
+            else        ps[i++] = - (int32_t) (pos + 2 - align_k);
         }
     }
+
+    A->I = kmerindex_alloc(ys, ps, n, align_k);
+    free(ys);
+    free(ps);
 }
 
 
@@ -432,10 +585,72 @@ static void index_contigs(assembler_t* A)
 {
     if (quip_verbose) fprintf(stderr, "indexing contigs ... ");
 
-    build_kmer_hash(A);
-    twobit_revcomp(A->supercontig_rc, A->supercontig);
+    build_kmer_index(A);
 
-    if (quip_verbose) fprintf(stderr, "done.\n");
+    if (quip_verbose) fprintf(stderr, "done. (%zu distinct %zu-mers)\n",
+                              kmerindex_size(A->I), align_k);
+}
+
+
+/* Free the seeds and k-mer counts, once contigs are made. */
+static void free_assembly_input(bloom_t** B, twobit_t*** seeds, size_t* seeds_len)
+{
+    bloom_free(*B);
+    *B = NULL;
+
+    size_t i;
+    for (i = 0; i < *seeds_len; ++i) {
+        twobit_free((*seeds)[i]);
+    }
+    free(*seeds);
+    *seeds = NULL;
+    *seeds_len = 0;
+}
+
+
+/* Make and index contigs from the reads counted so far. */
+static void assemble(void* arg)
+{
+    assembler_t* A = (assembler_t*) arg;
+
+    make_contigs(A->quip_version, &A->supercontig,
+                 A->B, A->seeds, A->seeds_len);
+    free_assembly_input(&A->B, &A->seeds, &A->seeds_len);
+    index_contigs(A);
+}
+
+
+void assembler_start_chunk(assembler_t* A)
+{
+    if (!A->assembly.running || --A->assembly_lag > 0) return;
+
+    background_join(&A->assembly);
+    if (A->store_contigs) seqenc_encode_supercontig(A->seqenc, A->supercontig);
+    seqenc_set_supercontig(A->seqenc, A->supercontig);
+}
+
+
+void assembler_set_n_qual(assembler_t* A, char n_qual)
+{
+    seqenc_encode_n_qual(A->seqenc, (uint8_t) n_qual);
+}
+
+
+void assembler_set_copy_count(assembler_t* A, uint32_t n)
+{
+    seqenc_encode_copy_count(A->seqenc, n);
+}
+
+
+void assembler_add_copy(assembler_t* A, uint32_t skip, uint32_t back, uint32_t offset)
+{
+    seqenc_encode_copy(A->seqenc, skip, back, offset);
+}
+
+
+void assembler_add_read_order(assembler_t* A, bool same, uint32_t x)
+{
+    seqenc_encode_read_order(A->seqenc, same, x);
 }
 
 
@@ -443,16 +658,39 @@ void assembler_add_seq(assembler_t* A, const short_read_t* seq)
 {
     A->stat_n++;
 
-    seqenc_encode_extras(A->seqenc, seq, A->quip_version);
+    if (A->quip_version < 5) seqenc_encode_extras(A->seqenc, seq);
 
-    if (A->ref != NULL && (seq->flags & BAM_FUNMAP) == 0) {
+    /* An aligned read with its sequence omitted is coded as empty. */
+    if (A->ref != NULL && (seq->flags & BAM_FUNMAP) == 0 && seq->seq.n > 0) {
         seqenc_encode_reference_alignment(A->seqenc, seq);
         A->stat_aligned_count++;
         return;
     }
 
+    bool dup = seqenc_encode_dup(A->seqenc, seq->seq.s, seq->seq.n);
+    if (dup) A->stat_dup_count++;
+
+    if (!dup && A->ref != NULL && A->quip_version >= 5) {
+        if (!A->refindex_built) {
+            A->refindex = refindex_alloc(A->ref);
+            A->refindex_built = true;
+        }
+
+        uint32_t seq_idx = 0, pos = 0;
+        uint8_t strand = 0;
+        bool mapped = A->refindex != NULL &&
+                      refindex_map(A->refindex, seq->seq.s, seq->seq.n,
+                                   &seq_idx, &pos, &strand);
+
+        seqenc_encode_ref_mapping(A->seqenc, seq, mapped, seq_idx, pos, strand);
+        if (mapped) {
+            A->stat_mapped_count++;
+            return;
+        }
+    }
+
     if (!A->assemble) {
-        seqenc_encode_char_seq(A->seqenc, seq->seq.s, seq->seq.n);
+        if (!dup) seqenc_encode_char_seq(A->seqenc, seq->seq.s, seq->seq.n);
     }
     else if (A->assembly_pending_n > 0) {
         twobit_copy_str_n(A->x, (char*) seq->seq.s, seq->seq.n);
@@ -465,37 +703,42 @@ void assembler_add_seq(assembler_t* A, const short_read_t* seq)
         }
 
         count_kmers(A->B, A->x);
-        seqenc_encode_twobit_seq(A->seqenc, seq->seq.s, A->x);
+        if (!dup) seqenc_encode_twobit_seq(A->seqenc, seq->seq.s, A->x);
         --A->assembly_pending_n;
 
         if (A->assembly_pending_n == 0) {
-            make_contigs(A->quip_version, &A->supercontig, &A->supercontig_rc,
-                         A->B, A->seeds, A->seeds_len);
-
-            /* Free up memory we won't need any more */
-            bloom_free(A->B);
-            A->B = NULL;
-
-            size_t i;
-            for (i = 0; i < A->seeds_len; ++i) {
-                twobit_free(A->seeds[i]);
+            if (A->quip_version >= 5) {
+                background_start(&A->assembly, assemble, A);
+                A->assembly_lag = assembly_lag_chunks();
+            }
+            else {
+                assemble(A);
+                seqenc_set_supercontig(A->seqenc, A->supercontig);
             }
-            free(A->seeds);
-            A->seeds = 0;
-            A->seeds_len = 0;
-
-            seqenc_set_supercontig(A->seqenc, A->supercontig);
-
-            index_contigs(A);
         }
     }
-    else {
+    else if (A->assembly.running) {
+        if (!dup) seqenc_encode_char_seq(A->seqenc, seq->seq.s, seq->seq.n);
+    }
+    else if (!dup) {
         twobit_copy_str_n(A->x, (char*) seq->seq.s, seq->seq.n);
         if (align_read(A, seq->seq.s, A->x)) A->stat_assemble_count++;
     }
 }
 
 
+void assembler_add_alignment(assembler_t* A, const short_read_t* seq)
+{
+    seqenc_encode_extras(A->seqenc, seq);
+}
+
+
+void assembler_end_chunk(assembler_t* A)
+{
+    seqenc_encode_end_chunk(A->seqenc);
+}
+
+
 size_t assembler_finish(assembler_t* A)
 {
     size_t bytes = seqenc_finish(A->seqenc);
@@ -514,11 +757,17 @@ size_t assembler_finish(assembler_t* A)
             100.0 * (double) A->stat_aligned_count / (double) A->stat_n);
         fprintf(stderr, "%2.1f%% aligned to assembled contigs.\n",
             100.0 * (double) A->stat_assemble_count / (double) A->stat_n);
+        fprintf(stderr, "%2.1f%% exact duplicates of recent reads.\n",
+            100.0 * (double) A->stat_dup_count / (double) A->stat_n);
+        fprintf(stderr, "%2.1f%% unaligned reads mapped to reference.\n",
+            100.0 * (double) A->stat_mapped_count / (double) A->stat_n);
     }
 
     A->stat_n = 0;
     A->stat_aligned_count = 0;
     A->stat_assemble_count = 0;
+    A->stat_dup_count = 0;
+    A->stat_mapped_count = 0;
 
     return bytes;
 }
@@ -530,11 +779,26 @@ void assembler_flush(assembler_t* A)
 }
 
 
+size_t assembler_finish_alignments(assembler_t* A)
+{
+    return seqenc_finish_alignments(A->seqenc);
+}
+
+
+void assembler_flush_alignments(assembler_t* A)
+{
+    seqenc_flush_alignments(A->seqenc);
+}
+
+
 struct disassembler_t_
 {
     /* actually assemble something */
     bool assemble;
 
+    /* contigs are read from the stream rather than assembled */
+    bool stored_contigs;
+
     /* quip header version used during compression */
     uint8_t quip_version;
 
@@ -545,9 +809,8 @@ struct disassembler_t_
     /* nucleotide sequence encoder */
     seqenc_t* seqenc;
 
-    /* assembled contigs and their reverse complements */
+    /* assembled contigs */
     twobit_t* supercontig;
-    twobit_t* supercontig_rc;
 
     /* candidate seeds */
     twobit_t** seeds;
@@ -565,35 +828,57 @@ struct disassembler_t_
     /* Number of reads before assembly is triggered. */
     size_t assembly_pending_n;
 
-    /* Initial state. */
+    /* contigs made in the background, as by the assembler */
+    background_t assembly;
+
+    /* set once the assembled reads are all read, until contigs are in use */
+    bool contigs_pending;
+
+    /* chunks left to start before contigs are used, as by the assembler */
+    size_t assembly_lag;
+
+    /* Initial state, of the sequence and alignment streams, resp. */
     bool initial_state;
+    bool aln_initial_state;
 };
 
 
 disassembler_t* disassembler_alloc(
     quip_reader_t reader,
     void* reader_data,
+    quip_reader_t aln_reader,
+    void* aln_reader_data,
     bool assemble,
+    bool stored_contigs,
     uint8_t quip_version,
-    const seqmap_t* ref)
+    const seqenc_params_t* seq_params,
+    const seqmap_t* ref,
+    const bam_header_t* header)
 {
     disassembler_t* D = malloc_or_die(sizeof(disassembler_t));
     memset(D, 0, sizeof(disassembler_t));
 
-    D->seqenc = seqenc_alloc_decoder(reader, reader_data, ref);
+    D->seqenc = seqenc_alloc_decoder(reader, reader_data,
+                                     aln_reader, aln_reader_data, quip_version,
+                                     seq_params, ref, header);
     D->reader = reader;
     D->reader_data = reader_data;
     D->ref = ref;
     D->assemble = assemble;
+    D->stored_contigs = stored_contigs;
     D->quip_version = quip_version;
     D->initial_state = true;
+    D->aln_initial_state = true;
 
-    if (assemble) {
+    if (assemble && stored_contigs) {
+        D->assembly_pending_n = quip_assembly_n;
+    }
+    else if (assemble) {
         D->seeds = malloc_or_die(seeds_n * sizeof(twobit_t*));
         memset(D->seeds, 0, seeds_n * sizeof(twobit_t*));
         D->seeds_len = 0;
 
-        D->B = bloom_alloc(bloom_n, bloom_m);
+        D->B = alloc_bloom(quip_version);
         D->x = twobit_alloc();
         D->assembly_pending_n = quip_assembly_n;
     }
@@ -606,6 +891,8 @@ void disassembler_free(disassembler_t* D)
 {
     if (D == NULL) return;
 
+    background_join(&D->assembly);
+
     size_t i;
     for (i = 0; i < D->seeds_len; ++i) {
         twobit_free(D->seeds[i]);
@@ -616,22 +903,96 @@ void disassembler_free(disassembler_t* D)
     bloom_free(D->B);
     twobit_free(D->x);
     twobit_free(D->supercontig);
-    twobit_free(D->supercontig_rc);
     free(D);
 }
 
-void disassembler_read(disassembler_t* D, short_read_t* seq, size_t n)
+static void disassembler_start(disassembler_t* D)
 {
     if (D->initial_state) {
         seqenc_start_decoder(D->seqenc);
         D->initial_state = false;
     }
+}
+
 
-    seqenc_decode_extras(D->seqenc, seq, n, D->quip_version);
-    seqenc_decode(D->seqenc, seq, n);
+/* Make contigs from the reads counted so far. */
+static void disassemble(void* arg)
+{
+    disassembler_t* D = (disassembler_t*) arg;
 
-    if (D->assembly_pending_n > 0 &&
-        (D->ref == NULL || seq->flags & BAM_FUNMAP) != 0) {
+    make_contigs(D->quip_version, &D->supercontig,
+                 D->B, D->seeds, D->seeds_len);
+    free_assembly_input(&D->B, &D->seeds, &D->seeds_len);
+}
+
+
+void disassembler_start_chunk(disassembler_t* D)
+{
+    if (!D->contigs_pending || --D->assembly_lag > 0) return;
+
+    disassembler_start(D);
+    if (D->stored_contigs) D->supercontig = seqenc_decode_supercontig(D->seqenc);
+    else                   background_join(&D->assembly);
+
+    seqenc_set_supercontig(D->seqenc, D->supercontig);
+    D->contigs_pending = false;
+}
+
+
+char disassembler_read_n_qual(disassembler_t* D)
+{
+    disassembler_start(D);
+    return (char) seqenc_decode_n_qual(D->seqenc);
+}
+
+
+uint32_t disassembler_read_copy_count(disassembler_t* D)
+{
+    disassembler_start(D);
+    return seqenc_decode_copy_count(D->seqenc);
+}
+
+
+void disassembler_read_copy(disassembler_t* D, uint32_t* skip, uint32_t* back,
+                            uint32_t* offset)
+{
+    disassembler_start(D);
+    seqenc_decode_copy(D->seqenc, skip, back, offset);
+}
+
+
+void disassembler_read_read_order(disassembler_t* D, bool* same, uint32_t* x)
+{
+    disassembler_start(D);
+    seqenc_decode_read_order(D->seqenc, same, x);
+}
+
+
+void disassembler_read_alignment(disassembler_t* D, short_read_t* seq, size_t n)
+{
+    if (D->aln_initial_state) {
+        seqenc_start_alignment_decoder(D->seqenc);
+        D->aln_initial_state = false;
+    }
+
+    seqenc_decode_extras(D->seqenc, seq, n);
+}
+
+
+void disassembler_read(disassembler_t* D, short_read_t* seq, size_t n)
+{
+    disassembler_start(D);
+
+    if (D->quip_version < 5) seqenc_decode_extras(D->seqenc, seq, n);
+    bool from_ref = seqenc_decode(D->seqenc, seq, n);
+
+    if (D->assembly_pending_n > 0 && !from_ref && D->stored_contigs) {
+        if (--D->assembly_pending_n == 0) {
+            D->contigs_pending = true;
+            D->assembly_lag = assembly_lag_chunks();
+        }
+    }
+    else if (D->assembly_pending_n > 0 && !from_ref) {
         twobit_copy_str_n(D->x, (char*) seq->seq.s, seq->seq.n);
 
         if (D->assembly_pending_n <= seeds_n - D->seeds_len) {
@@ -645,29 +1006,29 @@ void disassembler_read(disassembler_t* D, short_read_t* seq, size_t n)
         --D->assembly_pending_n;
 
         if (D->assembly_pending_n == 0) {
-            make_contigs(D->quip_version, &D->supercontig, &D->supercontig_rc,
-                         D->B, D->seeds, D->seeds_len);
-
-            /* Free up memory we won't need any more */
-            bloom_free(D->B);
-            D->B = NULL;
-
-            size_t i;
-            for (i = 0; i < D->seeds_len; ++i) {
-                twobit_free(D->seeds[i]);
+            if (D->quip_version >= 5) {
+                background_start(&D->assembly, disassemble, D);
+                D->contigs_pending = true;
+                D->assembly_lag = assembly_lag_chunks();
+            }
+            else {
+                disassemble(D);
+                seqenc_set_supercontig(D->seqenc, D->supercontig);
             }
-            free(D->seeds);
-            D->seeds = 0;
-            D->seeds_len = 0;
-
-            seqenc_set_supercontig(D->seqenc, D->supercontig);
         }
     }
 }
 
+void disassembler_end_chunk(disassembler_t* D)
+{
+    seqenc_decode_end_chunk(D->seqenc);
+}
+
+
 void disassembler_reset(disassembler_t* D)
 {
     seqenc_reset_decoder(D->seqenc);
     D->initial_state = true;
+    D->aln_initial_state = true;
 }
 
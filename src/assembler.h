@@ -17,6 +17,7 @@
 #define QUIP_ASSEMBLER
 
 #include "quip.h"
+#include "seqenc.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -28,17 +29,50 @@ assembler_t* assembler_alloc(
         quip_writer_t   writer,
         void*           writer_data,
         bool            assemble,
+        bool            store_contigs,
         uint8_t         quip_version,
-        const seqmap_t* ref);
+        const seqenc_params_t* seq_params,
+        const seqmap_t* ref,
+        const bam_header_t* header);
 
 void assembler_free(assembler_t*);
 
 void assembler_clear_contigs(assembler_t*);
 
+/* Called at the start of each chunk, before anything else. Contigs assembled
+ * in the background are used from a fixed number of chunks after the last
+ * read assembled, waiting for them if they are not yet made. */
+void   assembler_start_chunk(assembler_t*);
+
+/* Called at the start of each chunk with the quality score carried by every
+ * N in it, or 0 if N positions should be coded. */
+void   assembler_set_n_qual(assembler_t*, char n_qual);
+
+/* Called next, for SAM/BAM input, with the number of reads in the chunk that
+ * are copies of primary alignments, then for each of them, as by
+ * seqenc_encode_copy. */
+void   assembler_set_copy_count(assembler_t*, uint32_t n);
+void   assembler_add_copy(assembler_t*, uint32_t skip, uint32_t back, uint32_t offset);
+
+/* Called next, for reads reordered to be restored, for each read of the
+ * chunk, as by seqenc_encode_read_order. */
+void   assembler_add_read_order(assembler_t*, bool same, uint32_t x);
+
 void   assembler_add_seq(assembler_t*, const short_read_t* seq);
+
+/* Since version 5, the alignment of each read is coded separately from its
+ * sequence, to a stream of its own, possibly concurrently. */
+void   assembler_add_alignment(assembler_t*, const short_read_t* seq);
+
+/* Called at the end of each chunk. */
+void   assembler_end_chunk(assembler_t*);
+
 size_t assembler_finish(assembler_t* A);
 void   assembler_flush(assembler_t* A);
 
+size_t assembler_finish_alignments(assembler_t* A);
+void   assembler_flush_alignments(assembler_t* A);
+
 
 /* disassemble */
 typedef struct disassembler_t_ disassembler_t;
@@ -46,13 +80,42 @@ typedef struct disassembler_t_ disassembler_t;
 disassembler_t* disassembler_alloc(
     quip_reader_t reader,
     void* reader_data,
+    quip_reader_t aln_reader,
+    void* aln_reader_data,
     bool  assemble,
+    bool  stored_contigs,
     uint8_t quip_version,
-    const seqmap_t* ref);
+    const seqenc_params_t* seq_params,
+    const seqmap_t* ref,
+    const bam_header_t* header);
 
 void disassembler_free(disassembler_t*);
 
+/* Called at the start of each chunk, waiting, if the assembler began using
+ * contigs with this chunk, for the same contigs to be read or made. */
+void disassembler_start_chunk(disassembler_t*);
+
+/* Read the value given to assembler_set_n_qual for the next chunk. */
+char disassembler_read_n_qual(disassembler_t*);
+
+/* Read the values given to assembler_set_copy_count and assembler_add_copy. */
+uint32_t disassembler_read_copy_count(disassembler_t*);
+void     disassembler_read_copy(disassembler_t*, uint32_t* skip, uint32_t* back,
+                                uint32_t* offset);
+
+/* Read a value given to assembler_add_read_order. */
+void disassembler_read_read_order(disassembler_t*, bool* same, uint32_t* x);
+
 void disassembler_read(disassembler_t*, short_read_t* x, size_t n);
+
+/* Read the alignment given to assembler_add_alignment. When there is a
+ * reference, this must precede reading the sequence. */
+void disassembler_read_alignment(disassembler_t*, short_read_t* x, size_t n);
+
+/* Called at the end of each chunk, after which every read's sequence is
+ * complete. Until then, reads passed to disassembler_read must remain
+ * valid. */
+void disassembler_end_chunk(disassembler_t*);
 void disassembler_reset(disassembler_t*);
 
 
@@ -1,7 +1,9 @@
 
 #include "bloom.h"
 #include "misc.h"
+#include "quip.h"
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 
 
@@ -16,6 +18,14 @@ static const size_t   counter_bits     = 10;
 static const uint32_t counter_mask     = 0x0003ff;
 static const size_t   cell_bytes       = 3;
 
+/* In the blocked layout, all the cells a k-mer may occupy are in one block,
+ * the size of a cache line. */
+#define BLOCK_BYTES 64
+static const size_t block_cells = BLOCK_BYTES / 3; /* of cell_bytes each */
+
+/* k-mers queued across all shards before they are added */
+static const size_t queue_max = 1 << 22;
+
 
 static uint32_t get_cell_count(uint8_t* c)
 {
@@ -23,51 +33,135 @@ static uint32_t get_cell_count(uint8_t* c)
 }
 
 
-static void set_cell_count(uint8_t* c, uint32_t cnt)
+/* Cells are read and written as 32-bit integers, the high byte of which is
+ * the first of the next cell. Only bits in keep_mask of it are kept. */
+static void set_cell_count(uint8_t* c, uint32_t cnt, uint32_t keep_mask)
 {
-    (*(uint32_t*) c) = ((*(uint32_t*) c) & fingerprint_mask) | (cnt & counter_mask);
+    (*(uint32_t*) c) = ((*(uint32_t*) c) & (fingerprint_mask | keep_mask)) |
+                       (cnt & counter_mask);
 }
 
 
+/* hashes of k-mers waiting to be added to one shard */
+typedef struct queue_t_
+{
+    uint64_t* hs;
+    size_t n, size;
+} queue_t;
+
+
 struct bloom_t_
 {
+    /* the table, aligned to BLOCK_BYTES within the allocation mem */
     uint8_t* T;
+    uint8_t* mem;
+    size_t bytes;
 
-    /* pointers into T, to save a little computation */
-    uint8_t* subtable[NUM_SUBTABLES];
+    /* If true, each shard is an array of n blocks, one of which, chosen by
+     * multiply-shift, holds a k-mer. Otherwise a k-mer may be in any of
+     * NUM_SUBTABLES buckets, one in each subtable of its shard. */
+    bool blocked;
 
-    /* number of buckets per subtable */
+    /* number of buckets per subtable, or blocks, in each shard */
     size_t n;
 
-    /* number of cells per bucket */
+    /* number of cells per bucket or block */
     size_t m;
+
+    /* Bits of the next cell preserved when writing one. Before version 5,
+     * writes cleared the low byte of the next cell's count, which must be
+     * repeated to make the same contigs, but the blocked layout, in which
+     * cells are more often adjacent, preserves it. */
+    uint32_t keep_mask;
+
+    /* Shards are selected by the top shard_bits bits of a k-mer's hash, and
+     * are disjoint parts of the table, so that they can be updated
+     * concurrently. */
+    size_t shard_bits;
+    size_t shard_bytes;
+    size_t subtable_bytes;
+
+    /* k-mers queued by bloom_push, by shard */
+    queue_t* queues;
+    size_t queued;
 };
 
 
 
-bloom_t* bloom_alloc(size_t n, size_t m)
+static bloom_t* alloc_shards(size_t shards)
+{
+    bloom_t* B = malloc_or_die(sizeof(bloom_t));
+
+    B->shard_bits = 0;
+    while (((size_t) 1 << B->shard_bits) < shards) ++B->shard_bits;
+    shards = (size_t) 1 << B->shard_bits;
+
+    B->queues = malloc_or_die(shards * sizeof(queue_t));
+    memset(B->queues, 0, shards * sizeof(queue_t));
+    B->queued = 0;
+
+    return B;
+}
+
+
+/* Allocate the table, once the shard size is known. Reading a cell as a
+ * 32-bit integer may touch the byte after the last, so that is allocated
+ * as well, mainly so valgrind doesn't whine. */
+static void alloc_table(bloom_t* B)
 {
-    bloom_t* B = malloc(sizeof(bloom_t));
-    B->n = n;
+    B->bytes = ((size_t) 1 << B->shard_bits) * B->shard_bytes;
+    B->mem = malloc_or_die(B->bytes + BLOCK_BYTES);
+    memset(B->mem, 0, B->bytes + BLOCK_BYTES);
+
+    B->T = B->mem + (BLOCK_BYTES - (uintptr_t) B->mem % BLOCK_BYTES) % BLOCK_BYTES;
+}
+
+
+bloom_t* bloom_alloc(size_t n, size_t m, size_t shards)
+{
+    bloom_t* B = alloc_shards(shards);
+    B->blocked = false;
+    B->keep_mask = 0;
     B->m = m;
+    B->n = n >> B->shard_bits;
+    B->subtable_bytes = B->n * B->m * cell_bytes;
+    B->shard_bytes = NUM_SUBTABLES * B->subtable_bytes;
+    alloc_table(B);
 
-    /* the '(. / 4 + 1) * 4' is to make sure things are aligned up to 32-bit
-     * integers, mainly so valgrind doesn't whine. */
-    B->T = malloc_or_die(((NUM_SUBTABLES * n * m * cell_bytes) / 4 + 1) * 4);
-    memset(B->T, 0, ((NUM_SUBTABLES * n * m * cell_bytes) / 4 + 1) * 4);
+    return B;
+}
 
-    size_t i;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        B->subtable[i] = B->T + i * B->n * B->m * cell_bytes;
-    }
+
+bloom_t* bloom_alloc_blocked(size_t bytes, size_t shards)
+{
+    bloom_t* B = alloc_shards(shards);
+    B->blocked = true;
+    B->keep_mask = 0xff000000;
+    B->m = block_cells;
+    B->n = (bytes / BLOCK_BYTES) >> B->shard_bits;
+    if (B->n == 0) B->n = 1;
+    B->subtable_bytes = B->n * BLOCK_BYTES;
+    B->shard_bytes = B->subtable_bytes;
+    alloc_table(B);
 
     return B;
 }
 
 
+size_t bloom_size(const bloom_t* B)
+{
+    return B->bytes;
+}
+
+
 void bloom_clear(bloom_t* B)
 {
-    memset(B->T, 0, ((NUM_SUBTABLES * B->n * B->m * cell_bytes) / 4 + 1) * 4);
+    size_t shards = (size_t) 1 << B->shard_bits;
+    memset(B->T, 0, B->bytes);
+
+    size_t i;
+    for (i = 0; i < shards; ++i) B->queues[i].n = 0;
+    B->queued = 0;
 }
 
 
@@ -75,39 +169,87 @@ void bloom_free(bloom_t* B)
 {
     if (B == NULL) return;
 
-    free(B->T);
+    size_t i;
+    for (i = 0; i < ((size_t) 1 << B->shard_bits); ++i) {
+        free(B->queues[i].hs);
+    }
+    free(B->queues);
+    free(B->mem);
     free(B);
 }
 
 
+static size_t get_shard(const bloom_t* B, uint64_t h0)
+{
+    return B->shard_bits == 0 ? 0 : h0 >> (64 - B->shard_bits);
+}
+
 
-unsigned int bloom_get(bloom_t* B, kmer_t x)
+/* Find the buckets of B->m cells each that may hold the k-mer with hash h0,
+ * returning how many there are. */
+static size_t get_buckets(const bloom_t* B, uint64_t h0, uint8_t** buckets)
 {
-    const size_t bytes_per_bucket = B->m * cell_bytes;
+    uint8_t* shard = B->T + get_shard(B, h0) * B->shard_bytes;
 
-    uint64_t h1, h0 = kmer_hash(x);
-    uint32_t fp = h0 & (uint64_t) fingerprint_mask;
-    uint64_t hs[NUM_SUBTABLES];
+    /* the block is chosen by bits above the fingerprint and below those
+     * choosing the shard */
+    if (B->blocked) {
+        buckets[0] = shard +
+            (((h0 >> 24) & 0xffffffff) * B->n >> 32) * BLOCK_BYTES;
+        return 1;
+    }
 
-    h1 = h0;
+    const size_t bytes_per_bucket = B->m * cell_bytes;
+    uint64_t h1 = h0;
     size_t i;
     for (i = 0; i < NUM_SUBTABLES; ++i) {
-        h1 = hs[i] = kmer_hash_mix(h0, h1);
-        hs[i] = (hs[i] % B->n) * bytes_per_bucket;
-        prefetch(B->subtable[i] + hs[i], 0, 0);
+        h1 = kmer_hash_mix(h0, h1);
+        buckets[i] = shard + i * B->subtable_bytes + (h1 % B->n) * bytes_per_bucket;
     }
 
+    return NUM_SUBTABLES;
+}
+
+
+/* The fingerprint of a k-mer and the buckets that may hold it, computed from
+ * its hash before any of them is read. */
+typedef struct probe_t_
+{
+    uint32_t fp;
+    size_t nb;
+    uint8_t* buckets[NUM_SUBTABLES];
+} probe_t;
+
+
+/* Number of k-mers probed together by the batched operations: all their
+ * buckets are prefetched before the first is read, so that the misses
+ * overlap. */
+#define PROBE_BATCH 32
+
+
+static void get_probe(const bloom_t* B, uint64_t h0, probe_t* p)
+{
+    p->fp = h0 & (uint64_t) fingerprint_mask;
+    p->nb = get_buckets(B, h0, p->buckets);
+}
+
+
+static unsigned int probe_get(const bloom_t* B, const probe_t* p)
+{
+    const size_t bytes_per_bucket = B->m * cell_bytes;
+
+    size_t i;
     uint8_t* c;
     uint8_t* c_end;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
+    for (i = 0; i < p->nb; ++i) {
 
         /* get bucket offset */
-        c = B->subtable[i] + hs[i];
+        c = p->buckets[i];
         c_end = c + bytes_per_bucket;
 
         /* scan through cells */
         while (c < c_end) {
-            if (((*(uint32_t*) c) & fingerprint_mask) == fp) {
+            if (((*(uint32_t*) c) & fingerprint_mask) == p->fp) {
                 return get_cell_count(c);
             }
 
@@ -119,40 +261,58 @@ unsigned int bloom_get(bloom_t* B, kmer_t x)
 }
 
 
-void bloom_ldec(bloom_t* B, kmer_t x)
+unsigned int bloom_get(bloom_t* B, kmer_t x)
 {
-    const size_t bytes_per_bucket = B->m * cell_bytes;
-
-    uint64_t h1, h0 = kmer_hash(x);
-    uint32_t fp = h0 & (uint64_t) fingerprint_mask;
-    uint64_t hs[NUM_SUBTABLES];
+    probe_t p;
+    get_probe(B, kmer_hash(x), &p);
 
-    h1 = h0;
     size_t i;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        h1 = hs[i] = kmer_hash_mix(h0, h1);
-        hs[i] = (hs[i] % B->n) * bytes_per_bucket;
-        prefetch(B->subtable[i] + hs[i], 1, 0);
+    for (i = 0; i < p.nb; ++i) prefetch(p.buckets[i], 0, 0);
+
+    return probe_get(B, &p);
+}
+
+
+void bloom_get_many(bloom_t* B, const kmer_t* xs, unsigned int* cnts, size_t n)
+{
+    probe_t ps[PROBE_BATCH];
+    size_t i, j, k, m;
+    for (i = 0; i < n; i += m) {
+        m = n - i < PROBE_BATCH ? n - i : PROBE_BATCH;
+
+        for (j = 0; j < m; ++j) {
+            get_probe(B, kmer_hash(xs[i + j]), &ps[j]);
+            for (k = 0; k < ps[j].nb; ++k) prefetch(ps[j].buckets[k], 0, 0);
+        }
+
+        for (j = 0; j < m; ++j) cnts[i + j] = probe_get(B, &ps[j]);
     }
+}
 
+
+static void probe_ldec(bloom_t* B, const probe_t* p)
+{
+    const size_t bytes_per_bucket = B->m * cell_bytes;
+
+    size_t i;
     uint32_t cnt;
     uint8_t* c;
     uint8_t* c_end;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
+    for (i = 0; i < p->nb; ++i) {
         /* get bucket offset */
-        c = B->subtable[i] + hs[i];
+        c = p->buckets[i];
         c_end = c + bytes_per_bucket;
 
         /* scan through cells */
         while (c < c_end) {
-            if (((*(uint32_t*) c) & fingerprint_mask) == fp) {
+            if (((*(uint32_t*) c) & fingerprint_mask) == p->fp) {
                 cnt = get_cell_count(c);
 
                 if (cnt <= 1) {
                     (*(uint32_t*) c) &= ~(fingerprint_mask | counter_mask);
                 }
                 else {
-                    set_cell_count(c, cnt / 2);
+                    set_cell_count(c, cnt / 2, B->keep_mask);
                 }
                 return;
             }
@@ -163,32 +323,55 @@ void bloom_ldec(bloom_t* B, kmer_t x)
 }
 
 
+void bloom_ldec(bloom_t* B, kmer_t x)
+{
+    probe_t p;
+    get_probe(B, kmer_hash(x), &p);
+
+    size_t i;
+    for (i = 0; i < p.nb; ++i) prefetch(p.buckets[i], 1, 0);
+
+    probe_ldec(B, &p);
+}
+
+
+void bloom_ldec_many(bloom_t* B, const kmer_t* xs, size_t n)
+{
+    probe_t ps[PROBE_BATCH];
+    size_t i, j, k, m;
+    for (i = 0; i < n; i += m) {
+        m = n - i < PROBE_BATCH ? n - i : PROBE_BATCH;
+
+        for (j = 0; j < m; ++j) {
+            get_probe(B, kmer_hash(xs[i + j]), &ps[j]);
+            for (k = 0; k < ps[j].nb; ++k) prefetch(ps[j].buckets[k], 1, 0);
+        }
+
+        for (j = 0; j < m; ++j) probe_ldec(B, &ps[j]);
+    }
+}
+
+
 void bloom_del(bloom_t* B, kmer_t x)
 {
     const size_t bytes_per_bucket = B->m * cell_bytes;
 
-    uint64_t h1, h0 = kmer_hash(x);
-    uint32_t fp = h0 & (uint64_t) fingerprint_mask;
-    uint64_t hs[NUM_SUBTABLES];
+    probe_t p;
+    get_probe(B, kmer_hash(x), &p);
 
-    h1 = h0;
     size_t i;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        h1 = hs[i] = kmer_hash_mix(h0, h1);
-        hs[i] = (hs[i] % B->n) * bytes_per_bucket;
-        prefetch(B->subtable[i] + hs[i], 1, 0);
-    }
+    for (i = 0; i < p.nb; ++i) prefetch(p.buckets[i], 1, 0);
 
     uint8_t* c;
     uint8_t* c_end;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
+    for (i = 0; i < p.nb; ++i) {
         /* get bucket offset */
-        c = B->subtable[i] + hs[i];
+        c = p.buckets[i];
         c_end = c + bytes_per_bucket;
 
         /* scan through cells */
         while (c < c_end) {
-            if (((*(uint32_t*) c) & fingerprint_mask) == fp) {
+            if (((*(uint32_t*) c) & fingerprint_mask) == p.fp) {
                 (*(uint32_t*) c) &= ~(fingerprint_mask | counter_mask);
                 return;
             }
@@ -199,30 +382,12 @@ void bloom_del(bloom_t* B, kmer_t x)
 }
 
 
-unsigned int bloom_inc(bloom_t* B, kmer_t x)
-{
-    return bloom_add(B, x, 1);
-}
-
-
-unsigned int bloom_add(bloom_t* B, kmer_t x, unsigned int d)
+/* Add d to the count of a probed k-mer. */
+static unsigned int probe_add(bloom_t* B, const probe_t* p, unsigned int d)
 {
     const size_t bytes_per_bucket = B->m * cell_bytes;
-
-    uint64_t h1, h0 = kmer_hash(x);
-
-    /* compute all the hashes up front, this given an opportunity
-     * to prefetch and hopefully avoid a few cache misses. */
-    uint32_t fp = h0 & (uint64_t) fingerprint_mask;
-    uint64_t hs[NUM_SUBTABLES];
-
-    h1 = h0;
-    size_t i;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
-        h1 = hs[i] = kmer_hash_mix(h0, h1);
-        hs[i] = (hs[i] % B->n) * bytes_per_bucket;
-        prefetch(B->subtable[i] + hs[i], 1, 0);
-    }
+    const size_t nb = p->nb;
+    const uint32_t fp = p->fp;
 
     uint32_t g;
     uint32_t cnt;
@@ -230,11 +395,12 @@ unsigned int bloom_add(bloom_t* B, kmer_t x, unsigned int d)
     uint8_t* cells[NUM_SUBTABLES];
     size_t bucket_sizes[NUM_SUBTABLES];
 
+    size_t i;
     uint8_t *c0, *c, *c_end;
-    for (i = 0; i < NUM_SUBTABLES; ++i) {
+    for (i = 0; i < nb; ++i) {
 
         /* get bucket offset */
-        c0 = c = B->subtable[i] + hs[i];
+        c0 = c = p->buckets[i];
         c_end = c + bytes_per_bucket;
 
         /* scan through cells */
@@ -243,8 +409,8 @@ unsigned int bloom_add(bloom_t* B, kmer_t x, unsigned int d)
 
             if (g == fp) {
                 cnt = get_cell_count(c);
-                if (cnt + d < counter_mask) set_cell_count(c, cnt + d);
-                else set_cell_count(c, counter_mask);
+                if (cnt + d < counter_mask) set_cell_count(c, cnt + d, B->keep_mask);
+                else set_cell_count(c, counter_mask, B->keep_mask);
                 return cnt + d;
             }
             else if (g == 0) {
@@ -264,18 +430,19 @@ unsigned int bloom_add(bloom_t* B, kmer_t x, unsigned int d)
     }
 
     /* find the smallest bucket, breaking ties to the left */
-    size_t i_min = NUM_SUBTABLES;
+    size_t i_min = nb;
     size_t min_bucket_size = B->m;
-    for (i = 0; i < NUM_SUBTABLES && min_bucket_size > 0; ++i) {
+    for (i = 0; i < nb && min_bucket_size > 0; ++i) {
         if (bucket_sizes[i] < min_bucket_size) {
             i_min = i;
             min_bucket_size = bucket_sizes[i];
         }
     }
 
-    if (i_min < NUM_SUBTABLES) {
+    if (i_min < nb) {
         if (d > counter_mask) d = counter_mask;
-        (*(uint32_t*) cells[i_min]) = fp | d; // figngerprint & count
+        (*(uint32_t*) cells[i_min]) =
+            ((*(uint32_t*) cells[i_min]) & B->keep_mask) | fp | d; // figngerprint & count
         return 1;
     }
 
@@ -283,3 +450,130 @@ unsigned int bloom_add(bloom_t* B, kmer_t x, unsigned int d)
 }
 
 
+/* Add d to the count of the k-mer with hash h0. */
+static unsigned int add_hash(bloom_t* B, uint64_t h0, unsigned int d)
+{
+    probe_t p;
+    get_probe(B, h0, &p);
+
+    /* compute all the hashes up front, this given an opportunity
+     * to prefetch and hopefully avoid a few cache misses. */
+    size_t i;
+    for (i = 0; i < p.nb; ++i) prefetch(p.buckets[i], 1, 0);
+
+    return probe_add(B, &p, d);
+}
+
+
+/* Add one to the counts of the k-mers with the given hashes, in order. */
+static void add_hashes(bloom_t* B, const uint64_t* hs, size_t n)
+{
+    probe_t ps[PROBE_BATCH];
+    size_t i, j, k, m;
+    for (i = 0; i < n; i += m) {
+        m = n - i < PROBE_BATCH ? n - i : PROBE_BATCH;
+
+        for (j = 0; j < m; ++j) {
+            get_probe(B, hs[i + j], &ps[j]);
+            for (k = 0; k < ps[j].nb; ++k) prefetch(ps[j].buckets[k], 1, 0);
+        }
+
+        for (j = 0; j < m; ++j) probe_add(B, &ps[j], 1);
+    }
+}
+
+
+unsigned int bloom_inc(bloom_t* B, kmer_t x)
+{
+    return bloom_add(B, x, 1);
+}
+
+
+unsigned int bloom_add(bloom_t* B, kmer_t x, unsigned int d)
+{
+    return add_hash(B, kmer_hash(x), d);
+}
+
+
+void bloom_push(bloom_t* B, kmer_t x)
+{
+    uint64_t h0 = kmer_hash(x);
+    queue_t* q = &B->queues[get_shard(B, h0)];
+
+    if (q->n == q->size) {
+        q->size = q->size == 0 ? 1024 : 2 * q->size;
+        q->hs = realloc_or_die(q->hs, q->size * sizeof(uint64_t));
+    }
+    q->hs[q->n++] = h0;
+
+    if (++B->queued >= queue_max) bloom_flush(B);
+}
+
+
+typedef struct flush_worker_t_
+{
+    bloom_t* B;
+
+    /* shards first, first + step, first + 2 * step, ... */
+    size_t first, step;
+} flush_worker_t;
+
+
+static void* flush_worker(void* arg)
+{
+    flush_worker_t* w = (flush_worker_t*) arg;
+    bloom_t* B = w->B;
+
+    size_t shards = (size_t) 1 << B->shard_bits;
+    size_t i;
+    queue_t* q;
+    for (i = w->first; i < shards; i += w->step) {
+        q = &B->queues[i];
+        add_hashes(B, q->hs, q->n);
+        q->n = 0;
+    }
+
+    return NULL;
+}
+
+
+void bloom_flush(bloom_t* B)
+{
+    if (B->queued == 0) return;
+
+    size_t shards = (size_t) 1 << B->shard_bits;
+    size_t threads = quip_threads < shards ? quip_threads : shards;
+    if (threads == 0) threads = 1;
+
+    flush_worker_t* ws = malloc_or_die(threads * sizeof(flush_worker_t));
+    pthread_t* ts = malloc_or_die(threads * sizeof(pthread_t));
+
+    size_t i;
+    for (i = 0; i < threads; ++i) {
+        ws[i].B = B;
+        ws[i].first = i;
+        ws[i].step = threads;
+    }
+
+    /* the calling thread takes the first share of shards itself */
+    int ret;
+    for (i = 1; i < threads; ++i) {
+        ret = pthread_create(&ts[i], NULL, flush_worker, &ws[i]);
+        if (ret != 0) {
+            quip_error("pthread_create error: %s", strerror(ret));
+        }
+    }
+
+    flush_worker(&ws[0]);
+
+    for (i = 1; i < threads; ++i) {
+        ret = pthread_join(ts[i], NULL);
+        if (ret != 0) {
+            quip_error("pthread_join error: %s", strerror(ret));
+        }
+    }
+
+    free(ws);
+    free(ts);
+    B->queued = 0;
+}
@@ -27,9 +27,20 @@
 typedef struct bloom_t_ bloom_t;
 
 /* Allocate a new counting bloom filter, where n is the number of buckets per
- * table, and m is the number of cells per bucket.
+ * table, and m is the number of cells per bucket. The tables are split by hash
+ * into the given number of shards (rounded up to a power of two), each of
+ * which can be updated by a different thread.
  */
-bloom_t* bloom_alloc(size_t n, size_t m);
+bloom_t* bloom_alloc(size_t n, size_t m, size_t shards);
+
+/* Allocate a counting bloom filter of about the given number of bytes, in
+ * which all the cells a k-mer may occupy are in one cache line, so that each
+ * operation costs at most one miss. It is split into shards as above. */
+bloom_t* bloom_alloc_blocked(size_t bytes, size_t shards);
+
+/* Bytes used by the table. */
+size_t bloom_size(const bloom_t*);
+
 void     bloom_clear(bloom_t*);
 void     bloom_free(bloom_t*);
 
@@ -39,6 +50,20 @@ unsigned int bloom_add(bloom_t*, kmer_t, unsigned int d);
 unsigned int bloom_get(bloom_t*, kmer_t);
 void         bloom_del(bloom_t*, kmer_t);
 
+/* As bloom_get and bloom_ldec on each of n k-mers in turn, but hashing them
+ * and prefetching their buckets in batches, so that cache misses overlap. */
+void bloom_get_many(bloom_t*, const kmer_t* xs, unsigned int* cnts, size_t n);
+void bloom_ldec_many(bloom_t*, const kmer_t* xs, size_t n);
+
+/* Queue a k-mer to be counted, as by bloom_inc, before the next call to any
+ * of the functions above. Queued k-mers are counted by bloom_flush, which is
+ * also called when enough have been queued. */
+void bloom_push(bloom_t*, kmer_t);
+
+/* Count all queued k-mers, with up to quip_threads threads, each adding those
+ * of its own shards. The result is the same as adding them in order. */
+void bloom_flush(bloom_t*);
+
 #endif
 
 
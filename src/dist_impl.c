@@ -215,3 +215,15 @@ symb_t cdfun(decode)(ac_t* ac, cond_dist_t* D, uint32_t y)
 }
 
 
+void cdfun(prefetch)(const cond_dist_t* D, uint32_t y)
+{
+    const uint8_t* p   = (const uint8_t*) (D->xss + y);
+    const uint8_t* end = p + sizeof(dist_t);
+
+    /* round down to the start of a cache line */
+    p = (const uint8_t*) ((uintptr_t) p & ~(uintptr_t) 63);
+
+    for (; p < end; p += 64) prefetch(p, 1, 3);
+}
+
+
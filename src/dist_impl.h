@@ -70,3 +70,7 @@ void cdfun(setone) (cond_dist_t*, const uint16_t* cs, size_t i);
 void cdfun(encode)(ac_t* ac, cond_dist_t* D, uint32_t y, symb_t x);
 symb_t cdfun(decode)(ac_t* ac, cond_dist_t* D, uint32_t y);
 
+/* Hint that the distribution conditioned on y is about to be used, so that
+ * the cache lines it spans can be fetched ahead of time. */
+void cdfun(prefetch)(const cond_dist_t* D, uint32_t y);
+
@@ -182,3 +182,27 @@ uint64_t kmer_hash_mix(uint64_t h1, uint64_t h2)
 }
 
 
+uint64_t kmer_minimizer(const uint8_t* seq, size_t n, size_t k)
+{
+    if (n < k) return UINT64_MAX;
+
+    const size_t shift = 2 * (k - 1);
+    const kmer_t mask = k == 32 ? ~(kmer_t) 0 : ((kmer_t) 1 << (2 * k)) - 1;
+    kmer_t x = 0, y = 0, c;
+    uint64_t h, hmin = UINT64_MAX;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        c = chartokmer[seq[i]];
+        x = ((x << 2) | c) & mask;
+        y = (y >> 2) | ((3 - c) << shift);
+
+        if (i + 1 >= k) {
+            h = kmer_hash(x < y ? x : y);
+            if (h < hmin) hmin = h;
+        }
+    }
+
+    return hmin;
+}
+
+
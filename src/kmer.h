@@ -50,6 +50,10 @@ bool kmer_simple(kmer_t, size_t k);
 uint64_t kmer_hash(kmer_t);
 uint64_t kmer_hash_mix(uint64_t a, uint64_t b);
 
+/* The smallest hash of any canonical k-mer in a nucleotide string (mapped as
+ * by chartokmer), or UINT64_MAX if the string is shorter than k. */
+uint64_t kmer_minimizer(const uint8_t* seq, size_t n, size_t k);
+
 #endif
 
 
@@ -0,0 +1,135 @@
+
+#include "kmerindex.h"
+#include "misc.h"
+#include <string.h>
+
+
+/* a k-mer and one of its positions, as they are sorted */
+typedef struct entry_t_
+{
+    kmer_t     x;
+    kmer_pos_t pos;
+} entry_t;
+
+
+struct kmerindex_t_
+{
+    /* distinct k-mers, in increasing order */
+    kmer_t* keys;
+    size_t  n;
+
+    /* Positions of keys[i] are positions[starts[i]], ...,
+     * positions[starts[i + 1] - 1], in the order they were given. */
+    uint32_t*   starts;
+    kmer_pos_t* positions;
+
+    /* Keys whose leading bits, x >> shift, are b are keys[buckets[b]], ...,
+     * keys[buckets[b + 1] - 1]. */
+    uint32_t*    buckets;
+    unsigned int shift;
+};
+
+
+kmerindex_t* kmerindex_alloc(const kmer_t* xs, const kmer_pos_t* pos,
+                             size_t n, size_t k)
+{
+    kmerindex_t* I = malloc_or_die(sizeof(kmerindex_t));
+
+    entry_t* es  = malloc_or_die((n + 1) * sizeof(entry_t));
+    entry_t* tmp = malloc_or_die((n + 1) * sizeof(entry_t));
+    entry_t* t;
+
+    size_t i, j, c;
+    for (i = 0; i < n; ++i) {
+        es[i].x   = xs[i];
+        es[i].pos = pos[i];
+    }
+
+    /* Stable radix sort, a byte at a time from the least significant, so
+     * positions of equal k-mers stay in the order given. */
+    size_t counts[256];
+    unsigned int s;
+    for (s = 0; s < 2 * k; s += 8) {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < n; ++i) ++counts[(es[i].x >> s) & 0xff];
+
+        for (i = 0, j = 0; i < 256; ++i) {
+            c = counts[i];
+            counts[i] = j;
+            j += c;
+        }
+
+        for (i = 0; i < n; ++i) tmp[counts[(es[i].x >> s) & 0xff]++] = es[i];
+
+        t = es; es = tmp; tmp = t;
+    }
+    free(tmp);
+
+    I->n = 0;
+    for (i = 0; i < n; ++i) {
+        if (i == 0 || es[i].x != es[i - 1].x) ++I->n;
+    }
+
+    I->keys      = malloc_or_die((I->n + 1) * sizeof(kmer_t));
+    I->starts    = malloc_or_die((I->n + 1) * sizeof(uint32_t));
+    I->positions = malloc_or_die((n + 1) * sizeof(kmer_pos_t));
+
+    for (i = 0, j = 0; i < n; ++i) {
+        if (i == 0 || es[i].x != es[i - 1].x) {
+            I->keys[j] = es[i].x;
+            I->starts[j++] = i;
+        }
+        I->positions[i] = es[i].pos;
+    }
+    I->starts[I->n] = n;
+    free(es);
+
+    /* about one bucket for every two keys */
+    unsigned int bits = 1;
+    while (bits < 2 * k && ((size_t) 1 << bits) < I->n / 2) ++bits;
+    I->shift = 2 * k > bits ? 2 * k - bits : 0;
+
+    size_t bucket_count = (size_t) 1 << bits;
+    I->buckets = malloc_or_die((bucket_count + 1) * sizeof(uint32_t));
+    memset(I->buckets, 0, (bucket_count + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < I->n; ++i) I->buckets[(I->keys[i] >> I->shift) + 1]++;
+    for (i = 1; i <= bucket_count; ++i) I->buckets[i] += I->buckets[i - 1];
+
+    return I;
+}
+
+
+void kmerindex_free(kmerindex_t* I)
+{
+    if (I == NULL) return;
+
+    free(I->keys);
+    free(I->starts);
+    free(I->positions);
+    free(I->buckets);
+    free(I);
+}
+
+
+size_t kmerindex_size(const kmerindex_t* I)
+{
+    return I->n;
+}
+
+
+size_t kmerindex_get(const kmerindex_t* I, kmer_t x, const kmer_pos_t** pos)
+{
+    kmer_t b = x >> I->shift;
+    uint32_t i;
+    for (i = I->buckets[b]; i < I->buckets[b + 1]; ++i) {
+        if (I->keys[i] == x) {
+            *pos = I->positions + I->starts[i];
+            return I->starts[i + 1] - I->starts[i];
+        }
+        else if (I->keys[i] > x) break;
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,39 @@
+/*
+ * This file is part of quip.
+ *
+ * Copyright (c) 2012 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ */
+
+/*
+ * kmerindex :
+ * A static index of the positions of k-mers in a sequence set, built once
+ * and then only queried. Distinct k-mers are kept in sorted order, each with
+ * a run of positions in one flat array, and looked up by their leading bits.
+ *
+ */
+
+
+#ifndef QUIP_KMERINDEX
+#define QUIP_KMERINDEX
+
+#include "kmer.h"
+
+typedef struct kmerindex_t_ kmerindex_t;
+
+typedef int32_t kmer_pos_t;
+
+/* Index n k-mers, the i-th with position pos[i]. The positions of each k-mer
+ * are kept in the order given. */
+kmerindex_t* kmerindex_alloc(const kmer_t* xs, const kmer_pos_t* pos,
+                             size_t n, size_t k);
+void         kmerindex_free(kmerindex_t*);
+
+/* Number of distinct k-mers indexed. */
+size_t kmerindex_size(const kmerindex_t*);
+
+/* Set *pos to the positions of a k-mer, returning how many there are. */
+size_t kmerindex_get(const kmerindex_t*, kmer_t, const kmer_pos_t** pos);
+
+#endif
+
@@ -142,6 +142,8 @@ unsigned char complement(unsigned char c)
 
 void str_revcomp(unsigned char* seq, size_t n)
 {
+    if (n == 0) return;
+
     char c;
     size_t i, j;
     i = 0;
@@ -159,6 +161,8 @@ void str_revcomp(unsigned char* seq, size_t n)
 
 void str_rev(unsigned char* seq, size_t n)
 {
+    if (n == 0) return;
+
     char c;
     size_t i, j;
     i = 0;
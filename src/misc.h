@@ -26,6 +26,34 @@ FILE* fopen_or_die(const char*, const char*);
 #define prefetch(p, rw, locality)
 #endif
 
+/* Number of trailing zero bits in a nonzero 64-bit integer. */
+#if HAVE_CTZLL
+#define ctz64(x) __builtin_ctzll(x)
+#else
+static inline int ctz64(uint64_t x)
+{
+    int n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+}
+#endif
+
+/* Number of set bits in a 64-bit integer. */
+#if HAVE_POPCOUNTLL
+#define popcount64(x) __builtin_popcountll(x)
+#else
+static inline int popcount64(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+#endif
+
 #define UNUSED(x) (void)(x)
 
 /* Windows reads/writes in "text mode" by default. This is confusing
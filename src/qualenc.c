@@ -53,6 +53,10 @@ struct qualenc_t_
     ac_t* ac;
     cond_dist64_t cs;
     uint8_t base_qual;
+
+    /* context indexes of the read being encoded */
+    uint32_t* ctx;
+    size_t ctx_size;
 };
 
 
@@ -65,11 +69,29 @@ struct qualenc_t_
         (q1))
 
 
+/* How many symbols ahead the encoder prefetches distributions. */
+static const size_t qual_prefetch_dist = 6;
+
+
+/* State from which the context of the next quality score is computed. */
+typedef struct qual_ctx_t_
+{
+    union {
+        uint64_t ui64;
+        uint8_t  ui8[4];
+    } qprev;
+
+    int delta;
+} qual_ctx_t;
+
+
 static void qualenc_init(qualenc_t* E)
 {
     cond_dist64_init(&E->cs, delta_bins * pos_bins * q_bins2 * q_bins2 * q_bins1);
     cond_dist64_set_update_rate(&E->cs, qual_update_rate);
     E->base_qual = '!';
+    E->ctx = NULL;
+    E->ctx_size = 0;
 }
 
 
@@ -99,6 +121,7 @@ void qualenc_free(qualenc_t* E)
 {
     cond_dist64_free(&E->cs);
     ac_free(E->ac);
+    free(E->ctx);
     free(E);
 }
 
@@ -114,68 +137,71 @@ static inline uint8_t bytemax2(uint8_t a, uint8_t b)
     return a > b ? a : b;
 }
 
-static inline int intmin2(int a, int b)
+
+static inline void qual_ctx_init(qual_ctx_t* c)
 {
-    return a < b ? a : b;
+    c->qprev.ui64 = 0;
+    c->delta = 0;
 }
 
 
-void qualenc_encode(qualenc_t* E, const short_read_t* x)
+static inline uint32_t qual_ctx_index(const qual_ctx_t* c, size_t pos_bin)
 {
-    union {
-        uint64_t ui64;
-        uint8_t  ui8[4];
-    } qprev;
+    return cs_index(pos_bin, c->delta,
+                    bytemax2(c->qprev.ui8[3], c->qprev.ui8[2]),
+                    c->qprev.ui8[1], c->qprev.ui8[0]);
+}
+
 
-    qprev.ui64 = 0;
+/* Advance the context past quality score q. The running delta saturates at
+ * delta_max - 1. */
+static inline void qual_ctx_push(qual_ctx_t* c, uint8_t q)
+{
+    int qdiff = (int) c->qprev.ui8[0] - (int) q;
+
+    c->qprev.ui64 <<= 8;
+    c->qprev.ui8[1] = q_bin_map2[c->qprev.ui8[1]];
+    c->qprev.ui8[0] = q_bin_map1[q];
+
+    if (c->delta < delta_max - 1 && (qdiff < -1 || qdiff >= 1)) {
+        c->delta += 1;
+    }
+}
 
-    int delta = 0;
-    int qdiff;
-    uint8_t q;
 
+void qualenc_encode(qualenc_t* E, const short_read_t* x)
+{
     uint8_t* qs = x->qual.s;
     size_t n = x->qual.n;
 
+    if (n > E->ctx_size) {
+        E->ctx_size = n;
+        E->ctx = realloc_or_die(E->ctx, E->ctx_size * sizeof(uint32_t));
+    }
+
     /* this is: ceil(n / pos_bins) */
     size_t pos_bin_size = (n + pos_bins - 1) / pos_bins;
     size_t i;
 
+    /* Every context is determined by the read alone, so compute them all
+     * before touching the model. */
+    qual_ctx_t c;
+    qual_ctx_init(&c);
     for (i = 0; i < n; ++i) {
-        q = qs[i] - E->base_qual;
-        cond_dist64_encode(E->ac, &E->cs,
-                cs_index(i / pos_bin_size, delta,
-                         bytemax2(qprev.ui8[3], qprev.ui8[2]),
-                         qprev.ui8[1], qprev.ui8[0]), q);
-
-        qdiff = (int) qprev.ui8[0] - (int) q;
-
-        qprev.ui64 <<= 8;
-        qprev.ui8[1] = q_bin_map2[qprev.ui8[1]];
-        qprev.ui8[0] = q_bin_map1[q];
-
-        if (qdiff < -1 || qdiff >= 1) {
-            delta += 1;
-            if (delta >= delta_max) {
-                delta = delta_max - 1;
-                ++i;
-                break;
-            }
-        }
+        E->ctx[i] = qual_ctx_index(&c, i / pos_bin_size);
+        qual_ctx_push(&c, qs[i] - E->base_qual);
+    }
+
+    for (i = 0; i < n && i < qual_prefetch_dist; ++i) {
+        cond_dist64_prefetch(&E->cs, E->ctx[i]);
     }
 
-    /* We enter this loop when delta hits its maximum. It is the same as the
-     * above loop but saves a few cycles by not dealing with delta any further.
-     * */
-    for (; i < n; ++i) {
-        q = qs[i] - E->base_qual;
-        cond_dist64_encode(E->ac, &E->cs,
-                cs_index(i / pos_bin_size, delta,
-                         bytemax2(qprev.ui8[3], qprev.ui8[2]),
-                         qprev.ui8[1], qprev.ui8[0]), q);
-
-        qprev.ui64 <<= 8;
-        qprev.ui8[1] = q_bin_map2[qprev.ui8[1]];
-        qprev.ui8[0] = q_bin_map1[q];
+    for (i = 0; i < n; ++i) {
+        if (i + qual_prefetch_dist < n) {
+            cond_dist64_prefetch(&E->cs, E->ctx[i + qual_prefetch_dist]);
+        }
+
+        cond_dist64_encode(E->ac, &E->cs, E->ctx[i], qs[i] - E->base_qual);
     }
 }
 
@@ -198,53 +224,32 @@ void qualenc_decode(qualenc_t* E, short_read_t* seq, size_t n)
     qual->n = 0;
     uint8_t* qs = seq->qual.s;
 
-    union {
-        uint64_t ui64;
-        uint8_t  ui8[4];
-    } qprev;
-
-    qprev.ui64 = 0;
-
-    int delta = 0;
-    int qdiff;
-
     /* this is: ceil(n / pos_bins) */
     size_t pos_bin_size = (n + pos_bins - 1) / pos_bins;
     size_t i;
 
-    for (i = 0; i < n; ++i) {
-        qs[i] = cond_dist64_decode(E->ac, &E->cs,
-                    cs_index(i / pos_bin_size, delta,
-                             bytemax2(qprev.ui8[3], qprev.ui8[2]),
-                             qprev.ui8[1], qprev.ui8[0]));
-
-        qdiff = (int) qprev.ui8[0] - (int) qs[i];
-
-        qprev.ui64 <<= 8;
-        qprev.ui8[1] = q_bin_map2[qprev.ui8[1]];
-        qprev.ui8[0] = q_bin_map1[qs[i]];
-        qs[i] += E->base_qual;
+    qual_ctx_t c, guess;
+    qual_ctx_init(&c);
+    uint32_t ctx = qual_ctx_index(&c, 0);
 
-        if (qdiff < -1 || qdiff >= 1) {
-            delta += 1;
-            if (delta >= delta_max) {
-                delta = delta_max - 1;
-                ++i;
-                break;
+    for (i = 0; i < n; ++i) {
+        qs[i] = cond_dist64_decode(E->ac, &E->cs, ctx);
+        qual_ctx_push(&c, qs[i]);
+
+        if (i + 1 < n) {
+            ctx = qual_ctx_index(&c, (i + 1) / pos_bin_size);
+
+            /* All but the most recent score of the context after next is
+             * now known. Guess that the next score repeats this one and
+             * fetch that distribution while the next score is decoded. */
+            if (i + 2 < n) {
+                guess = c;
+                qual_ctx_push(&guess, qs[i]);
+                cond_dist64_prefetch(&E->cs,
+                    qual_ctx_index(&guess, (i + 2) / pos_bin_size));
             }
         }
-    }
-
-    /* Faster loop once delta hits its maximum. */
-    for (; i < n; ++i) {
-        qs[i] = cond_dist64_decode(E->ac, &E->cs,
-                    cs_index(i / pos_bin_size, delta,
-                             bytemax2(qprev.ui8[3], qprev.ui8[2]),
-                             qprev.ui8[1], qprev.ui8[0]));
 
-        qprev.ui64 <<= 8;
-        qprev.ui8[1] = q_bin_map2[qprev.ui8[1]];
-        qprev.ui8[0] = q_bin_map1[qs[i]];
         qs[i] += E->base_qual;
     }
 
@@ -37,9 +37,27 @@
 #define O_BINARY 0
 #endif
 
-static bool force_flag    = false;
-static bool assembly_flag = false;
-static bool stdout_flag   = false;
+static bool force_flag       = false;
+static bool assembly_flag    = false;
+static bool stdout_flag      = false;
+static bool n_from_qual_flag = false;
+static bool allow_reorder_flag = false;
+static bool reorder_flag = false;
+static bool store_contigs_flag = false;
+
+/* values for options that have no short form */
+enum {
+    OPT_N_FROM_QUAL = 256,
+    OPT_SEQ_ORDER,
+    OPT_SEQ_MEM,
+    OPT_SEQ_TETRA,
+    OPT_SEQ_LANES,
+    OPT_DEDUP,
+    OPT_ALLOW_REORDER,
+    OPT_REORDER,
+    OPT_STORE_CONTIGS,
+    OPT_ASSEMBLY_MEM
+};
 
 static enum {
     QUIP_CMD_CONVERT,
@@ -80,6 +98,27 @@ static void print_help()
 "                       compression at the cost of being somewhat slower.\n"
 "  -n, --assembly-n=N   assemble the first n reads (implies --assembly)\n"
 "                       (default: 2500000)\n"
+"      --assembly-mem=M use at most about M megabytes to count k-mers for\n"
+"                       assembly (default: 384)\n"
+"      --store-contigs  store assembled contigs, so that decompressing\n"
+"                       does not assemble them again (implies --assembly)\n"
+"      --n-from-qual    where every N has the same quality score, recover\n"
+"                       Ns from quality scores rather than storing them\n"
+"      --seq-order=K    condition nucleotides on the preceding K\n"
+"                       (default: 11)\n"
+"      --seq-mem=M      use at most about M megabytes for the nucleotide\n"
+"                       model, hashing contexts if needed (default: 512)\n"
+"      --seq-tetra      code four nucleotides at a time rather than two\n"
+"      --seq-lanes=L    decode L (1, 2, or 4) reads' sequences in lockstep,\n"
+"                       hiding memory latency (default: 1)\n"
+"      --dedup          code exact duplicates of recent reads' sequences\n"
+"                       as references to them\n"
+"      --allow-reorder  cluster similar reads of FASTQ input, and do not\n"
+"                       restore their order when decompressing\n"
+"      --reorder        cluster similar reads of FASTQ input, storing their\n"
+"                       order to be restored when decompressing\n"
+"  -p, --threads=N      use up to N threads for assembly\n"
+"                       (default: the number of processors)\n"
 "  -t, --test           test compressed file integrity\n"
 "  -l, --list           list total number of reads and bases\n"
 "  -c, --stdout         write on standard output\n"
@@ -325,6 +364,23 @@ static void guess_file_format(const char* fn,
 }
 
 
+/* Options for the output format, as determined by command line flags. */
+static quip_opt_t get_out_opts()
+{
+    quip_opt_t opts = 0;
+
+    if (out_fmt == QUIP_FMT_QUIP) {
+        if (assembly_flag)      opts |= QUIP_OPT_QUIP_ASSEMBLY;
+        if (n_from_qual_flag)   opts |= QUIP_OPT_QUIP_N_FROM_QUAL;
+        if (allow_reorder_flag) opts |= QUIP_OPT_QUIP_ALLOW_REORDER;
+        if (reorder_flag)       opts |= QUIP_OPT_QUIP_REORDER;
+        if (store_contigs_flag) opts |= QUIP_OPT_QUIP_STORE_CONTIGS;
+    }
+
+    return opts;
+}
+
+
 
 static int quip_cmd_convert(char** fns, size_t fn_count)
 {
@@ -375,8 +431,7 @@ static int quip_cmd_convert(char** fns, size_t fn_count)
         in  = quip_in_open_file(stdin, in_fmt, in_filter, 0, ref);
         quip_get_aux(in, &aux);
 
-        if (out_fmt == QUIP_FMT_QUIP && assembly_flag) opts = QUIP_OPT_QUIP_ASSEMBLY;
-        else opts = 0;
+        opts = get_out_opts();
 
         out = quip_out_open_file(stdout, out_fmt, opts, &aux, ref);
 
@@ -494,8 +549,7 @@ static int quip_cmd_convert(char** fns, size_t fn_count)
                 quip_out_fd = fileno(fout);
             }
 
-            if (out_fmt == QUIP_FMT_QUIP && assembly_flag) opts = QUIP_OPT_QUIP_ASSEMBLY;
-            else opts = 0;
+            opts = get_out_opts();
 
             out = quip_out_open_file(fout, out_fmt, opts, &aux, ref);
 
@@ -539,6 +593,9 @@ static void quip_print_list(const char* fn, quip_list_t* l)
                "%12"PRIu64"         "
                "%0.4f      "
                "%12"PRIu64"    "
+               "%12"PRIu64"         "
+               "%0.4f      "
+               "%12"PRIu64"    "
                "%12"PRIu64"     "
                "%0.4f       "
                "%12"PRIu64"     "
@@ -551,6 +608,8 @@ static void quip_print_list(const char* fn, quip_list_t* l)
                (double) l->id_bytes[1] / (double) l->id_bytes[0],
                l->aux_bytes[0],  l->aux_bytes[1],
                (double) l->aux_bytes[1] / (double) l->aux_bytes[0],
+               l->aln_bytes[0],  l->aln_bytes[1],
+               (double) l->aln_bytes[1] / (double) l->aln_bytes[0],
                l->seq_bytes[0],  l->seq_bytes[1],
                (double) l->seq_bytes[1] / (double) l->seq_bytes[0],
                l->qual_bytes[0], l->qual_bytes[1],
@@ -559,8 +618,8 @@ static void quip_print_list(const char* fn, quip_list_t* l)
     }
     else {
         uint64_t total_bytes[2];
-        total_bytes[0] = l->id_bytes[0] + l->aux_bytes[0] + l->seq_bytes[0] + l->qual_bytes[0] + l->num_reads;
-        total_bytes[1] = l->id_bytes[1] + l->aux_bytes[1] + l->seq_bytes[1] + l->qual_bytes[1] + l->header_bytes;
+        total_bytes[0] = l->id_bytes[0] + l->aux_bytes[0] + l->aln_bytes[0] + l->seq_bytes[0] + l->qual_bytes[0] + l->num_reads;
+        total_bytes[1] = l->id_bytes[1] + l->aux_bytes[1] + l->aln_bytes[1] + l->seq_bytes[1] + l->qual_bytes[1] + l->header_bytes;
 
         printf("%10"PRIu64"  "
                "%12"PRIu64"  "
@@ -589,6 +648,7 @@ static int quip_cmd_list(char** fns, size_t fn_count)
         printf("     Reads         Bases  "
                "ID Uncompressed  ID Compressed  ID Ratio  "
                "Aux Uncompressed  Aux Compressed   Aux Ratio  "
+               "Aln Uncompressed  Aln Compressed   Aln Ratio  "
                "Seq Uncompressed  Seq Compressed  Seq Ratio  "
                "Qual Uncompressed  Qual Compressed  Qual Ratio  "
                "Filename\n");
@@ -636,6 +696,32 @@ static quip_fmt_t parse_format(const char* fmtstr)
 }
 
 
+/* Parse the argument of a numeric option, which must be a whole number between
+ * 1 and max, exiting with an error otherwise. */
+static size_t parse_count_arg(const char* optname, const char* arg, size_t max)
+{
+    char* end;
+    errno = 0;
+    unsigned long long x = strtoull(arg, &end, 10);
+
+    if (!isdigit((unsigned char) arg[0]) || *end != '\0' || errno != 0 ||
+        x == 0 || x > max) {
+        fprintf(stderr, "%s: invalid argument to --%s: '%s' (expected 1 to %zu)\n",
+                quip_prog_name, optname, arg, max);
+        exit(EXIT_FAILURE);
+    }
+
+    return (size_t) x;
+}
+
+
+/* Parse a size given in megabytes, returning it in bytes. */
+static size_t parse_mb_arg(const char* optname, const char* arg)
+{
+    return parse_count_arg(optname, arg, SIZE_MAX / (1024 * 1024)) * 1024 * 1024;
+}
+
+
 int main(int argc, char* argv[])
 {
     static struct option long_options[] =
@@ -647,6 +733,17 @@ int main(int argc, char* argv[])
         {"reference",  required_argument, NULL, 'r'},
         {"assembly-n", required_argument, NULL, 'n'},
         {"assembly",   no_argument      , NULL, 'a'},
+        {"assembly-mem", required_argument, NULL, OPT_ASSEMBLY_MEM},
+        {"store-contigs", no_argument,    NULL, OPT_STORE_CONTIGS},
+        {"n-from-qual", no_argument,      NULL, OPT_N_FROM_QUAL},
+        {"seq-order",  required_argument, NULL, OPT_SEQ_ORDER},
+        {"seq-mem",    required_argument, NULL, OPT_SEQ_MEM},
+        {"seq-tetra",  no_argument,       NULL, OPT_SEQ_TETRA},
+        {"seq-lanes",  required_argument, NULL, OPT_SEQ_LANES},
+        {"dedup",      no_argument,       NULL, OPT_DEDUP},
+        {"allow-reorder", no_argument,    NULL, OPT_ALLOW_REORDER},
+        {"reorder",    no_argument,       NULL, OPT_REORDER},
+        {"threads",    required_argument, NULL, 'p'},
         {"list",       no_argument, NULL, 'l'},
         {"test",       no_argument, NULL, 't'},
         {"stdout",     no_argument, NULL, 'c'},
@@ -678,8 +775,13 @@ int main(int argc, char* argv[])
         stdout_flag = true;
     }
 
+#ifdef _SC_NPROCESSORS_ONLN
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nproc > 0) quip_threads = (size_t) nproc;
+#endif
+
     while (1) {
-        opt = getopt_long(argc, argv, "i:o:r:n:ltacdfvhV", long_options, &opt_idx);
+        opt = getopt_long(argc, argv, "i:o:r:n:p:ltacdfvhV", long_options, &opt_idx);
 
         if (opt == -1) break;
 
@@ -703,6 +805,11 @@ int main(int argc, char* argv[])
                 assembly_flag = true;
                 break;
 
+            case 'p':
+                quip_threads = strtoul(optarg, NULL, 10);
+                if (quip_threads == 0) quip_threads = 1;
+                break;
+
             case 'l':
                 quip_cmd = QUIP_CMD_LIST;
                 break;
@@ -720,6 +827,54 @@ int main(int argc, char* argv[])
                 stdout_flag = true;
                 break;
 
+            case OPT_ASSEMBLY_MEM:
+                quip_assembly_mem = parse_mb_arg("assembly-mem", optarg);
+                assembly_flag = true;
+                break;
+
+            case OPT_STORE_CONTIGS:
+                store_contigs_flag = true;
+                assembly_flag = true;
+                break;
+
+            case OPT_N_FROM_QUAL:
+                n_from_qual_flag = true;
+                break;
+
+            case OPT_SEQ_ORDER:
+                quip_seq_order = parse_count_arg("seq-order", optarg, 32);
+                break;
+
+            case OPT_SEQ_MEM:
+                quip_seq_mem = parse_mb_arg("seq-mem", optarg);
+                break;
+
+            case OPT_SEQ_TETRA:
+                quip_seq_symbol_len = 4;
+                break;
+
+            case OPT_SEQ_LANES:
+                quip_seq_lanes = parse_count_arg("seq-lanes", optarg, 4);
+                if (quip_seq_lanes == 3) {
+                    fprintf(stderr, "%s: invalid argument to --seq-lanes: '%s' "
+                                    "(expected 1, 2, or 4)\n",
+                            quip_prog_name, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case OPT_DEDUP:
+                quip_seq_dup_bits = 18;
+                break;
+
+            case OPT_ALLOW_REORDER:
+                allow_reorder_flag = true;
+                break;
+
+            case OPT_REORDER:
+                reorder_flag = true;
+                break;
+
             case 'd':
                 in_fmt = QUIP_FMT_QUIP;
                 break;
@@ -748,6 +903,11 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (assembly_flag && quip_seq_lanes > 1 && in_fmt != QUIP_FMT_QUIP) {
+        fprintf(stderr, "%s: --seq-lanes is ignored with --assembly.\n",
+                quip_prog_name);
+    }
+
     /* initialize reverse complement lookup tables */
     kmer_init();
 
@@ -125,14 +125,16 @@ typedef struct short_read_t_
     uint32_t flags;
 
     /* Information for aligned reads. These must be set if
-     * (flags & BAM_FUNMAP) == 0 (i.e., the read is not unmapped). */
-    str_t    seqname;
+     * (flags & BAM_FUNMAP) == 0 (i.e., the read is not unmapped).
+     * Sequences are given by their index among the @SQ lines of the SAM
+     * header carried as auxiliary data, or -1 if there is none. */
+    int32_t  tid;
     uint8_t  strand;
     uint32_t pos;
     uint8_t  map_qual;
     cigar_t  cigar;
 
-    str_t    mate_seqname;
+    int32_t  mate_tid;
     uint32_t mate_pos;
     int32_t  tlen;
 
@@ -225,6 +227,24 @@ typedef enum quip_filter_t_
  * at the cost of compression and decompression speed. */
 #define QUIP_OPT_QUIP_ASSEMBLY 1
 
+/* Omit N positions from the sequence stream for any chunk in which exactly
+ * the Ns carry one particular quality score, restoring them from quality
+ * scores when decompressing. */
+#define QUIP_OPT_QUIP_N_FROM_QUAL 2
+
+/* Cluster unaligned reads from FASTQ input by minimizer before compressing
+ * them, and do not store their original order. */
+#define QUIP_OPT_QUIP_ALLOW_REORDER 4
+
+/* With assembly, store the contigs in the file, so that decompression need
+ * not assemble them again. */
+#define QUIP_OPT_QUIP_STORE_CONTIGS 8
+
+/* Cluster unaligned reads from FASTQ input by minimizer before compressing
+ * them, storing their original order to be restored. Ignored if
+ * QUIP_OPT_QUIP_ALLOW_REORDER is also given. */
+#define QUIP_OPT_QUIP_REORDER 16
+
 /* Output SAM files in BAM (compressed SAM) format. */
 #define QUIP_OPT_SAM_BAM 1
 
@@ -320,6 +340,10 @@ bool quip_pipe(quip_in_t* in, quip_out_t* out);
 /* Print a great deal of useless information while running. */
 extern bool quip_verbose;
 
+/* Most threads used for work that can be split among any number of them,
+ * such as counting k-mers for assembly. */
+extern size_t quip_threads;
+
 /* Program name. */
 extern const char* quip_prog_name;
 
@@ -330,8 +354,26 @@ extern const char* quip_in_fname;
 extern char* quip_out_fname;
 extern int quip_out_fd;
 
-/* Number of reads used for assembly. */
+/* Number of reads used for assembly, and roughly the most memory in bytes
+ * used to count their k-mers. */
 extern size_t quip_assembly_n;
+extern size_t quip_assembly_mem;
+
+/* Order of the nucleotide model used in compression, and roughly the most
+ * memory in bytes it may use, beyond which contexts are hashed. */
+extern size_t quip_seq_order;
+extern size_t quip_seq_mem;
+
+/* Number of nucleotides coded per symbol: 2 or 4. */
+extern size_t quip_seq_symbol_len;
+
+/* Number of interleaved sub-streams used to code nucleotides, letting groups
+ * of reads be decoded in lockstep. Not used with assembly. */
+extern size_t quip_seq_lanes;
+
+/* Base 2 logarithm of the number of recent reads searched for exact
+ * duplicates, or 0 to not search. */
+extern size_t quip_seq_dup_bits;
 
 /* Remove the file currently being written. */
 void quip_remove_output_file();
@@ -5,8 +5,10 @@
 #include "qualenc.h"
 #include "idenc.h"
 #include "samoptenc.h"
+#include "samfmt.h"
 #include "seqmap.h"
 #include "crc64.h"
+#include "kmer.h"
 #include "sam/bam.h"
 #include <stdint.h>
 #include <string.h>
@@ -16,7 +18,7 @@
 static const uint8_t quip_header_magic[6] =
     {0xff, 'Q', 'U', 'I', 'P', 0x00};
 
-static const uint8_t quip_header_version = 0x04;
+static const uint8_t quip_header_version = 0x05;
 
 /* maximum number of bases per block */
 static const size_t block_size = 5000000;
@@ -27,9 +29,17 @@ static const char qual_scale_size = 64;
 /* Maximum number of sequences to read before they are compressed. */
 #define chunk_size 5000
 
+/* Number of reads clustered together when reads may be reordered. */
+#define reorder_window (50 * chunk_size)
+
+/* Length of the k-mers reads are clustered by when reordered. */
+static const size_t reorder_k = 16;
+
 typedef enum {
     QUIP_FLAG_REFERENCE = 1,
-    QUIP_FLAG_ASSEMBLED = 2
+    QUIP_FLAG_ASSEMBLED = 2,
+    QUIP_FLAG_REORDERED = 4,
+    QUIP_FLAG_CONTIGS   = 8
 
 } quip_header_flag_t;
 
@@ -40,7 +50,7 @@ void check_header_version(uint8_t v)
     if (v == 1) {
         version_str = "version 1.0.x";
     }
-    else if (v == 2 || v == 3 || v == 4) {
+    else if (v >= 2 && v <= 5) {
         return;
     }
     else {
@@ -172,6 +182,292 @@ static void pthread_create_or_die(
 
 
 
+/* A read's position along with the key it is sorted on when clustering. */
+typedef struct reorder_key_t_
+{
+    uint64_t minimizer;
+    uint32_t idx;
+} reorder_key_t;
+
+
+static int reorder_key_cmp(const void* a_, const void* b_)
+{
+    const reorder_key_t* a = (const reorder_key_t*) a_;
+    const reorder_key_t* b = (const reorder_key_t*) b_;
+
+    if (a->minimizer != b->minimizer) return a->minimizer < b->minimizer ? -1 : 1;
+    else return (int) a->idx - (int) b->idx;
+}
+
+
+/* Order reads by minimizer, so that reads likely to overlap are coded
+ * together, and otherwise by their original position. On return, keys[i].idx
+ * is the position of the read to be coded i-th. */
+static void cluster_reads(const short_read_t* reads, size_t n, reorder_key_t* keys)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        keys[i].minimizer = kmer_minimizer(reads[i].seq.s, reads[i].seq.n, reorder_k);
+        keys[i].idx = i;
+    }
+
+    qsort(keys, n, sizeof(reorder_key_t), reorder_key_cmp);
+}
+
+
+/* Since version 5, the sequence and quality scores of a secondary or
+ * supplementary alignment from a SAM/BAM file are not coded if they are those
+ * of a recent primary alignment of the same read, or a part of them, as when
+ * hard clipped. (Reads are kept in their original orientation, so this is so
+ * whatever strands they are aligned to.) Such copies are listed instead at
+ * the start of each chunk, in the sequence stream. */
+
+/* number of recent primary alignments that may be copied */
+#define primary_ring_size 1024
+
+/* size of the table of primary alignments by read name */
+#define primary_names_bits 12
+
+/* Copies shorter than this are coded as usual. */
+static const size_t min_copy_len = 32;
+
+typedef struct primary_t_
+{
+    str_t seq;
+    str_t qual;
+
+    /* used only when compressing */
+    str_t    id;
+    uint32_t segment;
+    uint32_t hclip;
+} primary_t;
+
+
+/* A read whose sequence and quality scores are copied from a primary
+ * alignment. */
+typedef struct read_copy_t_
+{
+    /* position of the read in the chunk */
+    uint32_t idx;
+
+    /* how many primary alignments back it is copied from */
+    uint32_t back;
+
+    /* where in the primary the copy starts */
+    uint32_t offset;
+} read_copy_t;
+
+
+typedef struct primary_cache_t_
+{
+    /* recent primary alignments, or NULL if copies are not used */
+    primary_t* reads;
+
+    /* number of primary alignments seen */
+    uint64_t n;
+
+    /* one plus the number of the last primary alignment seen for each read
+     * name, by hash, or 0 (only when compressing) */
+    uint64_t* names;
+
+    /* copies in the current chunk */
+    read_copy_t* copies;
+    size_t copies_len, copies_size;
+} primary_cache_t;
+
+
+static void primary_cache_init(primary_cache_t* P, bool enabled, bool encoding)
+{
+    P->reads = NULL;
+    P->names = NULL;
+    P->n = 0;
+    P->copies = NULL;
+    P->copies_len = P->copies_size = 0;
+
+    if (!enabled) return;
+
+    P->reads = malloc_or_die(primary_ring_size * sizeof(primary_t));
+    size_t i;
+    for (i = 0; i < primary_ring_size; ++i) {
+        str_init(&P->reads[i].seq);
+        str_init(&P->reads[i].qual);
+        str_init(&P->reads[i].id);
+    }
+
+    if (encoding) {
+        size_t n = (size_t) 1 << primary_names_bits;
+        P->names = malloc_or_die(n * sizeof(uint64_t));
+        memset(P->names, 0, n * sizeof(uint64_t));
+    }
+}
+
+
+static void primary_cache_free(primary_cache_t* P)
+{
+    size_t i;
+    if (P->reads != NULL) {
+        for (i = 0; i < primary_ring_size; ++i) {
+            str_free(&P->reads[i].seq);
+            str_free(&P->reads[i].qual);
+            str_free(&P->reads[i].id);
+        }
+    }
+
+    free(P->reads);
+    free(P->names);
+    free(P->copies);
+}
+
+
+static bool is_primary(const short_read_t* r)
+{
+    return (r->flags & (BAM_FSECONDARY | BAM_FSUPP)) == 0 &&
+           r->seq.n > 0 && r->seq.n == r->qual.n;
+}
+
+
+static uint32_t read_segment(const short_read_t* r)
+{
+    return r->flags & (BAM_FREAD1 | BAM_FREAD2);
+}
+
+
+static uint64_t* primary_name_slot(primary_cache_t* P, const short_read_t* r)
+{
+    uint32_t h = murmurhash3(r->id.s, r->id.n) ^ read_segment(r);
+    return &P->names[h & (((uint32_t) 1 << primary_names_bits) - 1)];
+}
+
+
+/* Number of nucleotides hard clipped from the start of a read, in its
+ * original orientation. */
+static uint32_t hard_clip(const short_read_t* r)
+{
+    const cigar_t* cigar = &r->cigar;
+    if (cigar->n == 0) return 0;
+
+    size_t i = r->strand ? cigar->n - 1 : 0;
+    return cigar->ops[i] == BAM_CHARD_CLIP ? cigar->lens[i] : 0;
+}
+
+
+static void primary_cache_add(primary_cache_t* P, const short_read_t* r)
+{
+    primary_t* p = &P->reads[P->n % primary_ring_size];
+    str_copy(&p->seq, &r->seq);
+    str_copy(&p->qual, &r->qual);
+
+    if (P->names != NULL) {
+        str_copy(&p->id, &r->id);
+        p->segment = read_segment(r);
+        p->hclip   = hard_clip(r);
+        *primary_name_slot(P, r) = P->n + 1;
+    }
+
+    P->n++;
+}
+
+
+/* Find a recent primary alignment that a secondary or supplementary one is a
+ * copy of. */
+static bool primary_cache_find(primary_cache_t* P, const short_read_t* r,
+                               read_copy_t* copy)
+{
+    if (r->seq.n < min_copy_len || r->seq.n != r->qual.n) return false;
+
+    uint64_t k = *primary_name_slot(P, r);
+    if (k == 0 || P->n - (k - 1) > primary_ring_size) return false;
+
+    const primary_t* p = &P->reads[(k - 1) % primary_ring_size];
+    if (p->segment != read_segment(r) || p->id.n != r->id.n ||
+        memcmp(p->id.s, r->id.s, r->id.n) != 0) {
+        return false;
+    }
+
+    uint32_t hclip = hard_clip(r);
+    if (hclip < p->hclip) return false;
+
+    size_t off = hclip - p->hclip, n = r->seq.n;
+    if (off + n > p->seq.n ||
+        memcmp(r->seq.s, p->seq.s + off, n) != 0 ||
+        memcmp(r->qual.s, p->qual.s + off, n) != 0) {
+        return false;
+    }
+
+    copy->back   = (uint32_t) (P->n - (k - 1));
+    copy->offset = (uint32_t) off;
+    return true;
+}
+
+
+/* Fill in the sequence and quality scores of a copied read of length n. */
+static void primary_cache_restore(const primary_cache_t* P, const read_copy_t* copy,
+                                  short_read_t* r, size_t n)
+{
+    if (copy->back == 0 || copy->back > P->n || copy->back > primary_ring_size) {
+        quip_error("A read is a copy of a nonexistent alignment.");
+    }
+
+    const primary_t* p = &P->reads[(P->n - copy->back) % primary_ring_size];
+    if ((size_t) copy->offset + n > p->seq.n) {
+        quip_error("A read is a copy of a nonexistent alignment.");
+    }
+
+    str_reserve(&r->seq, n + 1);
+    str_reserve(&r->qual, n + 1);
+    r->seq.n = r->qual.n = n;
+
+    memcpy(r->seq.s, p->seq.s + copy->offset, n);
+    memcpy(r->qual.s, p->qual.s + copy->offset, n);
+    r->seq.s[n] = r->qual.s[n] = '\0';
+}
+
+
+static uint64_t crc64_update_uint32(uint32_t x, uint64_t crc)
+{
+    uint8_t bytes[4] = { (uint8_t) (x >> 24),
+                         (uint8_t) (x >> 16),
+                         (uint8_t) (x >> 8),
+                         (uint8_t) x };
+    return crc64_update(bytes, 4, crc);
+}
+
+
+/* Update the checksum of the alignment stream with a read's alignment, leaving
+ * out what is not coded (e.g., the position of an unaligned read). Returns the
+ * number of bytes checksummed. */
+static size_t alignment_crc64_update(const short_read_t* r, uint64_t* crc)
+{
+    size_t bytes = 12;
+    *crc = crc64_update_uint32(r->flags, *crc);
+    *crc = crc64_update_uint32(r->map_qual, *crc);
+    *crc = crc64_update_uint32((uint32_t) r->tlen, *crc);
+
+    size_t i;
+    if ((r->flags & BAM_FUNMAP) == 0) {
+        *crc = crc64_update_uint32((uint32_t) r->tid, *crc);
+        *crc = crc64_update_uint32(r->pos, *crc);
+        for (i = 0; i < r->cigar.n; ++i) {
+            *crc = crc64_update_uint32(((uint32_t) r->cigar.lens[i] << 4) | r->cigar.ops[i], *crc);
+        }
+        bytes += 8 + 4 * r->cigar.n;
+    }
+    else if (r->tid >= 0) {
+        *crc = crc64_update_uint32((uint32_t) r->tid, *crc);
+        *crc = crc64_update_uint32(r->pos, *crc);
+        bytes += 8;
+    }
+
+    if ((r->flags & BAM_FMUNMAP) == 0 || r->mate_tid >= 0) {
+        *crc = crc64_update_uint32((uint32_t) r->mate_tid, *crc);
+        *crc = crc64_update_uint32(r->mate_pos, *crc);
+        bytes += 8;
+    }
+
+    return bytes;
+}
+
+
 struct quip_quip_out_t_
 {
     /* sequence buffers */
@@ -185,6 +481,9 @@ struct quip_quip_out_t_
     /* reference, NULL if we are not doing reference-based compression */
     const seqmap_t* ref;
 
+    /* SAM/BAM header, listing the sequences read tids refer to */
+    bam_header_t* header;
+
     /* algorithms to compress ids, qualities, and sequences, resp. */
     idenc_t*     idenc;
     samoptenc_t* auxenc;
@@ -195,15 +494,46 @@ struct quip_quip_out_t_
     size_t buffered_reads;
     size_t buffered_bases;
 
+    /* derive N positions from quality scores where possible */
+    bool n_from_qual;
+
+    /* quality score of every N in the current chunk, or 0 */
+    char n_qual;
+
+    /* Reads buffered to be clustered by minimizer, or NULL. */
+    short_read_t* window;
+    size_t window_len;
+    reorder_key_t* reorder_keys;
+
+    /* whether the original order of clustered reads is stored, and if so,
+     * for each read of the chunk, whether it shares its minimizer with the
+     * read before it, and the gap between their indexes in the window if so,
+     * or its index otherwise */
+    bool keep_order;
+    bool chunk_order_same[chunk_size];
+    uint32_t chunk_order[chunk_size];
+
+    /* recent primary alignments, and the reads of the current chunk copied
+     * from them */
+    primary_cache_t primaries;
+
+    /* which reads of the chunk are copies */
+    bool chunk_copied[chunk_size];
+
+    /* number of copies in the current block, for statistics */
+    uint32_t copied_reads;
+
     /* block specific checksums */
     uint64_t id_crc;
     uint64_t aux_crc;
+    uint64_t aln_crc;
     uint64_t seq_crc;
     uint64_t qual_crc;
 
     /* for compression statistics */
     uint32_t id_bytes;
     uint32_t aux_bytes;
+    uint32_t aln_bytes;
     uint32_t qual_bytes;
     uint32_t seq_bytes;
 
@@ -259,18 +589,55 @@ static void* aux_compressor_thread(void* ctx)
 }
 
 
+static void* aln_compressor_thread(void* ctx)
+{
+    quip_quip_out_t* C = (quip_quip_out_t*) ctx;
+
+    size_t i;
+    for (i = 0; i < C->chunk_len; ++i) {
+        assembler_add_alignment(C->assembler, &C->chunk[i]);
+        C->aln_bytes += alignment_crc64_update(&C->chunk[i], &C->aln_crc);
+    }
+
+    return NULL;
+}
+
+
 static void* seq_compressor_thread(void* ctx)
 {
     quip_quip_out_t* C = (quip_quip_out_t*) ctx;
 
+    assembler_start_chunk(C->assembler);
+    assembler_set_n_qual(C->assembler, C->n_qual);
+
+    const primary_cache_t* P = &C->primaries;
     size_t i;
+    uint32_t next = 0;
+    if (P->reads != NULL) {
+        assembler_set_copy_count(C->assembler, (uint32_t) P->copies_len);
+        for (i = 0; i < P->copies_len; ++i) {
+            assembler_add_copy(C->assembler, P->copies[i].idx - next,
+                               P->copies[i].back, P->copies[i].offset);
+            next = P->copies[i].idx + 1;
+        }
+    }
+
+    if (C->keep_order) {
+        for (i = 0; i < C->chunk_len; ++i) {
+            assembler_add_read_order(C->assembler, C->chunk_order_same[i],
+                                     C->chunk_order[i]);
+        }
+    }
+
     for (i = 0; i < C->chunk_len; ++i) {
-        assembler_add_seq(C->assembler, &C->chunk[i]);
+        if (!C->chunk_copied[i]) assembler_add_seq(C->assembler, &C->chunk[i]);
         C->seq_crc = crc64_update(
             C->chunk[i].seq.s,
             C->chunk[i].seq.n, C->seq_crc);
     }
 
+    assembler_end_chunk(C->assembler);
+
     return NULL;
 }
 
@@ -281,7 +648,7 @@ static void* qual_compressor_thread(void* ctx)
 
     size_t i;
     for (i = 0; i < C->chunk_len; ++i) {
-        qualenc_encode(C->qualenc, &C->chunk[i]);
+        if (!C->chunk_copied[i]) qualenc_encode(C->qualenc, &C->chunk[i]);
         C->qual_crc = crc64_update(
             C->chunk[i].qual.s,
             C->chunk[i].qual.n, C->qual_crc);
@@ -302,6 +669,9 @@ quip_quip_out_t* quip_quip_out_open(
 
     bool assembly_based = (opts & QUIP_OPT_QUIP_ASSEMBLY) != 0;
     bool ref_based      = ref != NULL;
+    bool store_contigs  = assembly_based && (opts & QUIP_OPT_QUIP_STORE_CONTIGS) != 0;
+    C->n_from_qual      = (opts & QUIP_OPT_QUIP_N_FROM_QUAL) != 0;
+    C->n_qual           = 0;
     C->writer = writer;
     C->writer_data = writer_data;
     C->ref = ref;
@@ -312,16 +682,52 @@ quip_quip_out_t* quip_quip_out_open(
     }
     C->chunk_len = 0;
 
+    /* Reordering is only of use to reads compressed on their own. Reads from
+     * SAM/BAM files are not reordered, since the header may declare them
+     * sorted. If reordering is allowed outright, the original order is not
+     * stored. */
+    bool reorder = (opts & (QUIP_OPT_QUIP_ALLOW_REORDER | QUIP_OPT_QUIP_REORDER)) != 0;
+    if (reorder && (assembly_based || ref_based)) {
+        quip_warning("reads are not reordered with a reference or assembly.");
+        reorder = false;
+    }
+    else if (reorder && aux != NULL &&
+             (aux->fmt == QUIP_FMT_SAM || aux->fmt == QUIP_FMT_BAM)) {
+        quip_warning("reads from SAM/BAM input are not reordered.");
+        reorder = false;
+    }
+
+    C->window       = NULL;
+    C->window_len   = 0;
+    C->reorder_keys = NULL;
+    C->keep_order   = reorder && (opts & QUIP_OPT_QUIP_ALLOW_REORDER) == 0;
+
+    if (reorder) {
+        C->window = malloc_or_die(reorder_window * sizeof(short_read_t));
+        for (i = 0; i < reorder_window; ++i) {
+            short_read_init(&C->window[i]);
+        }
+        C->reorder_keys = malloc_or_die(reorder_window * sizeof(reorder_key_t));
+    }
+
+    primary_cache_init(&C->primaries,
+                       aux != NULL && (aux->fmt == QUIP_FMT_SAM || aux->fmt == QUIP_FMT_BAM),
+                       true);
+    memset(C->chunk_copied, 0, chunk_size * sizeof(bool));
+    C->copied_reads = 0;
+
     C->buffered_reads = 0;
     C->buffered_bases = 0;
 
     C->id_crc   = 0;
     C->aux_crc  = 0;
+    C->aln_crc  = 0;
     C->seq_crc  = 0;
     C->qual_crc = 0;
 
     C->id_bytes   = 0;
     C->aux_bytes  = 0;
+    C->aln_bytes  = 0;
     C->qual_bytes = 0;
     C->seq_bytes  = 0;
 
@@ -342,8 +748,17 @@ quip_quip_out_t* quip_quip_out_open(
     C->idenc     = idenc_alloc_encoder(writer, (void*) writer_data);
     C->auxenc    = samoptenc_alloc_encoder(writer, (void*) writer_data);
     C->qualenc   = qualenc_alloc_encoder(writer, (void*) writer_data);
+
+    seqenc_params_t seq_params;
+    seqenc_params_init(&seq_params, quip_seq_order, quip_seq_symbol_len,
+                       assembly_based ? 1 : quip_seq_lanes,
+                       quip_seq_dup_bits, quip_seq_mem);
+
+    C->header = quip_sam_aux_header(aux);
     C->assembler = assembler_alloc(writer, (void*) writer_data,
-                                   assembly_based, quip_header_version, ref);
+                                   assembly_based, store_contigs,
+                                   quip_header_version,
+                                   &seq_params, ref, C->header);
 
     /* write header */
     C->writer(C->writer_data, quip_header_magic, 6);
@@ -353,8 +768,12 @@ quip_quip_out_t* quip_quip_out_open(
     uint8_t header_flags = 0;
     if (ref_based)      header_flags |= QUIP_FLAG_REFERENCE;
     if (assembly_based) header_flags |= QUIP_FLAG_ASSEMBLED;
+    if (C->keep_order)  header_flags |= QUIP_FLAG_REORDERED;
+    if (store_contigs)  header_flags |= QUIP_FLAG_CONTIGS;
     C->writer(C->writer_data, &header_flags, 1);
 
+    seqenc_write_params(C->writer, C->writer_data, &seq_params);
+
     /* write reference hash */
     if (ref_based) {
         seqmap_write_quip_header_info(C->writer, C->writer_data, ref);
@@ -362,6 +781,11 @@ quip_quip_out_t* quip_quip_out_open(
 
     if (assembly_based) {
         write_uint64(C->writer, C->writer_data, quip_assembly_n);
+        write_uint64(C->writer, C->writer_data, quip_assembly_mem);
+    }
+
+    if (C->keep_order) {
+        write_uint32(C->writer, C->writer_data, reorder_window);
     }
 
     /* write aux data */
@@ -424,10 +848,10 @@ void quip_out_flush_block(quip_quip_out_t* C)
         write_uint32(C->writer, C->writer_data, C->qual_scheme_lens[i]);
     }
 
-
     /* finish coding */
     size_t comp_id_bytes   = idenc_finish(C->idenc);
     size_t comp_aux_bytes  = samoptenc_finish(C->auxenc);
+    size_t comp_aln_bytes  = assembler_finish_alignments(C->assembler);
     size_t comp_seq_bytes  = assembler_finish(C->assembler);
     size_t comp_qual_bytes = qualenc_finish(C->qualenc);
 
@@ -440,6 +864,10 @@ void quip_out_flush_block(quip_quip_out_t* C)
     write_uint32(C->writer, C->writer_data, comp_aux_bytes);
     write_uint64(C->writer, C->writer_data, C->aux_crc);
 
+    write_uint32(C->writer, C->writer_data, C->aln_bytes);
+    write_uint32(C->writer, C->writer_data, comp_aln_bytes);
+    write_uint64(C->writer, C->writer_data, C->aln_crc);
+
     write_uint32(C->writer, C->writer_data, C->seq_bytes);
     write_uint32(C->writer, C->writer_data, comp_seq_bytes);
     write_uint64(C->writer, C->writer_data, C->seq_crc);
@@ -464,6 +892,16 @@ void quip_out_flush_block(quip_quip_out_t* C)
                 100.0 * (double) comp_aux_bytes / (double) C->aux_bytes);
     }
 
+    /* write compressed alignments */
+    assembler_flush_alignments(C->assembler);
+    if (quip_verbose) {
+        fprintf(stderr, "\taln: %u / %u (%0.2f%%)\n",
+                (unsigned int) comp_aln_bytes, (unsigned int) C->aln_bytes,
+                100.0 * (double) comp_aln_bytes / (double) C->aln_bytes);
+        fprintf(stderr, "\t%u reads copied from primary alignments\n",
+                (unsigned int) C->copied_reads);
+    }
+
     /* write compressed sequences */
     assembler_flush(C->assembler);
     if (quip_verbose) {
@@ -488,11 +926,14 @@ void quip_out_flush_block(quip_quip_out_t* C)
     C->qual_bytes     = 0;
     C->seq_bytes      = 0;
     C->aux_bytes      = 0;
+    C->aln_bytes      = 0;
     C->id_crc         = 0;
     C->seq_crc        = 0;
     C->qual_crc       = 0;
     C->aux_crc        = 0;
+    C->aln_crc        = 0;
     C->readlen_count  = 0;
+    C->copied_reads   = 0;
 
     C->qual_scheme_vals[0] = C->qual_scheme_vals[C->qual_scheme_count - 1];
     C->qual_scheme_lens[0] = 0;
@@ -554,17 +995,90 @@ static void update_qual_scheme_guess(quip_quip_out_t* C)
 }
 
 
+/* Find the quality score that is given to every N in the chunk and to nothing
+ * else, so that Ns can be restored from qualities. Returns 0 if there is no
+ * such score or the chunk has no Ns. */
+static char guess_n_qual(const quip_quip_out_t* C)
+{
+    char n_qual = 0;
+    size_t i, j;
+    for (i = 0; i < C->chunk_len; ++i) {
+        const short_read_t* r = &C->chunk[i];
+        if (r->seq.n != r->qual.n) {
+            if (r->seq.n > 0 && memchr(r->seq.s, 'N', r->seq.n) != NULL) return 0;
+            continue;
+        }
+
+        for (j = 0; j < r->seq.n; ++j) {
+            if (r->seq.s[j] != 'N') continue;
+            if (n_qual == 0) n_qual = r->qual.s[j];
+            else if (r->qual.s[j] != n_qual) return 0;
+        }
+    }
+
+    if (n_qual == 0) return 0;
+
+    for (i = 0; i < C->chunk_len; ++i) {
+        const short_read_t* r = &C->chunk[i];
+        if (r->seq.n != r->qual.n) continue;
+
+        for (j = 0; j < r->seq.n; ++j) {
+            if (r->qual.s[j] == n_qual && r->seq.s[j] != 'N') return 0;
+        }
+    }
+
+    return n_qual;
+}
+
+
+/* Find the reads of the chunk that are copies of primary alignments. */
+static void find_copies(quip_quip_out_t* C)
+{
+    primary_cache_t* P = &C->primaries;
+    read_copy_t copy;
+    short_read_t* r;
+    size_t i;
+
+    P->copies_len = 0;
+    for (i = 0; i < C->chunk_len; ++i) {
+        r = &C->chunk[i];
+        C->chunk_copied[i] = false;
+
+        if (is_primary(r)) {
+            primary_cache_add(P, r);
+        }
+        else if ((r->flags & (BAM_FSECONDARY | BAM_FSUPP)) != 0 &&
+                 primary_cache_find(P, r, &copy)) {
+            if (P->copies_len == P->copies_size) {
+                P->copies_size = P->copies_size == 0 ? 64 : 2 * P->copies_size;
+                P->copies = realloc_or_die(P->copies, P->copies_size * sizeof(read_copy_t));
+            }
+
+            copy.idx = (uint32_t) i;
+            P->copies[P->copies_len++] = copy;
+            C->chunk_copied[i] = true;
+            C->copied_reads++;
+        }
+    }
+}
+
+
 static void quip_out_flush_chunk(quip_quip_out_t* C)
 {
     update_qual_scheme_guess(C);
 
+    C->n_qual = C->n_from_qual ? guess_n_qual(C) : 0;
+
+    if (C->primaries.reads != NULL) find_copies(C);
+
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-    pthread_t id_thread, aux_thread, seq_thread, qual_thread;
+    pthread_t id_thread, aux_thread, aln_thread, seq_thread, qual_thread;
     pthread_create_or_die(&id_thread,   &attr, id_compressor_thread,   (void*) C);
     pthread_create_or_die(&aux_thread,  &attr, aux_compressor_thread,  (void*) C);
+    pthread_create_or_die(&aln_thread,  &attr, aln_compressor_thread,  (void*) C);
     pthread_create_or_die(&seq_thread,  &attr, seq_compressor_thread,  (void*) C);
     pthread_create_or_die(&qual_thread, &attr, qual_compressor_thread, (void*) C);
 
@@ -585,6 +1099,7 @@ static void quip_out_flush_chunk(quip_quip_out_t* C)
     void* val;
     pthread_join_or_die(id_thread,   &val);
     pthread_join_or_die(aux_thread,   &val);
+    pthread_join_or_die(aln_thread,  &val);
     pthread_join_or_die(seq_thread,  &val);
     pthread_join_or_die(qual_thread, &val);
 
@@ -594,7 +1109,9 @@ static void quip_out_flush_chunk(quip_quip_out_t* C)
 }
 
 
-void quip_quip_write(quip_quip_out_t* C, short_read_t* seq)
+/* Return the next free read in the chunk, first flushing the chunk and
+ * block, if either is full. */
+static short_read_t* quip_out_next_read(quip_quip_out_t* C)
 {
     if (C->buffered_bases > block_size) {
         quip_out_flush_block(C);
@@ -604,13 +1121,54 @@ void quip_quip_write(quip_quip_out_t* C, short_read_t* seq)
         quip_out_flush_chunk(C);
     }
 
-    short_read_copy(&C->chunk[C->chunk_len++], seq);
+    return &C->chunk[C->chunk_len++];
+}
+
+
+/* Compress the buffered window of reads in clustered order, noting where
+ * each stood if the order is to be stored. */
+static void quip_out_flush_window(quip_quip_out_t* C)
+{
+    const reorder_key_t* keys = C->reorder_keys;
+    cluster_reads(C->window, C->window_len, C->reorder_keys);
+
+    short_read_t tmp;
+    short_read_t* r;
+    size_t i, j;
+    bool same;
+    for (i = 0; i < C->window_len; ++i) {
+        r = quip_out_next_read(C);
+        tmp = *r;
+        *r = C->window[keys[i].idx];
+        C->window[keys[i].idx] = tmp;
+
+        if (C->keep_order) {
+            /* Reads sharing a minimizer are sorted by index. */
+            j = C->chunk_len - 1;
+            same = i > 0 && keys[i].minimizer == keys[i - 1].minimizer;
+            C->chunk_order_same[j] = same;
+            C->chunk_order[j] = same ? keys[i].idx - keys[i - 1].idx - 1 : keys[i].idx;
+        }
+    }
+
+    C->window_len = 0;
+}
+
+
+void quip_quip_write(quip_quip_out_t* C, short_read_t* seq)
+{
+    if (C->window != NULL) {
+        if (C->window_len == reorder_window) quip_out_flush_window(C);
+        short_read_copy(&C->window[C->window_len++], seq);
+    }
+    else short_read_copy(quip_out_next_read(C), seq);
 }
 
 
 void quip_out_finish(quip_quip_out_t* C)
 {
     if (C->finished) return;
+    if (C->window_len > 0) quip_out_flush_window(C);
     if (C->chunk_len > 0) quip_out_flush_chunk(C);
     if (C->buffered_bases > 0) quip_out_flush_block(C);
 
@@ -630,10 +1188,20 @@ void quip_quip_out_close(quip_quip_out_t* C)
         short_read_free(&C->chunk[i]);
     }
 
+    if (C->window != NULL) {
+        for (i = 0; i < reorder_window; ++i) {
+            short_read_free(&C->window[i]);
+        }
+        free(C->window);
+    }
+    free(C->reorder_keys);
+    primary_cache_free(&C->primaries);
+
     idenc_free(C->idenc);
     samoptenc_free(C->auxenc);
     qualenc_free(C->qualenc);
     assembler_free(C->assembler);
+    bam_header_destroy(C->header);
     free(C->readlen_vals);
     free(C->readlen_lens);
     free(C->qual_scheme_vals);
@@ -657,6 +1225,9 @@ struct quip_quip_in_t_
     str_t   aux_data;
     uint8_t aux_data_type;
 
+    /* SAM/BAM header parsed from the auxiliary data */
+    bam_header_t* header;
+
     /* algorithms to decompress ids, qualities, and sequences, resp. */
     idenc_t*        idenc;
     samoptenc_t*    auxenc;
@@ -671,6 +1242,10 @@ struct quip_quip_in_t_
     uint8_t* auxbuf;
     size_t auxbuf_size, auxbuf_len, auxbuf_pos;
 
+    /* compressed alignments */
+    uint8_t* alnbuf;
+    size_t alnbuf_size, alnbuf_len, alnbuf_pos;
+
     /* compressed sequence */
     uint8_t* seqbuf;
     size_t seqbuf_size, seqbuf_len, seqbuf_pos;
@@ -682,18 +1257,51 @@ struct quip_quip_in_t_
     /* number of reads encoded in the buffers */
     uint32_t pending_reads;
 
+    /* quality score of every N in the current chunk, or 0 if Ns were
+     * decoded with the sequences */
+    char n_qual;
+
+    /* recent primary alignments, and the reads of the current chunk copied
+     * from them */
+    primary_cache_t primaries;
+
+    /* the copy, if any, that each read of the chunk is */
+    const read_copy_t* chunk_copies[chunk_size];
+    bool chunk_has_copies;
+
+    /* With reordered reads, the index in its window of each read of the
+     * chunk, the reads of the window as they are restored to their original
+     * order, and which have been, or NULL if reads were not reordered. */
+    uint32_t chunk_order[chunk_size];
+    short_read_t* window;
+    bool* window_filled;
+    size_t window_size, window_len, window_pos;
+
+    /* number of reads of the current window whose index has been read, and
+     * the last of those indexes */
+    size_t order_pos;
+    uint32_t order_prev;
+
+    /* format version */
+    uint8_t version;
+
+    /* whether aligned reads are coded against a reference */
+    bool ref_based;
+
     /* current block number */
     uint32_t block_num;
 
     /* expected block checksums */
     uint64_t exp_id_crc;
     uint64_t exp_aux_crc;
+    uint64_t exp_aln_crc;
     uint64_t exp_seq_crc;
     uint64_t exp_qual_crc;
 
     /* observed block checksums */
     uint64_t id_crc;
     uint64_t aux_crc;
+    uint64_t aln_crc;
     uint64_t seq_crc;
     uint64_t qual_crc;
 
@@ -750,6 +1358,32 @@ static void* aux_decompressor_thread(void* ctx)
 }
 
 
+static void* aln_decompressor_thread(void* ctx)
+{
+    quip_quip_in_t* D = (quip_quip_in_t*) ctx;
+
+    size_t readlen_idx = D->readlen_idx;
+    size_t readlen_off = D->readlen_off;
+
+    size_t n; /* read length */
+    size_t cnt = D->pending_reads >= chunk_size ?
+                    chunk_size : D->pending_reads;
+    size_t i;
+    for (i = 0; i < cnt; ++i) {
+        n = D->readlen_vals[readlen_idx];
+        if (++readlen_off >= D->readlen_lens[readlen_idx]) {
+            readlen_off = 0;
+            readlen_idx++;
+        }
+
+        disassembler_read_alignment(D->disassembler, &D->chunk[i], n);
+        alignment_crc64_update(&D->chunk[i], &D->aln_crc);
+    }
+
+    return NULL;
+}
+
+
 static void* seq_decompressor_thread(void* ctx)
 {
     quip_quip_in_t* D = (quip_quip_in_t*) ctx;
@@ -769,13 +1403,24 @@ static void* seq_decompressor_thread(void* ctx)
             readlen_idx++;
         }
 
-        disassembler_read(D->disassembler, &D->chunk[i], n);
-        D->seq_crc = crc64_update(
-            D->chunk[i].seq.s,
-            D->chunk[i].seq.n, D->seq_crc);
+        if (D->chunk_copies[i] == NULL) {
+            disassembler_read(D->disassembler, &D->chunk[i], n);
+        }
         ++i;
     }
 
+    disassembler_end_chunk(D->disassembler);
+
+    /* Otherwise, the checksum is taken once Ns have been restored and copies
+     * made. */
+    if (D->n_qual == 0 && !D->chunk_has_copies) {
+        for (i = 0; i < cnt; ++i) {
+            D->seq_crc = crc64_update(
+                D->chunk[i].seq.s,
+                D->chunk[i].seq.n, D->seq_crc);
+        }
+    }
+
     return NULL;
 }
 
@@ -809,11 +1454,15 @@ static void* qual_decompressor_thread(void* ctx)
             }
         }
 
+        if (D->chunk_copies[i] != NULL) continue;
+
         qualenc_decode(D->qualenc, &D->chunk[i], n);
 
-        D->qual_crc = crc64_update(
-            D->chunk[i].qual.s,
-            D->chunk[i].qual.n, D->qual_crc);
+        if (!D->chunk_has_copies) {
+            D->qual_crc = crc64_update(
+                D->chunk[i].qual.s,
+                D->chunk[i].qual.n, D->qual_crc);
+        }
     }
 
     return NULL;
@@ -858,6 +1507,19 @@ static size_t aux_buf_reader(void* param, uint8_t* data, size_t size)
 }
 
 
+static size_t aln_buf_reader(void* param, uint8_t* data, size_t size)
+{
+    quip_quip_in_t* C = (quip_quip_in_t*) param;
+
+    size_t cnt = 0;
+    while (cnt < size && C->alnbuf_pos < C->alnbuf_len) {
+        data[cnt++] = C->alnbuf[C->alnbuf_pos++];
+    }
+
+    return cnt;
+}
+
+
 static size_t seq_buf_reader(void* param, uint8_t* data, size_t size)
 {
     quip_quip_in_t* C = (quip_quip_in_t*) param;
@@ -894,6 +1556,11 @@ quip_quip_in_t* quip_quip_in_open(
     D->auxbuf_len  = 0;
     D->auxbuf_pos  = 0;
 
+    D->alnbuf = NULL;
+    D->alnbuf_size = 0;
+    D->alnbuf_len  = 0;
+    D->alnbuf_pos  = 0;
+
     D->idbuf = NULL;
     D->idbuf_size = 0;
     D->idbuf_len  = 0;
@@ -910,6 +1577,7 @@ quip_quip_in_t* quip_quip_in_open(
     D->qualbuf_pos  = 0;
 
     D->pending_reads = 0;
+    D->n_qual = 0;
     D->block_num = 0;
 
     D->readlen_size  = 1;
@@ -924,6 +1592,7 @@ quip_quip_in_t* quip_quip_in_open(
 
     D->id_crc   = D->exp_id_crc   = 0;
     D->aux_crc  = D->exp_aux_crc  = 0;
+    D->aln_crc  = D->exp_aln_crc  = 0;
     D->seq_crc  = D->exp_seq_crc  = 0;
     D->qual_crc = D->exp_qual_crc = 0;
 
@@ -942,6 +1611,17 @@ quip_quip_in_t* quip_quip_in_open(
 
     bool assembly_based = (header_flags & QUIP_FLAG_ASSEMBLED) != 0;
     bool ref_based      = (header_flags & QUIP_FLAG_REFERENCE) != 0;
+    bool stored_contigs = (header_flags & QUIP_FLAG_CONTIGS) != 0;
+    bool reordered      = (header_flags & QUIP_FLAG_REORDERED) != 0;
+
+    D->version = header_version;
+    D->ref_based = ref_based;
+
+    seqenc_params_t seq_params;
+    if (header_version >= 5) {
+        seqenc_read_params(D->reader, D->reader_data, &seq_params);
+    }
+    else seqenc_params_init_v4(&seq_params);
 
     if (ref_based) {
         if (ref == NULL) {
@@ -953,6 +1633,28 @@ quip_quip_in_t* quip_quip_in_open(
 
     if (assembly_based) {
         quip_assembly_n = read_uint64(D->reader, D->reader_data);
+        if (header_version >= 5) {
+            quip_assembly_mem = read_uint64(D->reader, D->reader_data);
+        }
+    }
+
+    D->window = NULL;
+    D->window_filled = NULL;
+    D->window_size = D->window_len = D->window_pos = 0;
+    D->order_pos = 0;
+    D->order_prev = 0;
+
+    if (reordered) {
+        D->window_size = read_uint32(D->reader, D->reader_data);
+        if (D->window_size == 0) {
+            quip_error("Reordered reads have an empty window.");
+        }
+
+        D->window = malloc_or_die(D->window_size * sizeof(short_read_t));
+        for (i = 0; i < D->window_size; ++i) {
+            short_read_init(&D->window[i]);
+        }
+        D->window_filled = malloc_or_die(D->window_size * sizeof(bool));
     }
 
     /* read aux data */
@@ -965,8 +1667,23 @@ quip_quip_in_t* quip_quip_in_open(
 
     D->idenc   = idenc_alloc_decoder(id_buf_reader, (void*) D);
     D->auxenc  = samoptenc_alloc_decoder(aux_buf_reader, (void*) D);
+    quip_aux_t aux;
+    aux.fmt  = D->aux_data_type;
+    aux.data = D->aux_data;
+    D->header = quip_sam_aux_header(&aux);
+
+    primary_cache_init(&D->primaries,
+                       header_version >= 5 &&
+                       (aux.fmt == QUIP_FMT_SAM || aux.fmt == QUIP_FMT_BAM),
+                       false);
+    memset(D->chunk_copies, 0, chunk_size * sizeof(read_copy_t*));
+    D->chunk_has_copies = false;
+
     D->disassembler = disassembler_alloc(seq_buf_reader, (void*) D,
-                                         assembly_based, header_version, ref);
+                                         aln_buf_reader, (void*) D,
+                                         assembly_based, stored_contigs,
+                                         header_version,
+                                         &seq_params, ref, D->header);
     D->qualenc = qualenc_alloc_decoder(qual_buf_reader, (void*) D);
 
     return D;
@@ -986,14 +1703,25 @@ void quip_quip_in_close(quip_quip_in_t* D)
         short_read_free(&D->chunk[i]);
     }
 
+    if (D->window != NULL) {
+        for (i = 0; i < D->window_size; ++i) {
+            short_read_free(&D->window[i]);
+        }
+        free(D->window);
+    }
+    free(D->window_filled);
+
     str_free(&D->aux_data);
+    primary_cache_free(&D->primaries);
 
     idenc_free(D->idenc);
     samoptenc_free(D->auxenc);
     disassembler_free(D->disassembler);
+    bam_header_destroy(D->header);
     qualenc_free(D->qualenc);
     free(D->idbuf);
     free(D->auxbuf);
+    free(D->alnbuf);
     free(D->seqbuf);
     free(D->qualbuf);
     free(D->readlen_vals);
@@ -1061,6 +1789,7 @@ static void quip_in_read_block_header(quip_quip_in_t* D)
         cnt += qual_scheme_len;
     }
 
+
     /* read id byte count */
     read_uint32(D->reader, D->reader_data); /* uncompressed bytes */
     uint32_t id_byte_cnt = read_uint32(D->reader, D->reader_data);
@@ -1081,6 +1810,19 @@ static void quip_in_read_block_header(quip_quip_in_t* D)
     }
     D->exp_aux_crc = read_uint64(D->reader, D->reader_data);
 
+    /* read alignment byte count, since version 5 */
+    uint32_t aln_byte_cnt = 0;
+    if (D->version >= 5) {
+        read_uint32(D->reader, D->reader_data); /* uncompressed bytes */
+        aln_byte_cnt = read_uint32(D->reader, D->reader_data);
+        if (aln_byte_cnt > D->alnbuf_size) {
+            D->alnbuf_size = aln_byte_cnt;
+            free(D->alnbuf);
+            D->alnbuf = malloc_or_die(D->alnbuf_size * sizeof(uint8_t));
+        }
+        D->exp_aln_crc = read_uint64(D->reader, D->reader_data);
+    }
+
     /* read seq byte count */
     read_uint32(D->reader, D->reader_data); /* uncompressed bytes */
     uint32_t seq_byte_cnt = read_uint32(D->reader, D->reader_data);
@@ -1114,6 +1856,12 @@ static void quip_in_read_block_header(quip_quip_in_t* D)
     }
     D->auxbuf_pos = 0;
 
+    D->alnbuf_len = D->reader(D->reader_data, D->alnbuf, aln_byte_cnt);
+    if (D->alnbuf_len < aln_byte_cnt) {
+        quip_error("Unexpected end of file.");
+    }
+    D->alnbuf_pos = 0;
+
     D->seqbuf_len = D->reader(D->reader_data, D->seqbuf, seq_byte_cnt);
     if (D->seqbuf_len < seq_byte_cnt) {
         quip_error("Unexpected end of file.");
@@ -1140,13 +1888,101 @@ static void quip_in_read_block_header(quip_quip_in_t* D)
 
     D->id_crc   = 0;
     D->aux_crc  = 0;
+    D->aln_crc  = 0;
     D->seq_crc  = 0;
     D->qual_crc = 0;
     ++D->block_num;
 }
 
 
-short_read_t* quip_quip_read(quip_quip_in_t* D)
+/* Restore Ns in a read from quality scores, now that both have been
+ * decoded. */
+static void restore_n(const quip_quip_in_t* D, short_read_t* r)
+{
+    size_t j;
+    if (r->seq.n == r->qual.n) {
+        for (j = 0; j < r->seq.n; ++j) {
+            if (r->qual.s[j] == D->n_qual) r->seq.s[j] = 'N';
+        }
+    }
+}
+
+
+/* Read where each reordered read of the chunk stood in its window. */
+static void read_chunk_order(quip_quip_in_t* D, size_t cnt)
+{
+    size_t i;
+    bool same;
+    uint32_t x;
+    for (i = 0; i < cnt; ++i) {
+        if (D->order_pos == D->window_size) D->order_pos = 0;
+
+        disassembler_read_read_order(D->disassembler, &same, &x);
+        if (same) {
+            if (D->order_pos == 0 || x >= D->window_size - D->order_prev - 1) {
+                quip_error("A reordered read lies outside its window.");
+            }
+            x += D->order_prev + 1;
+        }
+        else if (x >= D->window_size) {
+            quip_error("A reordered read lies outside its window.");
+        }
+
+        D->chunk_order[i] = D->order_prev = x;
+        D->order_pos++;
+    }
+}
+
+
+/* Read what is coded for the next chunk, of the given size, ahead of its
+ * reads in the sequence stream: whether contigs are used from it on, the
+ * quality score of its Ns, where its reads stood if they were reordered, and
+ * which of its reads are copies. */
+static void read_chunk_header(quip_quip_in_t* D, size_t cnt)
+{
+    primary_cache_t* P = &D->primaries;
+
+    disassembler_start_chunk(D->disassembler);
+    D->n_qual = disassembler_read_n_qual(D->disassembler);
+
+    if (D->window != NULL) read_chunk_order(D, cnt);
+
+    memset(D->chunk_copies, 0, cnt * sizeof(read_copy_t*));
+    D->chunk_has_copies = false;
+
+    if (P->reads == NULL) return;
+
+    P->copies_len = disassembler_read_copy_count(D->disassembler);
+    if (P->copies_len > cnt) {
+        quip_error("A chunk has more copied reads than reads.");
+    }
+
+    if (P->copies_len > P->copies_size) {
+        P->copies_size = P->copies_len;
+        free(P->copies);
+        P->copies = malloc_or_die(P->copies_size * sizeof(read_copy_t));
+    }
+
+    size_t i;
+    uint32_t next = 0, skip;
+    for (i = 0; i < P->copies_len; ++i) {
+        disassembler_read_copy(D->disassembler, &skip,
+                               &P->copies[i].back, &P->copies[i].offset);
+        if (skip >= cnt - next) {
+            quip_error("A copied read lies outside its chunk.");
+        }
+
+        P->copies[i].idx = next + skip;
+        next = P->copies[i].idx + 1;
+
+        D->chunk_copies[P->copies[i].idx] = &P->copies[i];
+        D->chunk_has_copies = true;
+    }
+}
+
+
+/* Return the next read in the order it was coded, or NULL. */
+static short_read_t* quip_in_next_read(quip_quip_in_t* D)
 {
     if (D->chunk_pos < D->chunk_len) {
         return &D->chunk[D->chunk_pos++];
@@ -1167,6 +2003,12 @@ short_read_t* quip_quip_read(quip_quip_in_t* D)
                 "Aux data may be corrupt.", D->block_num);
         }
 
+        if (D->aln_crc != D->exp_aln_crc) {
+            quip_warning(
+                "Alignment checksums in block %u do not match. "
+                "Alignment data may be corrupt.", D->block_num);
+        }
+
         if (D->seq_crc != D->exp_seq_crc) {
             quip_warning(
                 "Sequence checksums in block %u do not match. "
@@ -1196,7 +2038,7 @@ short_read_t* quip_quip_read(quip_quip_in_t* D)
     }
 
     /* launch threads to decode a chunk of reads */
-    pthread_t id_thread, aux_thread, seq_thread, qual_thread;
+    pthread_t id_thread, aux_thread, aln_thread, seq_thread, qual_thread;
 
     pthread_attr_t attr;
     pthread_attr_init(&attr);
@@ -1204,11 +2046,27 @@ short_read_t* quip_quip_read(quip_quip_in_t* D)
 
     pthread_create_or_die(&id_thread,   &attr, id_decompressor_thread,   (void*) D);
     pthread_create_or_die(&aux_thread,  &attr, aux_decompressor_thread,  (void*) D);
-    pthread_create_or_die(&seq_thread,  &attr, seq_decompressor_thread,  (void*) D);
+
+    /* Qualities of copied reads are not coded, so copies must be known
+     * first. */
+    read_chunk_header(D, D->pending_reads >= chunk_size ?
+                            chunk_size : D->pending_reads);
+
     pthread_create_or_die(&qual_thread, &attr, qual_decompressor_thread, (void*) D);
 
+    /* Sequences aligned to a reference are decoded against it, so their
+     * alignments must be known first. */
+    bool separate_aln = D->version >= 5;
+    if (separate_aln) {
+        pthread_create_or_die(&aln_thread, &attr, aln_decompressor_thread, (void*) D);
+        if (D->ref_based) pthread_join_or_die(aln_thread, NULL);
+    }
+
+    pthread_create_or_die(&seq_thread,  &attr, seq_decompressor_thread,  (void*) D);
+
     pthread_join_or_die(id_thread,   NULL);
     pthread_join_or_die(aux_thread,  NULL);
+    if (separate_aln && !D->ref_based) pthread_join_or_die(aln_thread, NULL);
     pthread_join_or_die(seq_thread,  NULL);
     pthread_join_or_die(qual_thread, NULL);
 
@@ -1219,8 +2077,11 @@ short_read_t* quip_quip_read(quip_quip_in_t* D)
     D->chunk_pos = 0;
 
     D->pending_reads -= D->chunk_len;
-    size_t i;
+    size_t i, n;
+    short_read_t* r;
+
     for (i = 0; i < D->chunk_len; ++i) {
+        n = D->readlen_vals[D->readlen_idx];
         if (++D->readlen_off >= D->readlen_lens[D->readlen_idx]) {
             D->readlen_off = 0;
             D->readlen_idx++;
@@ -1230,12 +2091,77 @@ short_read_t* quip_quip_read(quip_quip_in_t* D)
             D->qual_scheme_off = 0;
             D->qual_scheme_idx++;
         }
+
+        r = &D->chunk[i];
+        if (D->chunk_copies[i] != NULL) {
+            primary_cache_restore(&D->primaries, D->chunk_copies[i], r, n);
+        }
+        else {
+            if (D->n_qual != 0) restore_n(D, r);
+            if (D->primaries.reads != NULL && is_primary(r)) {
+                primary_cache_add(&D->primaries, r);
+            }
+        }
+
+        if (D->n_qual != 0 || D->chunk_has_copies) {
+            D->seq_crc = crc64_update(r->seq.s, r->seq.n, D->seq_crc);
+        }
+
+        if (D->chunk_has_copies) {
+            D->qual_crc = crc64_update(r->qual.s, r->qual.n, D->qual_crc);
+        }
     }
 
     return &D->chunk[D->chunk_pos++];
 }
 
 
+/* Decode the next window of reordered reads, putting each where it stood. */
+static void quip_in_fill_window(quip_quip_in_t* D)
+{
+    memset(D->window_filled, 0, D->window_size * sizeof(bool));
+
+    short_read_t tmp;
+    short_read_t* r;
+    uint32_t idx;
+    size_t i, n = 0;
+    while (n < D->window_size && (r = quip_in_next_read(D)) != NULL) {
+        idx = D->chunk_order[D->chunk_pos - 1];
+        if (D->window_filled[idx]) {
+            quip_error("Two reordered reads stood in the same place.");
+        }
+
+        tmp = D->window[idx];
+        D->window[idx] = *r;
+        *r = tmp;
+        D->window_filled[idx] = true;
+        ++n;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (!D->window_filled[i]) {
+            quip_error("The reordered reads of a window are missing one.");
+        }
+    }
+
+    D->window_len = n;
+    D->window_pos = 0;
+}
+
+
+short_read_t* quip_quip_read(quip_quip_in_t* D)
+{
+    if (D->window == NULL) return quip_in_next_read(D);
+
+    if (D->window_pos == D->window_len) {
+        quip_in_fill_window(D);
+        if (D->window_len == 0) return NULL;
+    }
+
+    return &D->window[D->window_pos++];
+}
+
+
 void quip_list(quip_reader_t reader, void* reader_data, quip_list_t* l)
 {
     memset(l, 0, sizeof(quip_list_t));
@@ -1254,6 +2180,11 @@ void quip_list(quip_reader_t reader, void* reader_data, quip_list_t* l)
 
     check_header_version(header[6]);
 
+    if (header[6] >= 5) {
+        seqenc_params_t seq_params;
+        seqenc_read_params(reader, reader_data, &seq_params);
+    }
+
     if (header[7] & QUIP_FLAG_REFERENCE) {
         read_uint64(reader, reader_data); /* CRC */
         uint32_t fnlen = read_uint32(reader, reader_data); /* file name length */
@@ -1274,6 +2205,13 @@ void quip_list(quip_reader_t reader, void* reader_data, quip_list_t* l)
 
     if (header[7] & QUIP_FLAG_ASSEMBLED) {
         read_uint64(reader, reader_data); // quip_assembly_n
+        if (header[6] >= 5) {
+            read_uint64(reader, reader_data); // quip_assembly_mem
+        }
+    }
+
+    if (header[7] & QUIP_FLAG_REORDERED) {
+        read_uint32(reader, reader_data); /* reorder window */
     }
 
     /* read aux data */
@@ -1323,6 +2261,16 @@ void quip_list(quip_reader_t reader, void* reader_data, quip_list_t* l)
         block_bytes += n;
         read_uint64(reader, reader_data);
 
+        /* alignment byte-count and checksum */
+        if (header[6] >= 5) {
+            l->aln_bytes[0] += read_uint32(reader, reader_data);
+            n = read_uint32(reader, reader_data);
+            l->aln_bytes[1] += n;
+            block_bytes += n;
+            read_uint64(reader, reader_data);
+            l->header_bytes += 16;
+        }
+
         /* sequence byte-count and checksum */
         l->seq_bytes[0] += read_uint32(reader, reader_data);
         n = read_uint32(reader, reader_data);
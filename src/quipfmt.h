@@ -52,6 +52,7 @@ typedef struct quip_list_t_
     /* the uncompressed (0) and compressed (1) byte counts */
     uint64_t id_bytes[2];
     uint64_t aux_bytes[2];
+    uint64_t aln_bytes[2];
     uint64_t seq_bytes[2];
     uint64_t qual_bytes[2];
     uint64_t header_bytes;
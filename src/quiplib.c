@@ -16,6 +16,7 @@
 #endif
 
 bool quip_verbose = false;
+size_t quip_threads = 1;
 const char* quip_prog_name = "quip";
 const char* quip_in_fname = "";
 char* quip_out_fname = NULL;
@@ -201,14 +202,14 @@ void short_read_init(short_read_t* sr)
     str_init(&sr->id);
     str_init(&sr->seq);
     str_init(&sr->qual);
-    str_init(&sr->seqname);
-    str_init(&sr->mate_seqname);
     sr->aux = samopt_table_alloc();
     cigar_init(&sr->cigar);
     sr->flags    = BAM_FUNMAP;
+    sr->tid      = -1;
     sr->strand   = 0;
     sr->pos      = 0;
     sr->map_qual = 255;
+    sr->mate_tid = -1;
     sr->mate_pos = 0;
     sr->tlen     = 0;
 }
@@ -220,8 +221,6 @@ void short_read_free(short_read_t* sr)
         str_free(&sr->id);
         str_free(&sr->seq);
         str_free(&sr->qual);
-        str_free(&sr->seqname);
-        str_free(&sr->mate_seqname);
         samopt_table_free(sr->aux);
     }
 }
@@ -232,14 +231,14 @@ void short_read_copy(short_read_t* dest, const short_read_t* src)
     str_copy(&dest->id,   &src->id);
     str_copy(&dest->seq,  &src->seq);
     str_copy(&dest->qual, &src->qual);
-    str_copy(&dest->seqname, &src->seqname);
-    str_copy(&dest->mate_seqname, &src->mate_seqname);
     samopt_table_copy(dest->aux, src->aux);
     cigar_copy(&dest->cigar, &src->cigar);
     dest->flags    = src->flags;
+    dest->tid      = src->tid;
     dest->strand   = src->strand;
     dest->pos      = src->pos;
     dest->map_qual = src->map_qual;
+    dest->mate_tid = src->mate_tid;
     dest->mate_pos = src->mate_pos;
     dest->tlen     = src->tlen;
 }
@@ -0,0 +1,511 @@
+
+#include "refindex.h"
+#include "kmer.h"
+#include "misc.h"
+#include "twobit.h"
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+/* length of the indexed k-mers */
+static const size_t refindex_k = 20;
+
+/* bitmask for 2-bit encoded k-mers */
+static const kmer_t refindex_kmer_mask = 0x000000ffffffffffull;
+
+/* Number of consecutive k-mers among which one, the minimizer, is indexed.
+ * Any read with at least this many k-mers that matches the reference exactly
+ * somewhere shares a minimizer with it. */
+#define refindex_w 20
+
+/* Minimizers occurring more often than this (e.g., in repeats or runs of Ns)
+ * are not used to find candidate positions. */
+static const uint32_t refindex_max_occ = 32;
+
+
+/* The smallest hash, and its index, among the last refindex_w k-mers. Ties
+ * go to the leftmost, so that a read and the reference choose the same
+ * minimizer in a window they share. */
+typedef struct minimizer_window_t_
+{
+    uint64_t h[refindex_w];
+
+    /* number of k-mers seen */
+    uint64_t n;
+
+    /* index of the minimizer of the current window */
+    uint64_t min_i;
+
+    /* index of the last minimizer reported */
+    uint64_t last_i;
+} minimizer_window_t;
+
+
+static void window_init(minimizer_window_t* W)
+{
+    W->n = 0;
+    W->min_i = 0;
+    W->last_i = UINT64_MAX;
+}
+
+
+/* Add the hash of the next k-mer. Returns true, setting *i to its index, if
+ * this makes a new k-mer the minimizer of a complete window. */
+static bool window_push(minimizer_window_t* W, uint64_t h, uint64_t* i)
+{
+    uint64_t n = W->n++;
+    W->h[n % refindex_w] = h;
+
+    if (n >= refindex_w && W->min_i <= n - refindex_w) {
+        uint64_t j;
+        W->min_i = n - refindex_w + 1;
+        for (j = W->min_i + 1; j <= n; ++j) {
+            if (W->h[j % refindex_w] < W->h[W->min_i % refindex_w]) W->min_i = j;
+        }
+    }
+    else if (n == 0 || h < W->h[W->min_i % refindex_w]) {
+        W->min_i = n;
+    }
+
+    if (n + 1 < refindex_w || W->min_i == W->last_i) return false;
+
+    W->last_i = *i = W->min_i;
+    return true;
+}
+
+
+struct refindex_t_
+{
+    const seqmap_t* ref;
+
+    /* Position of each sequence in the concatenation of them all, followed
+     * by the total length. */
+    uint64_t* offsets;
+    size_t n;
+
+    /* Positions of minimizers in the concatenated reference, grouped by hash.
+     * Those whose hash h has (h & bucket_mask) == b are
+     * positions[buckets[b]], ..., positions[buckets[b + 1] - 1]. */
+    uint32_t* buckets;
+    uint32_t* positions;
+    uint64_t  bucket_mask;
+
+    /* If the buckets and positions were read from a cache, the mapped file
+     * holding them. */
+    void*  cache;
+    size_t cache_size;
+
+    /* read and its reverse complement, as they are mapped */
+    str_t     rc;
+    twobit_t* query[2];
+};
+
+
+/* Find the minimizers of a reference sequence, counting them in buckets, or,
+ * if fill is true, storing them at the positions the counts now indicate. */
+static void index_seq(refindex_t* I, const twobit_t* seq, uint64_t offset, bool fill)
+{
+    size_t len = twobit_len(seq);
+    minimizer_window_t W;
+    window_init(&W);
+
+    kmer_t x = 0;
+    uint64_t h, i, b;
+    size_t j;
+    for (j = 0; j < len; ++j) {
+        x = ((x << 2) | twobit_get(seq, j)) & refindex_kmer_mask;
+        if (j + 1 < refindex_k) continue;
+
+        if (!window_push(&W, kmer_hash(x), &i)) continue;
+
+        h = W.h[i % refindex_w];
+        b = h & I->bucket_mask;
+        if (fill) I->positions[I->buckets[b]++] = (uint32_t) (offset + i);
+        else      I->buckets[b + 1]++;
+    }
+}
+
+
+/* Build the index, for the sequences at the given offsets. */
+static void build_index(refindex_t* I)
+{
+    size_t bucket_count = I->bucket_mask + 1;
+    size_t i;
+
+    I->buckets = malloc_or_die((bucket_count + 1) * sizeof(uint32_t));
+    memset(I->buckets, 0, (bucket_count + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < I->n; ++i) {
+        index_seq(I, seqmap_get_nth(I->ref, i), I->offsets[i], false);
+    }
+
+    for (i = 1; i <= bucket_count; ++i) I->buckets[i] += I->buckets[i - 1];
+    I->positions = malloc_or_die(I->buckets[bucket_count] * sizeof(uint32_t));
+
+    /* buckets[b] is used as a cursor through the b-th bucket, after which it
+     * gives the start of the next */
+    for (i = 0; i < I->n; ++i) {
+        index_seq(I, seqmap_get_nth(I->ref, i), I->offsets[i], true);
+    }
+
+    for (i = bucket_count; i > 0; --i) I->buckets[i] = I->buckets[i - 1];
+    I->buckets[0] = 0;
+}
+
+
+/*
+ * Index cache.
+ *
+ * Building the index takes many times longer than reading a cached reference,
+ * so it is written to "<fn>.qpidx", beside the reference cache, and mapped
+ * into memory next time. The cache is in native byte order, and consists of a header,
+ *
+ *     magic, byte order mark, reference checksum, reference length, k, w,
+ *     number of buckets, number of minimizers
+ *
+ * each an 8-byte integer (but the magic, which is 8 characters), followed by
+ * the bucket offsets and then the positions, each a 4-byte integer.
+ *
+ * The cache is used only if the reference's checksum and length, and the
+ * parameters of the index, match those recorded. The checksum covers the
+ * names and nucleotides of the reference, so the cache follows it through any
+ * change, without needing to consult the FASTA file.
+ */
+
+#if HAVE_MMAP
+
+static const char     refindex_cache_magic[8] = {'Q', 'P', 'I', 'D', 'X', '\0', '\0', '\1'};
+static const uint64_t refindex_cache_bom = 0x0102030405060708ULL;
+
+typedef struct refindex_cache_header_t_
+{
+    char     magic[8];
+    uint64_t bom;
+    uint64_t crc;
+    uint64_t ref_len;
+    uint64_t k;
+    uint64_t w;
+    uint64_t bucket_count;
+    uint64_t position_count;
+} refindex_cache_header_t;
+
+
+static char* cache_fn(const char* fn)
+{
+    size_t n = strlen(fn);
+    char* cfn = malloc_or_die(n + 7);
+    memcpy(cfn, fn, n);
+    memcpy(cfn + n, ".qpidx", 7);
+    return cfn;
+}
+
+
+static void cache_header(const refindex_t* I, refindex_cache_header_t* h)
+{
+    memset(h, 0, sizeof(refindex_cache_header_t));
+    memcpy(h->magic, refindex_cache_magic, sizeof(refindex_cache_magic));
+    h->bom          = refindex_cache_bom;
+    h->crc          = seqmap_crc64(I->ref);
+    h->ref_len      = I->offsets[I->n];
+    h->k            = refindex_k;
+    h->w            = refindex_w;
+    h->bucket_count = I->bucket_mask + 1;
+}
+
+
+/* Try to read the index from the cache beside the given FASTA file, returning
+ * false if there is no usable cache. */
+static bool read_cache(refindex_t* I, const char* fn)
+{
+    char* cfn = cache_fn(fn);
+    int fd = open(cfn, O_RDONLY);
+    free(cfn);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(refindex_cache_header_t)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* cache = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) return false;
+
+    const refindex_cache_header_t* h = cache;
+    refindex_cache_header_t expected;
+    cache_header(I, &expected);
+
+    uint32_t* buckets = (uint32_t*) (h + 1);
+    size_t words = (size - sizeof(refindex_cache_header_t)) / sizeof(uint32_t);
+    size_t i;
+
+    if (memcmp(h->magic, expected.magic, sizeof(expected.magic)) != 0 ||
+        h->bom != expected.bom || h->crc != expected.crc ||
+        h->ref_len != expected.ref_len || h->k != expected.k ||
+        h->w != expected.w || h->bucket_count != expected.bucket_count ||
+        (size - sizeof(refindex_cache_header_t)) % sizeof(uint32_t) != 0 ||
+        h->position_count > UINT32_MAX ||
+        words != h->bucket_count + 1 + h->position_count) {
+        munmap(cache, size);
+        return false;
+    }
+
+    /* check that every bucket lies within the positions */
+    for (i = 0; i < h->bucket_count; ++i) {
+        if (buckets[i] > buckets[i + 1]) break;
+    }
+
+    if (buckets[0] != 0 || i < h->bucket_count ||
+        buckets[h->bucket_count] != h->position_count) {
+        munmap(cache, size);
+        return false;
+    }
+
+    I->cache = cache;
+    I->cache_size = size;
+    I->buckets = buckets;
+    I->positions = buckets + h->bucket_count + 1;
+
+    return true;
+}
+
+
+/* Write a cache of the index just built. Failing to do so (e.g., for lack of
+ * permission) is not an error. */
+static void write_cache(const refindex_t* I, const char* fn)
+{
+    char* cfn = cache_fn(fn);
+    char* tmp_fn = malloc_or_die(strlen(cfn) + 8);
+    sprintf(tmp_fn, "%s.XXXXXX", cfn);
+
+    /* write to a temporary file, which is renamed once complete, so a cache
+     * is never seen partially written */
+    int fd = mkstemp(tmp_fn);
+
+    /* mkstemp makes the file private, but others may use the same reference */
+    if (fd >= 0) fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    FILE* f = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (f == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_fn);
+        }
+
+        if (quip_verbose) fprintf(stderr, "\tunable to write %s\n", cfn);
+        free(tmp_fn);
+        free(cfn);
+        return;
+    }
+
+    refindex_cache_header_t h;
+    cache_header(I, &h);
+    h.position_count = I->buckets[h.bucket_count];
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(I->buckets, sizeof(uint32_t), h.bucket_count + 1, f) ==
+                  h.bucket_count + 1 &&
+              (h.position_count == 0 ||
+               fwrite(I->positions, sizeof(uint32_t), h.position_count, f) ==
+                  h.position_count);
+
+    if (fclose(f) != 0) ok = false;
+
+    if (ok && rename(tmp_fn, cfn) == 0) {
+        if (quip_verbose) fprintf(stderr, "\twrote %s\n", cfn);
+    }
+    else {
+        unlink(tmp_fn);
+        if (quip_verbose) fprintf(stderr, "\tunable to write %s\n", cfn);
+    }
+
+    free(tmp_fn);
+    free(cfn);
+}
+
+#endif
+
+
+refindex_t* refindex_alloc(const seqmap_t* ref)
+{
+    size_t n = seqmap_size(ref);
+    uint64_t* offsets = malloc_or_die((n + 1) * sizeof(uint64_t));
+
+    size_t i;
+    offsets[0] = 0;
+    for (i = 0; i < n; ++i) {
+        offsets[i + 1] = offsets[i] + twobit_len(seqmap_get_nth(ref, i));
+    }
+
+    if (offsets[n] > UINT32_MAX) {
+        quip_warning("The reference is too large to map unaligned reads to.");
+        free(offsets);
+        return NULL;
+    }
+
+    refindex_t* I = malloc_or_die(sizeof(refindex_t));
+    I->ref = ref;
+    I->offsets = offsets;
+    I->n = n;
+    I->cache = NULL;
+    I->cache_size = 0;
+
+    /* about one bucket for every two minimizers */
+    size_t bucket_count = 1024;
+    while (bucket_count < offsets[n] / (refindex_w + 1)) bucket_count *= 2;
+    I->bucket_mask = bucket_count - 1;
+
+    const char* fn = seqmap_fn(ref);
+
+#if HAVE_MMAP
+    if (fn != NULL && read_cache(I, fn)) {
+        if (quip_verbose) fprintf(stderr, "\tread cached index %s.qpidx\n", fn);
+    }
+    else
+#endif
+    {
+        if (quip_verbose) fprintf(stderr, "indexing reference ... ");
+
+        build_index(I);
+
+        if (quip_verbose) {
+            fprintf(stderr, "done. (%" PRIu32 " minimizers)\n", I->buckets[bucket_count]);
+        }
+
+#if HAVE_MMAP
+        if (fn != NULL) write_cache(I, fn);
+#endif
+    }
+
+    str_init(&I->rc);
+    I->query[0] = twobit_alloc();
+    I->query[1] = twobit_alloc();
+
+    return I;
+}
+
+
+void refindex_free(refindex_t* I)
+{
+    if (I == NULL) return;
+
+    free(I->offsets);
+#if HAVE_MMAP
+    if (I->cache != NULL) munmap(I->cache, I->cache_size);
+    else
+#endif
+    {
+        free(I->buckets);
+        free(I->positions);
+    }
+    str_free(&I->rc);
+    twobit_free(I->query[0]);
+    twobit_free(I->query[1]);
+    free(I);
+}
+
+
+/* Count mismatches between a query and the subject at the given position,
+ * stopping at max_miss. */
+static uint32_t count_mismatches(const twobit_t* subject, size_t spos,
+                                 const twobit_t* query, size_t n, uint32_t max_miss)
+{
+    uint32_t mismatches = 0;
+    size_t i = 0;
+    while (true) {
+        i += twobit_match_len(subject, spos + i, query, i, n - i);
+        if (i >= n || ++mismatches >= max_miss) break;
+        ++i;
+    }
+
+    return mismatches;
+}
+
+
+/* Index of the sequence containing the given position of the concatenated
+ * reference. */
+static size_t find_seq(const refindex_t* I, uint64_t pos)
+{
+    size_t i = 0, j = I->n, k;
+    while (j - i > 1) {
+        k = (i + j) / 2;
+        if (I->offsets[k] <= pos) i = k;
+        else                      j = k;
+    }
+
+    return i;
+}
+
+
+bool refindex_map(refindex_t* I, const uint8_t* seq, size_t n,
+                  uint32_t* seq_idx, uint32_t* pos, uint8_t* strand)
+{
+    if (n < refindex_k + refindex_w - 1) return false;
+
+    /* Beyond this, a read is likely cheaper to code on its own. */
+    const uint32_t max_miss = n / 8;
+    uint32_t best_miss = max_miss + 1;
+
+    str_reserve(&I->rc, n + 1);
+    memcpy(I->rc.s, seq, n);
+    I->rc.n = n;
+    str_revcomp(I->rc.s, n);
+
+    twobit_copy_str_n(I->query[0], (const char*) seq, n);
+    twobit_copy_str_n(I->query[1], (const char*) I->rc.s, n);
+
+    minimizer_window_t W;
+    const uint8_t* s;
+    const twobit_t* subject;
+    kmer_t x;
+    uint64_t i, b, start, last_start;
+    uint32_t k, miss;
+    size_t j, u;
+    uint8_t t;
+    for (t = 0; t < 2; ++t) {
+        s = t == 0 ? seq : I->rc.s;
+        window_init(&W);
+        x = 0;
+        last_start = UINT64_MAX;
+
+        for (j = 0; j < n; ++j) {
+            x = ((x << 2) | chartokmer[s[j]]) & refindex_kmer_mask;
+            if (j + 1 < refindex_k) continue;
+
+            if (!window_push(&W, kmer_hash(x), &i)) continue;
+
+            b = W.h[i % refindex_w] & I->bucket_mask;
+            if (I->buckets[b + 1] - I->buckets[b] > refindex_max_occ) continue;
+
+            for (k = I->buckets[b]; k < I->buckets[b + 1]; ++k) {
+                if (I->positions[k] < i) continue;
+                start = I->positions[k] - i;
+                if (start == last_start) continue;
+                last_start = start;
+
+                u = find_seq(I, start);
+                subject = seqmap_get_nth(I->ref, u);
+                if (start - I->offsets[u] + n > twobit_len(subject)) continue;
+
+                miss = count_mismatches(subject, start - I->offsets[u],
+                                        I->query[t], n, best_miss);
+                if (miss < best_miss) {
+                    best_miss = miss;
+                    *seq_idx = u;
+                    *pos     = start - I->offsets[u];
+                    *strand  = t;
+                    if (miss == 0) return true;
+                }
+            }
+        }
+    }
+
+    return best_miss <= max_miss;
+}
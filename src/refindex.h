@@ -0,0 +1,36 @@
+/*
+ * This file is part of quip.
+ *
+ * Copyright (c) 2012 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ */
+
+/*
+ * refindex:
+ * An index of the minimizers of a reference sequence set, used to find where
+ * unaligned reads came from, so that they can be coded against the reference.
+ *
+ */
+
+#ifndef QUIP_REFINDEX
+#define QUIP_REFINDEX
+
+#include "quip.h"
+#include "seqmap.h"
+
+typedef struct refindex_t_ refindex_t;
+
+/* Index the given reference, which must outlive the index. If the reference
+ * is too large to be indexed, a warning is printed and NULL returned. */
+refindex_t* refindex_alloc(const seqmap_t*);
+void        refindex_free(refindex_t*);
+
+/* Find a position at which a read matches the reference with few enough
+ * mismatches that it is worth coding that way, setting *seq_idx to the index
+ * of the reference sequence (as by seqmap_get_nth), *pos to the position in
+ * it, and *strand to 1 if it is the read's reverse complement that matches.
+ * Returns false if there is no such position. */
+bool refindex_map(refindex_t*, const uint8_t* seq, size_t n,
+                  uint32_t* seq_idx, uint32_t* pos, uint8_t* strand);
+
+#endif
@@ -105,6 +105,8 @@ typedef struct {
 #define BAM_FQCFAIL      512
 /*! @abstract optical or PCR duplicate */
 #define BAM_FDUP        1024
+/*! @abstract supplementary alignment */
+#define BAM_FSUPP       2048
 
 #define BAM_OFDEC          0
 #define BAM_OFHEX          1
@@ -7,26 +7,21 @@
 #include <inttypes.h>
 #include <assert.h>
 
+/* defined in sam/bam_aux.c */
+void bam_init_header_hash(bam_header_t *header);
+
 struct quip_sam_out_t_
 {
     samfile_t* f;
     bam1_t* b;
 };
 
-quip_sam_out_t* quip_sam_out_open(
-    quip_writer_t     writer,
-    void*             writer_data,
-    quip_opt_t        opts,
-    const quip_aux_t* aux)
+bam_header_t* quip_sam_aux_header(const quip_aux_t* aux)
 {
-    quip_sam_out_t* out = malloc_or_die(sizeof(quip_sam_out_t));
-
-    bool binary = (opts & QUIP_OPT_SAM_BAM) != 0;
-
     bam_header_t* header = bam_header_init();
 
     const char* header_text;
-    if (aux->fmt == QUIP_FMT_SAM || aux->fmt == QUIP_FMT_BAM) {
+    if (aux != NULL && (aux->fmt == QUIP_FMT_SAM || aux->fmt == QUIP_FMT_BAM)) {
         header_text = (const char*) aux->data.s;
         header->n_text = header->l_text = aux->data.n;
     }
@@ -39,7 +34,23 @@ quip_sam_out_t* quip_sam_out_open(
     memcpy(header->text, header_text, header->l_text);
     header->text[header->l_text] = '\0';
     sam_header_parse(header);
+    bam_init_header_hash(header);
+
+    return header;
+}
+
 
+quip_sam_out_t* quip_sam_out_open(
+    quip_writer_t     writer,
+    void*             writer_data,
+    quip_opt_t        opts,
+    const quip_aux_t* aux)
+{
+    quip_sam_out_t* out = malloc_or_die(sizeof(quip_sam_out_t));
+
+    bool binary = (opts & QUIP_OPT_SAM_BAM) != 0;
+
+    bam_header_t* header = quip_sam_aux_header(aux);
     out->f = samopen_out(writer, writer_data, binary, (void*) header);
 
     bam_header_destroy(header);
@@ -168,9 +179,6 @@ void quip_sam_write(quip_sam_out_t* out, short_read_t* r)
     bam1_t*      b = out->b;
     bam1_core_t* c = &b->core;
 
-    bool aligned      = !(r->flags & BAM_FUNMAP);
-    bool mate_aligned = !(r->flags & BAM_FMUNMAP);
-
     size_t i, doff = 0;
 
     /* 1. qname */
@@ -182,11 +190,11 @@ void quip_sam_write(quip_sam_out_t* out, short_read_t* r)
     /* 2. flags */
     c->flag = r->flags;
 
-    /* 3. rname */
-    c->tid = aligned ? bam_get_tid(out->f->header, (char*) r->seqname.s) : -1;
+    /* 3. rname (which an unaligned read may still be placed at) */
+    c->tid = r->tid;
 
     /* 4. position */
-    c->pos = aligned ? (int32_t) r->pos : -1;
+    c->pos = r->tid >= 0 ? (int32_t) r->pos : -1;
 
     /* 5. mapq */
     c->qual = r->map_qual;
@@ -203,11 +211,10 @@ void quip_sam_write(quip_sam_out_t* out, short_read_t* r)
     c->bin = bam_reg2bin(c->pos, bam_calend(c, bam1_cigar(b)));
 
     /* 7. rnext */
-    c->mtid = (mate_aligned && r->mate_seqname.n > 0) ?
-        bam_get_tid(out->f->header, (char*) r->mate_seqname.s) : -1;
+    c->mtid = r->mate_tid;
 
     /* 8. pnext */
-    c->mpos = mate_aligned ? (int32_t) r->mate_pos : -1;
+    c->mpos = r->mate_tid >= 0 ? (int32_t) r->mate_pos : -1;
 
     /* 9. tlen */
     c->isize = r->tlen;
@@ -229,17 +236,11 @@ void quip_sam_write(quip_sam_out_t* out, short_read_t* r)
         doff += (c->l_qseq + 1) / 2;
         s = b->data + doff;
 
-        if (r->qual.n == 0) {
-            s[i] = 0xff;
-            ++doff;
-        }
-        else {
-            for (i = 0; i < r->seq.n; ++i) {
-                u = r->qual.s[r->qual.n - 1 - i];
-                s[i] = u - 33;
-            }
-            doff += c->l_qseq;
+        for (i = 0; i < r->seq.n; ++i) {
+            u = r->qual.s[r->qual.n - 1 - i];
+            s[i] = u - 33;
         }
+        doff += c->l_qseq;
     }
     else {
         for (i = 0; i < r->seq.n; ++i) {
@@ -248,16 +249,10 @@ void quip_sam_write(quip_sam_out_t* out, short_read_t* r)
         doff += (c->l_qseq + 1) / 2;
         s = b->data + doff;
 
-        if (r->qual.n == 0) {
-            s[i] = 0xff;
-            ++doff;
-        }
-        else {
-            for (i = 0; i < r->seq.n; ++i) {
-                s[i] = r->qual.s[i] - 33;
-            }
-            doff += c->l_qseq;
+        for (i = 0; i < r->seq.n; ++i) {
+            s[i] = r->qual.s[i] - 33;
         }
+        doff += c->l_qseq;
     }
 
     /* 12. aux */
@@ -275,9 +270,52 @@ struct quip_sam_in_t_
     samfile_t* f;
     bam1_t* b;
     short_read_t r;
+
+    /* If the reference sequences of a BAM file's binary header are not
+     * listed in the same order in its text (which is what is kept as
+     * auxiliary data), the index in the latter of each in the former, or
+     * else NULL. */
+    int32_t* tid_map;
 };
 
 
+/* Check that the reference sequences listed in the header's text, from which
+ * the header is reconstructed when decompressing, are in the same order as
+ * those that tids in the input refer to, and if not, make a table to
+ * translate between them. */
+static void make_tid_map(quip_sam_in_t* in)
+{
+    in->tid_map = NULL;
+
+    const bam_header_t* header = in->f->header;
+    if (header == NULL || header->n_targets == 0) return;
+
+    quip_aux_t aux;
+    aux.fmt = QUIP_FMT_SAM;
+    aux.data.s = (uint8_t*) header->text;
+    aux.data.n = header->l_text;
+    bam_header_t* alt = quip_sam_aux_header(&aux);
+
+    /* with no sequences in the text, they are added to it in order */
+    int32_t i;
+    if (alt->n_targets > 0) {
+        for (i = 0; i < header->n_targets; ++i) {
+            if (i >= alt->n_targets ||
+                strcmp(header->target_name[i], alt->target_name[i]) != 0) break;
+        }
+
+        if (i < header->n_targets) {
+            in->tid_map = malloc_or_die(header->n_targets * sizeof(int32_t));
+            for (i = 0; i < header->n_targets; ++i) {
+                in->tid_map[i] = bam_get_tid(alt, header->target_name[i]);
+            }
+        }
+    }
+
+    bam_header_destroy(alt);
+}
+
+
 quip_sam_in_t* quip_sam_in_open(
                     quip_reader_t reader,
                     void*         reader_data,
@@ -297,6 +335,7 @@ quip_sam_in_t* quip_sam_in_open(
 
     in->b = bam_init1();
     short_read_init(&in->r);
+    make_tid_map(in);
 
     return in;
 }
@@ -308,6 +347,7 @@ void quip_sam_in_close(quip_sam_in_t* in)
         samclose(in->f);
         bam_destroy1(in->b);
         short_read_free(&in->r);
+        free(in->tid_map);
         free(in);
     }
 }
@@ -341,11 +381,16 @@ void quip_sam_get_aux(quip_sam_in_t* in, quip_aux_t* aux)
         }
     }
     else {
-        size_t max_bytes;
+        /* reserve space for all at once, since there may be very many */
+        size_t max_bytes, total_bytes = 0;
         int i;
+        for (i = 0; i < in->f->header->n_targets; ++i) {
+            total_bytes += 22 + strlen(in->f->header->target_name[i]);
+        }
+        str_reserve_extra(&aux->data, total_bytes);
+
         for (i = 0; i < in->f->header->n_targets; ++i) {
             max_bytes = 22 + strlen(in->f->header->target_name[i]);
-            str_reserve_extra(&aux->data, max_bytes);
             aux->data.n += snprintf(
                     (char*) aux->data.s + aux->data.n,
                     max_bytes,
@@ -378,6 +423,9 @@ short_read_t* quip_sam_read(quip_sam_in_t* in)
 
     str_reserve(&in->r.qual, readlen + 1);
     uint8_t* bamqual = (uint8_t*) bam1_qual(in->b);
+    if (readlen > 0 && bamqual[0] == 0xff) {
+        quip_error("Reads with a sequence but no quality scores are not supported.");
+    }
     for (i = 0; i < readlen; ++i) {
         in->r.qual.s[i] = bamqual[i] + 33;
     }
@@ -395,27 +443,15 @@ short_read_t* quip_sam_read(quip_sam_in_t* in)
     in->r.pos      = in->b->core.pos;
     in->r.map_qual = in->b->core.qual;
 
-    if (in->f->header && in->b->core.tid >= 0) {
-        str_copy_cstr(
-            &in->r.seqname,
-            in->f->header->target_name[in->b->core.tid],
-            strlen(in->f->header->target_name[in->b->core.tid]));
-    }
-    else in->r.seqname.n = 0;
-
-    if (in->f->header && in->b->core.mtid >= 0) {
-        if (in->b->core.mtid == in->b->core.tid) {
-            in->r.mate_seqname.n = 0;
-            str_append_cstr(&in->r.mate_seqname, "=");
-        }
-        else {
-            str_copy_cstr(
-                &in->r.mate_seqname,
-                in->f->header->target_name[in->b->core.mtid],
-                strlen(in->f->header->target_name[in->b->core.mtid]));
-        }
+    in->r.tid      = in->b->core.tid;
+    in->r.mate_tid = in->b->core.mtid;
+    if (in->tid_map) {
+        int32_t n = in->f->header->n_targets;
+        in->r.tid = in->r.tid >= 0 && in->r.tid < n ?
+            in->tid_map[in->r.tid] : -1;
+        in->r.mate_tid = in->r.mate_tid >= 0 && in->r.mate_tid < n ?
+            in->tid_map[in->r.mate_tid] : -1;
     }
-    else in->r.mate_seqname.n = 0;
 
     in->r.mate_pos = in->b->core.mpos;
     in->r.tlen = in->b->core.isize;
@@ -9,6 +9,7 @@
 #define QUIP_SAMFMT
 
 #include "quip.h"
+#include "sam/bam.h"
 
 typedef struct quip_sam_out_t_ quip_sam_out_t;
 
@@ -18,6 +19,11 @@ quip_sam_out_t* quip_sam_out_open(
                     quip_opt_t        opts,
                     const quip_aux_t* aux);
 
+/* The SAM/BAM header given by auxiliary data (or a minimal header, if the
+ * data is not from a SAM/BAM file), with its reference sequences indexed in
+ * the order that read tids refer to them. Free with bam_header_destroy. */
+bam_header_t* quip_sam_aux_header(const quip_aux_t* aux);
+
 void quip_sam_out_close(quip_sam_out_t*);
 void quip_sam_write(quip_sam_out_t*, short_read_t*);
 
@@ -473,7 +473,11 @@ void samoptenc_encode(samoptenc_t* E, const samopt_table_t* T)
     samopt_t* opt;
     size_t i, j;
     for (i = 0; i < T->n; ++i) {
-        if (samopt_table_empty(&T->xs[i])) continue;
+        /* Skip fields left over from a previous read in the same table, so
+         * that the types of absent fields, which enter into the checksum, are
+         * those last decoded, however reads are assigned to tables. */
+        if (samopt_table_empty(&T->xs[i]) ||
+            T->xs[i].data == NULL || T->xs[i].data->n == 0) continue;
         opt = samopt_table_get_priv(E->last, T->xs[i].key);
 
         if (samopt_table_empty(opt)) {
@@ -10,13 +10,50 @@
 #include <string.h>
 
 
-/* Order of the markov chain assigning probabilities to dinucleotides. */
-static const size_t k = 11;
+/* Order of the markov chain assigning probabilities to dinucleotides, and
+ * roughly the most memory it may use. */
+size_t quip_seq_order = 11;
+size_t quip_seq_mem   = 512 * 1024 * 1024;
+
+/* Since version 5, rather than each sequence having a model of positions on
+ * it, sequences whose lengths are within a factor of two share one, so that
+ * memory does not grow with the number of sequences (of which a transcriptome
+ * or draft assembly may have millions). */
+#define pos_model_bins 34
+
+/* Nucleotides coded per symbol. */
+size_t quip_seq_symbol_len = 2;
+
+/* Interleaved sub-streams used to code nucleotides. */
+size_t quip_seq_lanes = 1;
+
+/* Recent reads searched for duplicates, as a power of two. */
+size_t quip_seq_dup_bits = 0;
+
+/* Largest such window. */
+static const size_t max_dup_bits = 24;
+
+/* Order used by version 4 and earlier. */
+static const size_t v4_order = 11;
+
+/* Bounds on the number of contexts in the nucleotide model. */
+static const size_t min_ctx_bits = 10;
+static const size_t max_ctx_bits = 31;
+
+/* Multiplier used to hash contexts too long to index directly. */
+static const kmer_t ctx_hash_mult = 0x9e3779b97f4a7c15ULL;
 
 /* Use a seperate model for the first n dinucleotides. This is primarily to
  * account for positional sequence bias that is sommon in short read sequencing.  */
 static const size_t prefix_len = 4;
 
+/* Likewise, for the first n tetranucleotides when coding four nucleotides per
+ * symbol. */
+#define tetra_prefix_len 2
+
+/* Largest number of interleaved nucleotide sub-streams. */
+#define max_lanes 4
+
 /* The rate at which the nucleotide markov chain is updated. */
 static const size_t seq_update_rate   = 1;
 static const size_t motif_update_rate = 4;
@@ -24,6 +61,9 @@ static const size_t motif_update_rate = 4;
 /* Initial pseudocount biasing contig motifs towards the consensus sequence.  */
 static const uint16_t contig_motif_prior = 50;
 
+/* Order of the markov chain used to code contigs stored in the file. */
+#define contig_order 8
+
 enum {
     SEQENC_TYPE_SEQUENCE = 0,
     SEQENC_TYPE_ALIGNMENT
@@ -35,27 +75,146 @@ enum {
 };
 
 
+/* Compressed input of one nucleotide sub-stream while decoding. */
+typedef struct lane_buf_t_
+{
+    uint8_t* buf;
+    size_t len, size, pos;
+} lane_buf_t;
+
+
+/* Since version 5, a read whose mate was seen earlier need not code its mate's
+ * position or the template length, which are just those of the mate with the
+ * roles reversed. We keep a table of reads whose mates have yet to be seen,
+ * indexed by where their mates are. Reads colliding in this table overwrite
+ * one another, which costs only the opportunity to use them. */
+#define pending_mates_bits 16
+
+typedef struct pending_mate_t_
+{
+    int32_t  tid;
+    uint32_t pos;
+    int32_t  mate_tid;
+    uint32_t mate_pos;
+    int32_t  tlen;
+    bool     used;
+} pending_mate_t;
+
+
+/* Since version 5, the flags, map quality, and cigar of an aligned read are
+ * usually one of a few combinations seen recently, so we keep them in a small
+ * move-to-front list and code only the index where they are found, or
+ * sig_cache_size if they are not. */
+#define sig_cache_size 15
+
+typedef struct alignment_sig_t_
+{
+    uint32_t flags;
+    uint8_t  map_qual;
+    cigar_t  cigar;
+} alignment_sig_t;
+
+
 struct seqenc_t_
 {
     /* coder */
     ac_t* ac;
 
+    /* coder for alignments (seqenc_encode_extras), which since version 5
+     * are a stream of their own, and are otherwise coded with the sequences
+     * by ac */
+    ac_t* aln_ac;
+
+    /* quip header version being written or read */
+    uint8_t quip_version;
+
+    /* model parameters */
+    seqenc_params_t params;
+
     /* bitmask for two bit encoded context */
-    uint32_t ctx_mask;
-    uint32_t ctx0_mask;
+    kmer_t ctx_mask;
 
-    /* nucleotide probability given the last k nucleotides */
+    /* shift applied to hashed contexts, or 0 if contexts index directly */
+    unsigned int ctx_hash_shift;
+
+    /* nucleotide probability given the last params.order nucleotides */
     cond_dist16_t cs;
 
     /* special case models for the first 2 * prefix_les positions. */
     cond_dist16_t cs0[5];
 
+    /* tetranucleotide models used in place of cs and cs0 when coding four
+     * nucleotides per symbol */
+    cond_dist256_t cs4;
+    cond_dist256_t cs4_0[tetra_prefix_len];
+
+    /* Coders for the interleaved sub-streams when params.lanes > 1. The
+     * nucleotides and N masks of each group of params.lanes consecutive
+     * unaligned reads are coded together, one read per lane, alternating
+     * between lanes one symbol at a time. Everything else goes to ac. */
+    ac_t* lane_ac[max_lanes];
+    lane_buf_t lane_in[max_lanes];
+
+    /* reads in the current group: copies while encoding, and the
+     * destination of the decoded sequence while decoding */
+    size_t   lane_count;
+    str_t    lane_seq[max_lanes];
+    uint8_t* lane_out[max_lanes];
+    size_t   lane_len[max_lanes];
+    uint64_t lane_dup_idx[max_lanes];
+
+    /* The last 2^params.dup_bits reads' sequences, indexed by their number
+     * modulo the window size, as they are decoded, so with Ns as 'A' when they
+     * are to be restored from qualities. Only reads that go through the
+     * duplicate check are numbered and stored. */
+    str_t*   dup_hist;
+    uint64_t dup_n;   /* number of reads checked so far */
+    uint64_t dup_cur; /* number of the current read */
+
+    /* While encoding, a hash table giving the number plus one of the last
+     * read inserted with a given hash. */
+    uint64_t* dup_table;
+    str_t     dup_tmp;
+
+    /* duplicate flag and distance to the duplicated read */
+    dist2_t      d_dup;
+    uint32_enc_t d_dup_dist;
+
+    /* whether a read contains any N */
+    dist2_t d_nmask_flag;
+
+    /* distance to the next run of Ns, and the length of the run */
+    uint32_enc_t d_nmask_gap;
+    uint32_enc_t d_nmask_run;
+
+    /* Quality score carried by every N in the current chunk, in which case
+     * Ns are recovered from qualities rather than coded, or 0. */
+    uint8_t n_qual;
+    dist256_t d_n_qual;
+
+    /* per-position N mask used by version 4 and earlier */
     dist2_t* d_nmask;
     size_t nmask_n; /* maximum read length supported by d_nmask */
 
     /* binary distribution of unique (0) / match (1) */
     dist2_t d_type;
 
+    /* Since version 5, the number of reads in a chunk of SAM/BAM input that
+     * are copies of recent primary alignments, and for each, the number of
+     * reads since the last copy, how many primary alignments back it is
+     * copied from, and where in the primary it starts. */
+    uint32_enc_t d_copy_count;
+    uint32_enc_t d_copy_skip;
+    uint32_enc_t d_copy_back;
+    uint32_enc_t d_copy_offset;
+
+    /* Where each reordered read stood in its window: whether it shares its
+     * minimizer with the read before it, and if so, the gap between their
+     * indexes, and otherwise its index. */
+    dist2_t      d_order_same;
+    uint32_enc_t d_order_gap;
+    uint32_enc_t d_order_idx;
+
     /* distribution over match strand */
     dist2_t d_aln_strand;
 
@@ -65,6 +224,24 @@ struct seqenc_t_
     /* distribution over match/mismatces in reference alignments */
     dist2_t d_ref_match;
 
+    /* Since version 5, aligned bases are instead coded as the number of
+     * matches before each mismatch, and the mismatching nucleotide,
+     * conditioned on the reference nucleotide. */
+    uint32_enc_t d_ref_run;
+    cond_dist4_t d_ref_mismatch;
+
+    /* read being encoded, two bits per nucleotide, with Ns in aligned
+     * positions taking the reference nucleotide, so that they match */
+    twobit_t* ref_query;
+
+    /* Since version 5, when there is a reference, whether an unaligned read
+     * was mapped to it, and if so, the index of the reference sequence, the
+     * position within it, and the strand. */
+    dist2_t      d_refmap;
+    uint32_enc_t d_refmap_seq;
+    uint32_enc_t d_refmap_pos;
+    dist2_t      d_refmap_strand;
+
     /* distribution over inserted nucleotides in reference alignment */
     dist4_t d_ref_ins_nuc;
 
@@ -74,12 +251,28 @@ struct seqenc_t_
     /* reference sequence set, or NULL if none */
     const seqmap_t* ref;
 
+    /* SAM/BAM header listing the sequences that reads are aligned to, by
+     * tid, or NULL, and the number of them */
+    const bam_header_t* header;
+    int32_t n_targets;
+
+    /* the reference sequence for each of those, or NULL where the reference
+     * has none of that name (NULL altogether, without a reference) */
+    const twobit_t** target_seqs;
+
     /* temporary space to compute reverse complements */
     str_t tmpseq;
 
     /* assign sequential indexes to sequences */
     strmap_t* seq_index;
 
+    /* Index of the position model of each bin of sequences (as given by
+     * pos_model_bin), or UINT32_MAX if one has not yet been needed. */
+    uint32_t tid_pos_idx[pos_model_bins];
+
+    /* sequence name as decoded from older versions */
+    str_t tmpname;
+
     /* distribution used to compress the "extra" fields in
      * the short_read_t structure. */
 
@@ -89,8 +282,14 @@ struct seqenc_t_
     /* sequence name */
     cond_dist128_t  d_ext_seqname;
 
+    /* sequence tid (plus one), and whether it is the previous read's */
+    int32_t         last_tid;
+    dist2_t         d_ext_tid_same;
+    uint32_enc_t    d_ext_tid;
+
     /* genomic position, conditioned on sequence index */
     uint32_enc_t*   d_ext_pos;
+    size_t          d_ext_pos_n;
 
     /* genomic position as offset from the previous */
     uint32_t        last_ref_pos;
@@ -114,35 +313,226 @@ struct seqenc_t_
 
     /* template length */
     uint32_enc_t    d_ext_tlen;
+
+    /* reads whose mates have yet to be seen, or NULL until needed */
+    pending_mate_t* pending_mates;
+
+    /* whether a read is its pending mate's mate */
+    dist2_t         d_ext_mate_match;
+
+    /* whether an unaligned read (or mate) is placed where expected */
+    dist2_t         d_ext_placed;
+
+    /* recent alignment signatures, most recent first */
+    alignment_sig_t sigs[sig_cache_size];
+    size_t          sigs_len;
+
+    /* index of the signature in the list, conditioned on the previous */
+    uint8_t         last_sig;
+    cond_dist16_t   d_ext_sig;
 };
 
 
-static void seqenc_init(seqenc_t* E, const seqmap_t* ref)
+void seqenc_params_init(seqenc_params_t* params, size_t order, size_t symbol_len,
+                        size_t lanes, size_t dup_bits, size_t mem)
+{
+    if (order < 1 || order > 32) {
+        quip_error("Sequence model order must be between 1 and 32.");
+    }
+
+    if (symbol_len != 2 && symbol_len != 4) {
+        quip_error("Nucleotides must be coded two or four at a time.");
+    }
+
+    if (lanes != 1 && lanes != 2 && lanes != 4) {
+        quip_error("The number of sequence lanes must be 1, 2, or 4.");
+    }
+
+    if (dup_bits > max_dup_bits) {
+        quip_error("The duplicate read window may be at most 2^%zu reads.",
+                   max_dup_bits);
+    }
+
+    size_t ctx_size = symbol_len == 4 ? sizeof(dist256_t) : sizeof(dist16_t);
+    size_t ctx_bits = 2 * order;
+    while (ctx_bits > max_ctx_bits ||
+           (ctx_bits > min_ctx_bits &&
+            ((size_t) 1 << ctx_bits) * ctx_size > mem)) {
+        --ctx_bits;
+    }
+
+    params->order      = order;
+    params->ctx_bits   = ctx_bits;
+    params->symbol_len = symbol_len;
+    params->lanes      = lanes;
+    params->dup_bits   = dup_bits;
+}
+
+
+void seqenc_params_init_v4(seqenc_params_t* params)
 {
+    params->order      = v4_order;
+    params->ctx_bits   = 2 * v4_order;
+    params->symbol_len = 2;
+    params->lanes      = 1;
+    params->dup_bits   = 0;
+}
+
+
+void seqenc_write_params(quip_writer_t writer, void* writer_data,
+                         const seqenc_params_t* params)
+{
+    write_uint8(writer, writer_data, params->order);
+    write_uint8(writer, writer_data, params->ctx_bits);
+    write_uint8(writer, writer_data, params->symbol_len);
+    write_uint8(writer, writer_data, params->lanes);
+    write_uint8(writer, writer_data, params->dup_bits);
+}
+
+
+void seqenc_read_params(quip_reader_t reader, void* reader_data,
+                        seqenc_params_t* params)
+{
+    params->order      = read_uint8(reader, reader_data);
+    params->ctx_bits   = read_uint8(reader, reader_data);
+    params->symbol_len = read_uint8(reader, reader_data);
+    params->lanes      = read_uint8(reader, reader_data);
+    params->dup_bits   = read_uint8(reader, reader_data);
+
+    if (params->order < 1 || params->order > 32 ||
+        params->ctx_bits > 2 * params->order ||
+        params->ctx_bits > max_ctx_bits ||
+        (params->symbol_len != 2 && params->symbol_len != 4) ||
+        (params->lanes != 1 && params->lanes != 2 && params->lanes != 4) ||
+        params->dup_bits > max_dup_bits) {
+        quip_error("Invalid sequence model parameters.");
+    }
+}
+
+
+/* Index into the nucleotide model of a two bit encoded context. */
+static inline uint32_t ctx_idx(const seqenc_t* E, kmer_t ctx)
+{
+    if (E->ctx_hash_shift == 0) return (uint32_t) ctx;
+    else return (uint32_t) ((ctx * ctx_hash_mult) >> E->ctx_hash_shift);
+}
+
+
+static void seqenc_init(seqenc_t* E, uint8_t quip_version,
+                        const seqenc_params_t* params, const seqmap_t* ref,
+                        const bam_header_t* header)
+{
+    size_t i;
+
+    E->quip_version = quip_version;
+    E->params = *params;
     E->ref = ref;
+
+    /* Sequences are looked up by name once, here, rather than for every
+     * read. */
+    E->header = header;
+    E->n_targets = header == NULL ? 0 : header->n_targets;
+    E->target_seqs = NULL;
+    if (ref != NULL && E->n_targets > 0) {
+        E->target_seqs = malloc_or_die(E->n_targets * sizeof(twobit_t*));
+        for (i = 0; i < (size_t) E->n_targets; ++i) {
+            E->target_seqs[i] = seqmap_get(ref, header->target_name[i]);
+        }
+    }
+
+    for (i = 0; i < pos_model_bins; ++i) {
+        E->tid_pos_idx[i] = UINT32_MAX;
+    }
+    str_init(&E->tmpname);
     str_init(&E->tmpseq);
 
-    size_t N = 1 << (2 * k);
-    E->ctx_mask = N - 1;
+    E->lane_count = 0;
+    for (i = 0; i < max_lanes; ++i) {
+        E->lane_ac[i] = NULL;
+        memset(&E->lane_in[i], 0, sizeof(lane_buf_t));
+        str_init(&E->lane_seq[i]);
+        E->lane_out[i] = NULL;
+        E->lane_len[i] = 0;
+        E->lane_dup_idx[i] = 0;
+    }
+
+    E->dup_hist = NULL;
+    E->dup_table = NULL;
+    E->dup_n = 0;
+    E->dup_cur = 0;
+    str_init(&E->dup_tmp);
+    if (params->dup_bits > 0) {
+        size_t dup_window = (size_t) 1 << params->dup_bits;
+        E->dup_hist = malloc_or_die(dup_window * sizeof(str_t));
+        for (i = 0; i < dup_window; ++i) str_init(&E->dup_hist[i]);
+    }
+    dist2_init(&E->d_dup);
+    uint32_enc_init(&E->d_dup_dist);
 
-    cond_dist16_init(&E->cs, N);
-    cond_dist16_set_update_rate(&E->cs, seq_update_rate);
+    E->ctx_mask = params->order >= 32 ?
+        ~(kmer_t) 0 : ((kmer_t) 1 << (2 * params->order)) - 1;
+    E->ctx_hash_shift =
+        params->ctx_bits < 2 * params->order ? 64 - params->ctx_bits : 0;
 
-    size_t i;
-    for (i = 0; i < prefix_len; ++i) {
-        cond_dist16_init(&E->cs0[i], 1 << (4 * i));
-        cond_dist16_set_update_rate(&E->cs0[i], seq_update_rate);
+    size_t N = (size_t) 1 << params->ctx_bits;
+
+    memset(&E->cs, 0, sizeof(cond_dist16_t));
+    memset(E->cs0, 0, sizeof(E->cs0));
+    memset(&E->cs4, 0, sizeof(cond_dist256_t));
+    memset(E->cs4_0, 0, sizeof(E->cs4_0));
+
+    if (params->symbol_len == 4) {
+        cond_dist256_init(&E->cs4, N);
+        cond_dist256_set_update_rate(&E->cs4, seq_update_rate);
+
+        for (i = 0; i < tetra_prefix_len; ++i) {
+            cond_dist256_init(&E->cs4_0[i], 1 << (8 * i));
+            cond_dist256_set_update_rate(&E->cs4_0[i], seq_update_rate);
+        }
+    }
+    else {
+        cond_dist16_init(&E->cs, N);
+        cond_dist16_set_update_rate(&E->cs, seq_update_rate);
+
+        for (i = 0; i < prefix_len; ++i) {
+            cond_dist16_init(&E->cs0[i], 1 << (4 * i));
+            cond_dist16_set_update_rate(&E->cs0[i], seq_update_rate);
+        }
     }
 
+    dist2_init(&E->d_nmask_flag);
+    uint32_enc_init(&E->d_nmask_gap);
+    uint32_enc_init(&E->d_nmask_run);
+
+    E->n_qual = 0;
+    dist256_init(&E->d_n_qual);
+
     E->d_nmask = NULL;
     E->nmask_n = 0;
 
     dist2_init(&E->d_type);
     dist2_init(&E->d_aln_strand);
 
+    uint32_enc_init(&E->d_copy_count);
+    uint32_enc_init(&E->d_copy_skip);
+    uint32_enc_init(&E->d_copy_back);
+    uint32_enc_init(&E->d_copy_offset);
+
+    dist2_init(&E->d_order_same);
+    uint32_enc_init(&E->d_order_gap);
+    uint32_enc_init(&E->d_order_idx);
+
     uint32_enc_init(&E->d_contig_off);
 
     dist2_init(&E->d_ref_match);
+    uint32_enc_init(&E->d_ref_run);
+    cond_dist4_init(&E->d_ref_mismatch, 4);
+    E->ref_query = NULL;
+
+    dist2_init(&E->d_refmap);
+    uint32_enc_init(&E->d_refmap_seq);
+    uint32_enc_init(&E->d_refmap_pos);
+    dist2_init(&E->d_refmap_strand);
     dist4_init(&E->d_ref_ins_nuc);
 
     memset(&E->supercontig_motif, 0, sizeof(cond_dist4_t));
@@ -150,7 +540,12 @@ static void seqenc_init(seqenc_t* E, const seqmap_t* ref)
     uint32_enc_init(&E->d_ext_flags);
     cond_dist128_init(&E->d_ext_seqname, 128);
 
+    E->last_tid = -1;
+    dist2_init(&E->d_ext_tid_same);
+    uint32_enc_init(&E->d_ext_tid);
+
     E->d_ext_pos = NULL;
+    E->d_ext_pos_n = 0;
 
     E->last_ref_pos = 0;
     dist2_init(&E->d_ext_pos_off_flag);
@@ -167,6 +562,17 @@ static void seqenc_init(seqenc_t* E, const seqmap_t* ref)
     dist2_init(&E->d_ext_mate_sameseq);
     uint32_enc_init(&E->d_ext_tlen);
 
+    E->pending_mates = NULL;
+    dist2_init(&E->d_ext_mate_match);
+    dist2_init(&E->d_ext_placed);
+
+    for (i = 0; i < sig_cache_size; ++i) {
+        cigar_init(&E->sigs[i].cigar);
+    }
+    E->sigs_len = 0;
+    E->last_sig = 0;
+    cond_dist16_init(&E->d_ext_sig, sig_cache_size + 1);
+
     E->seq_index = strmap_alloc();
 }
 
@@ -186,25 +592,145 @@ static void reserve_nmask(seqenc_t* E, size_t readlen)
 }
 
 
-seqenc_t* seqenc_alloc_encoder(quip_writer_t writer, void* writer_data, const seqmap_t* ref)
+/* Encode the positions of Ns in a read of length n. Most reads have none, so
+ * beyond a single flag only the gaps between runs of Ns and the lengths of
+ * those runs are coded. */
+static void encode_nmask(seqenc_t* E, ac_t* ac, const uint8_t* s, size_t n)
+{
+    size_t i;
+
+    if (E->n_qual != 0) return;
+
+    if (E->quip_version < 5) {
+        reserve_nmask(E, n);
+        for (i = 0; i < n; ++i) {
+            dist2_encode(ac, &E->d_nmask[i], s[i] == 'N' ? 1 : 0);
+        }
+        return;
+    }
+
+    const uint8_t* first = memchr(s, 'N', n);
+    if (first == NULL) {
+        dist2_encode(ac, &E->d_nmask_flag, 0);
+        return;
+    }
+
+    dist2_encode(ac, &E->d_nmask_flag, 1);
+
+    /* A gap that reaches the end of the read terminates the mask. */
+    size_t j;
+    i = 0;
+    while (true) {
+        for (j = i; j < n && s[j] != 'N'; ++j);
+        uint32_enc_encode(ac, &E->d_nmask_gap, j - i);
+        if (j == n) break;
+
+        for (i = j; i < n && s[i] == 'N'; ++i);
+        uint32_enc_encode(ac, &E->d_nmask_run, i - j - 1);
+        if (i == n) break;
+    }
+}
+
+
+/* Decode the positions of Ns in a read of length n, setting them in s and
+ * leaving every other position untouched. */
+static void decode_nmask(seqenc_t* E, ac_t* ac, uint8_t* s, size_t n)
+{
+    size_t i;
+
+    if (E->n_qual != 0) return;
+
+    if (E->quip_version < 5) {
+        reserve_nmask(E, n);
+        for (i = 0; i < n; ++i) {
+            if (dist2_decode(ac, &E->d_nmask[i])) s[i] = 'N';
+        }
+        return;
+    }
+
+    if (!dist2_decode(ac, &E->d_nmask_flag)) return;
+
+    size_t run;
+    i = 0;
+    while (true) {
+        i += uint32_enc_decode(ac, &E->d_nmask_gap);
+        if (i >= n) break;
+
+        run = 1 + uint32_enc_decode(ac, &E->d_nmask_run);
+        if (run > n - i) {
+            quip_error("N mask extends past the end of the read.");
+        }
+
+        memset(s + i, 'N', run);
+        i += run;
+        if (i == n) break;
+    }
+}
+
+
+/* Read compressed data for one sub-stream from its buffer. */
+static size_t lane_reader(void* param, uint8_t* data, size_t size)
+{
+    lane_buf_t* in = (lane_buf_t*) param;
+
+    if (size > in->len - in->pos) size = in->len - in->pos;
+    if (data != NULL) memcpy(data, in->buf + in->pos, size);
+    in->pos += size;
+
+    return size;
+}
+
+
+seqenc_t* seqenc_alloc_encoder(quip_writer_t writer, void* writer_data,
+                               uint8_t quip_version,
+                               const seqenc_params_t* params,
+                               const seqmap_t* ref,
+                               const bam_header_t* header)
 {
     seqenc_t* E = malloc_or_die(sizeof(seqenc_t));
 
     E->ac = ac_alloc_encoder(writer, writer_data);
+    E->aln_ac = quip_version >= 5 ? ac_alloc_encoder(writer, writer_data) : E->ac;
+
+    seqenc_init(E, quip_version, params, ref, header);
+
+    size_t i;
+    if (params->lanes > 1) {
+        for (i = 0; i < params->lanes; ++i) {
+            E->lane_ac[i] = ac_alloc_encoder(writer, writer_data);
+        }
+    }
 
-    seqenc_init(E, ref);
+    if (params->dup_bits > 0) {
+        size_t table_size = (size_t) 2 << params->dup_bits;
+        E->dup_table = malloc_or_die(table_size * sizeof(uint64_t));
+        memset(E->dup_table, 0, table_size * sizeof(uint64_t));
+    }
 
     return E;
 }
 
 
-seqenc_t* seqenc_alloc_decoder(quip_reader_t reader, void* reader_data, const seqmap_t* ref)
+seqenc_t* seqenc_alloc_decoder(quip_reader_t reader, void* reader_data,
+                               quip_reader_t aln_reader, void* aln_reader_data,
+                               uint8_t quip_version,
+                               const seqenc_params_t* params,
+                               const seqmap_t* ref,
+                               const bam_header_t* header)
 {
     seqenc_t* E = malloc_or_die(sizeof(seqenc_t));
 
     E->ac = ac_alloc_decoder(reader, reader_data);
+    E->aln_ac = quip_version >= 5 ? ac_alloc_decoder(aln_reader, aln_reader_data) : E->ac;
 
-    seqenc_init(E, ref);
+    seqenc_init(E, quip_version, params, ref, header);
+
+    size_t i;
+    if (params->lanes > 1) {
+        for (i = 0; i < params->lanes; ++i) {
+            E->lane_ac[i] = ac_alloc_decoder(lane_reader, &E->lane_in[i]);
+        }
+    }
 
     return E;
 }
@@ -216,24 +742,57 @@ void seqenc_free(seqenc_t* E)
 
     str_free(&E->tmpseq);
 
+    size_t i;
+    for (i = 0; i < max_lanes; ++i) {
+        if (E->lane_ac[i] != NULL) ac_free(E->lane_ac[i]);
+        free(E->lane_in[i].buf);
+        str_free(&E->lane_seq[i]);
+    }
+
+    if (E->dup_hist != NULL) {
+        size_t dup_window = (size_t) 1 << E->params.dup_bits;
+        for (i = 0; i < dup_window; ++i) str_free(&E->dup_hist[i]);
+        free(E->dup_hist);
+    }
+    free(E->dup_table);
+    str_free(&E->dup_tmp);
+    uint32_enc_free(&E->d_dup_dist);
+
     ac_free(E->ac);
     cond_dist16_free(&E->cs);
 
-    size_t i;
     for (i = 0; i < prefix_len; ++i) {
         cond_dist16_free(&E->cs0[i]);
     }
 
+    cond_dist256_free(&E->cs4);
+    for (i = 0; i < tetra_prefix_len; ++i) {
+        cond_dist256_free(&E->cs4_0[i]);
+    }
+
+    uint32_enc_free(&E->d_nmask_gap);
+    uint32_enc_free(&E->d_nmask_run);
     free(E->d_nmask);
 
     uint32_enc_free(&E->d_contig_off);
+    uint32_enc_free(&E->d_copy_count);
+    uint32_enc_free(&E->d_copy_skip);
+    uint32_enc_free(&E->d_copy_back);
+    uint32_enc_free(&E->d_copy_offset);
+    uint32_enc_free(&E->d_order_gap);
+    uint32_enc_free(&E->d_order_idx);
     cond_dist4_free(&E->supercontig_motif);
+    uint32_enc_free(&E->d_ref_run);
+    cond_dist4_free(&E->d_ref_mismatch);
+    twobit_free(E->ref_query);
+    uint32_enc_free(&E->d_refmap_seq);
+    uint32_enc_free(&E->d_refmap_pos);
 
     uint32_enc_free(&E->d_ext_flags);
     cond_dist128_free(&E->d_ext_seqname);
 
-    size_t refsize = strmap_size(E->seq_index);
-    for (i = 0; i < refsize; ++i) {
+    uint32_enc_free(&E->d_ext_tid);
+    for (i = 0; i < E->d_ext_pos_n; ++i) {
         cond_dist256_free(&E->d_ext_pos[i]);
     }
     free(E->d_ext_pos);
@@ -247,35 +806,223 @@ void seqenc_free(seqenc_t* E)
 
     uint32_enc_free(&E->d_ext_tlen);
 
+    for (i = 0; i < sig_cache_size; ++i) {
+        cigar_free(&E->sigs[i].cigar);
+    }
+    cond_dist16_free(&E->d_ext_sig);
+
     strmap_free(E->seq_index);
+    free(E->pending_mates);
+    free(E->target_seqs);
+    str_free(&E->tmpname);
 
     free(E);
 }
 
 
-static uint32_t get_seq_idx(seqenc_t* E, const str_t* seqname)
+/* Add a model of positions on a sequence, returning its index. */
+static uint32_t add_pos_model(seqenc_t* E)
+{
+    size_t n = E->d_ext_pos_n++;
+    E->d_ext_pos = realloc_or_die(E->d_ext_pos, (n + 1) * sizeof(cond_dist256_t));
+    cond_dist256_init(&E->d_ext_pos[n], 9 * 256);
+    return n;
+}
+
+
+/* Index of the position model of the named sequence. Each is numbered in the
+ * order they are first seen, as in version 4 and earlier. */
+static uint32_t get_seq_idx(seqenc_t* E, const char* seqname)
 {
+    str_t name;
+    name.s = (uint8_t*) seqname;
+    name.n = strlen(seqname);
+
     uint32_t n   = strmap_size(E->seq_index);
-    uint32_t idx = strmap_get(E->seq_index, seqname);
+    uint32_t idx = strmap_get(E->seq_index, &name);
 
-    if (idx >= n) {
-        E->d_ext_pos = realloc_or_die(E->d_ext_pos, (n + 1) * sizeof(cond_dist256_t));
-        cond_dist256_init(&E->d_ext_pos[n], 9 * 256);
-    }
+    if (idx >= n) add_pos_model(E);
 
     return idx;
 }
 
 
-static void encode_seqname(seqenc_t* E, const str_t* seqname)
+/* Bin of sequences sharing a position model: 0 for no sequence (tid -1), and
+ * otherwise one more than the base 2 logarithm of the sequence's length. */
+static size_t pos_model_bin(const seqenc_t* E, int32_t tid)
 {
-    unsigned char last = '\0';
+    if (tid < 0) return 0;
+
+    uint32_t len = E->header->target_len[tid];
+    size_t bin = 1;
+    while (len >>= 1) ++bin;
+
+    return bin;
+}
+
+
+/* Index of the position model of the sequence with the given tid, which is
+ * checked against the header. */
+static uint32_t get_tid_idx(seqenc_t* E, int32_t tid)
+{
+    if (tid < -1 || tid >= E->n_targets) {
+        quip_error("A read refers to a reference sequence not listed in the header.");
+    }
+
+    size_t i = pos_model_bin(E, tid);
+    if (E->tid_pos_idx[i] == UINT32_MAX) {
+        E->tid_pos_idx[i] = add_pos_model(E);
+    }
+
+    return E->tid_pos_idx[i];
+}
+
+
+/* Name of the sequence with the given tid, or "" if there is none. */
+static const char* target_name(const seqenc_t* E, int32_t tid)
+{
+    if (tid < 0 || tid >= E->n_targets) return "";
+    else return E->header->target_name[tid];
+}
+
+
+/* Reference sequence with the given tid. */
+static const twobit_t* get_target_seq(const seqenc_t* E, int32_t tid)
+{
+    const twobit_t* seq = NULL;
+    if (tid >= 0 && tid < E->n_targets) seq = E->target_seqs[tid];
+
+    if (seq == NULL) {
+        quip_error(
+            "A read was aligned to sequence %s, which was not found in the reference.",
+            tid >= 0 && tid < E->n_targets ? target_name(E, tid) : "*");
+    }
+
+    return seq;
+}
+
+
+/* Slot in the table of pending mates of a read whose mate is at the given
+ * position. */
+static pending_mate_t* pending_mate_slot(seqenc_t* E, int32_t tid, uint32_t pos)
+{
+    if (E->pending_mates == NULL) {
+        size_t n = (size_t) 1 << pending_mates_bits;
+        E->pending_mates = malloc_or_die(n * sizeof(pending_mate_t));
+        memset(E->pending_mates, 0, n * sizeof(pending_mate_t));
+    }
+
+    uint64_t key = ((uint64_t) (uint32_t) tid << 32) | pos;
+    return &E->pending_mates[(key * ctx_hash_mult) >> (64 - pending_mates_bits)];
+}
+
+
+/* The pending read, if any, whose mate is at the given position. */
+static pending_mate_t* find_pending_mate(seqenc_t* E, int32_t tid, uint32_t pos)
+{
+    pending_mate_t* m = pending_mate_slot(E, tid, pos);
+    if (m->used && m->mate_tid == tid && m->mate_pos == pos) return m;
+    else return NULL;
+}
+
+
+static void add_pending_mate(seqenc_t* E, const short_read_t* x)
+{
+    pending_mate_t* m = pending_mate_slot(E, x->mate_tid, x->mate_pos);
+    m->tid      = x->tid;
+    m->pos      = x->pos;
+    m->mate_tid = x->mate_tid;
+    m->mate_pos = x->mate_pos;
+    m->tlen     = x->tlen;
+    m->used     = true;
+}
+
+
+/* Whether a read and its mate are both aligned, so that one may be predicted
+ * from the other. */
+static bool has_aligned_mate(const seqenc_t* E, uint32_t flags)
+{
+    return E->quip_version >= 5 &&
+           (flags & (BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP)) == BAM_FPAIRED;
+}
+
+
+/* Number of read nucleotides accounted for by a cigar. */
+static uint32_t cigar_read_len(const cigar_t* cigar)
+{
+    uint32_t len = 0;
     size_t i;
-    for (i = 0; i < seqname->n; ++i) {
-        cond_dist128_encode(E->ac, &E->d_ext_seqname, last, seqname->s[i]);
-        last = seqname->s[i];
+    for (i = 0; i < cigar->n; ++i) {
+        if (cigar->ops[i] != BAM_CDEL &&
+            cigar->ops[i] != BAM_CREF_SKIP &&
+            cigar->ops[i] != BAM_CHARD_CLIP)
+        {
+            len += cigar->lens[i];
+        }
+    }
+
+    return len;
+}
+
+
+/* Index of a read's alignment signature in the list of recent ones, or
+ * sig_cache_size if it is not there. The cigar of an unaligned read is
+ * ignored. */
+static uint8_t find_sig(const seqenc_t* E, const short_read_t* x)
+{
+    bool aligned = (x->flags & BAM_FUNMAP) == 0;
+    const alignment_sig_t* sig;
+    size_t i;
+    for (i = 0; i < E->sigs_len; ++i) {
+        sig = &E->sigs[i];
+        if (sig->flags != x->flags || sig->map_qual != x->map_qual) continue;
+        if (!aligned) return i;
+
+        if (sig->cigar.n == x->cigar.n &&
+            memcmp(sig->cigar.ops, x->cigar.ops, x->cigar.n * sizeof(uint8_t)) == 0 &&
+            memcmp(sig->cigar.lens, x->cigar.lens, x->cigar.n * sizeof(uint32_t)) == 0)
+        {
+            return i;
+        }
+    }
+
+    return sig_cache_size;
+}
+
+
+/* Move the i-th recent signature to the front. */
+static void use_sig(seqenc_t* E, uint8_t i)
+{
+    if (i == 0) return;
+    alignment_sig_t sig = E->sigs[i];
+    memmove(&E->sigs[1], &E->sigs[0], i * sizeof(alignment_sig_t));
+    E->sigs[0] = sig;
+}
+
+
+/* Put a read's alignment signature at the front of the list, dropping the
+ * last if the list is full. */
+static void add_sig(seqenc_t* E, const short_read_t* x)
+{
+    if (E->sigs_len < sig_cache_size) ++E->sigs_len;
+    use_sig(E, E->sigs_len - 1);
+
+    alignment_sig_t* sig = &E->sigs[0];
+    sig->flags    = x->flags;
+    sig->map_qual = x->map_qual;
+    if ((x->flags & BAM_FUNMAP) == 0) cigar_copy(&sig->cigar, &x->cigar);
+    else sig->cigar.n = 0;
+}
+
+
+static void encode_seqname(seqenc_t* E, const char* seqname)
+{
+    unsigned char last = '\0';
+    for (; *seqname != '\0'; ++seqname) {
+        cond_dist128_encode(E->aln_ac, &E->d_ext_seqname, last, *seqname);
+        last = *seqname;
     }
-    cond_dist128_encode(E->ac, &E->d_ext_seqname, last, '\0');
+    cond_dist128_encode(E->aln_ac, &E->d_ext_seqname, last, '\0');
 }
 
 
@@ -287,7 +1034,7 @@ static void decode_seqname(seqenc_t* E, str_t* seqname)
     do {
         str_reserve_extra(seqname, 2);
         seqname->s[i] = \
-            cond_dist128_decode(E->ac, &E->d_ext_seqname, last);
+            cond_dist128_decode(E->aln_ac, &E->d_ext_seqname, last);
         last = seqname->s[i];
         ++seqname->n;
         ++i;
@@ -297,237 +1044,735 @@ static void decode_seqname(seqenc_t* E, str_t* seqname)
 }
 
 
-void seqenc_encode_extras(seqenc_t* E, const short_read_t* x, uint8_t quip_version)
+/* The sequence as it will be decoded, for the purpose of finding duplicates. */
+static const uint8_t* dup_normalize(seqenc_t* E, const uint8_t* x, size_t n)
+{
+    if (E->n_qual == 0 || memchr(x, 'N', n) == NULL) return x;
+
+    str_memcpy(&E->dup_tmp, x, n);
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (E->dup_tmp.s[i] == 'N') E->dup_tmp.s[i] = 'A';
+    }
+
+    return E->dup_tmp.s;
+}
+
+
+static void dup_insert(seqenc_t* E, uint64_t idx, const uint8_t* x, size_t n)
+{
+    x = dup_normalize(E, x, n);
+
+    uint64_t window = (uint64_t) 1 << E->params.dup_bits;
+    str_memcpy(&E->dup_hist[idx & (window - 1)], x, n);
+
+    if (E->dup_table != NULL) {
+        uint32_t mask = ((uint32_t) 2 << E->params.dup_bits) - 1;
+        E->dup_table[murmurhash3(x, n) & mask] = idx + 1;
+    }
+}
+
+
+bool seqenc_encode_dup(seqenc_t* E, const uint8_t* x, size_t n)
+{
+    if (E->params.dup_bits == 0 || n == 0) return false;
+
+    uint64_t window = (uint64_t) 1 << E->params.dup_bits;
+    uint32_t mask = ((uint32_t) 2 << E->params.dup_bits) - 1;
+
+    x = dup_normalize(E, x, n);
+    uint64_t j = E->dup_table[murmurhash3(x, n) & mask];
+    uint64_t d = 0;
+
+    E->dup_cur = E->dup_n++;
+
+    /* the entry may be a collision, or have left the window */
+    if (j > 0 && E->dup_cur - (j - 1) < window) {
+        const str_t* h = &E->dup_hist[(j - 1) & (window - 1)];
+        if (h->n == n && memcmp(h->s, x, n) == 0) d = E->dup_cur - (j - 1);
+    }
+
+    dist2_encode(E->ac, &E->d_dup, d > 0 ? 1 : 0);
+    if (d > 0) uint32_enc_encode(E->ac, &E->d_dup_dist, (uint32_t) (d - 1));
+
+    /* Other reads are stored once coded, which with lanes is not until the
+     * rest of their group is. */
+    if (d > 0 || E->params.lanes == 1) dup_insert(E, E->dup_cur, x, n);
+
+    return d > 0;
+}
+
+
+static bool seqenc_decode_dup(seqenc_t* E, short_read_t* x, size_t n)
+{
+    if (E->params.dup_bits == 0 || n == 0) return false;
+
+    E->dup_cur = E->dup_n++;
+    if (!dist2_decode(E->ac, &E->d_dup)) return false;
+
+    uint64_t window = (uint64_t) 1 << E->params.dup_bits;
+    uint64_t d = 1 + (uint64_t) uint32_enc_decode(E->ac, &E->d_dup_dist);
+    if (d >= window || d > E->dup_cur) {
+        quip_error("Invalid duplicate read reference.");
+    }
+
+    const str_t* h = &E->dup_hist[(E->dup_cur - d) & (window - 1)];
+    if (h->n != n) {
+        quip_error("Duplicate read reference has the wrong length.");
+    }
+
+    str_reserve(&x->seq, n + 1);
+    memcpy(x->seq.s, h->s, n);
+    x->seq.s[n] = '\0';
+    x->seq.n = n;
+
+    dup_insert(E, E->dup_cur, x->seq.s, n);
+
+    return true;
+}
+
+
+void seqenc_encode_n_qual(seqenc_t* E, uint8_t n_qual)
 {
-    uint32_enc_encode(E->ac, &E->d_ext_flags, x->flags);
-    dist256_encode(E->ac, &E->d_ext_map_qual, x->map_qual);
-    uint32_enc_encode(E->ac, &E->d_ext_tlen, x->tlen);
+    if (E->quip_version < 5) return;
+
+    dist256_encode(E->ac, &E->d_n_qual, n_qual);
+    E->n_qual = n_qual;
+}
+
+
+uint8_t seqenc_decode_n_qual(seqenc_t* E)
+{
+    if (E->quip_version < 5) return 0;
+
+    E->n_qual = dist256_decode(E->ac, &E->d_n_qual);
+    return E->n_qual;
+}
+
+
+void seqenc_encode_copy_count(seqenc_t* E, uint32_t n)
+{
+    uint32_enc_encode(E->ac, &E->d_copy_count, n);
+}
+
+
+uint32_t seqenc_decode_copy_count(seqenc_t* E)
+{
+    return uint32_enc_decode(E->ac, &E->d_copy_count);
+}
+
+
+void seqenc_encode_copy(seqenc_t* E, uint32_t skip, uint32_t back, uint32_t offset)
+{
+    uint32_enc_encode(E->ac, &E->d_copy_skip, skip);
+    uint32_enc_encode(E->ac, &E->d_copy_back, back - 1);
+    uint32_enc_encode(E->ac, &E->d_copy_offset, offset);
+}
+
+
+void seqenc_decode_copy(seqenc_t* E, uint32_t* skip, uint32_t* back, uint32_t* offset)
+{
+    *skip   = uint32_enc_decode(E->ac, &E->d_copy_skip);
+    *back   = 1 + uint32_enc_decode(E->ac, &E->d_copy_back);
+    *offset = uint32_enc_decode(E->ac, &E->d_copy_offset);
+}
+
+
+void seqenc_encode_read_order(seqenc_t* E, bool same, uint32_t x)
+{
+    dist2_encode(E->ac, &E->d_order_same, same ? 1 : 0);
+    uint32_enc_encode(E->ac, same ? &E->d_order_gap : &E->d_order_idx, x);
+}
+
+
+void seqenc_decode_read_order(seqenc_t* E, bool* same, uint32_t* x)
+{
+    *same = dist2_decode(E->ac, &E->d_order_same) != 0;
+    *x = uint32_enc_decode(E->ac, *same ? &E->d_order_gap : &E->d_order_idx);
+}
+
+
+/* Since version 5, an unaligned read, or the unaligned mate of a read, may
+ * still be placed at a sequence and position, as SAM suggests for unaligned
+ * reads with aligned mates. A flag gives whether it is placed as expected
+ * (with its mate, or unplaced if the mate is not placed), and if not, the
+ * sequence and, if any, the position follow. */
+static void encode_placement(seqenc_t* E, int32_t tid, uint32_t pos,
+                             int32_t exp_tid, uint32_t exp_pos)
+{
+    bool expected = tid < 0 ? exp_tid < 0 : tid == exp_tid && pos == exp_pos;
+    dist2_encode(E->aln_ac, &E->d_ext_placed, expected);
+    if (expected) return;
+
+    uint32_enc_encode(E->aln_ac, &E->d_ext_tid, (uint32_t) (tid + 1));
+    if (tid >= 0) {
+        uint32_enc_encode(E->aln_ac, &E->d_ext_pos[get_tid_idx(E, tid)], pos);
+    }
+}
+
+
+static void decode_placement(seqenc_t* E, int32_t* tid, uint32_t* pos,
+                             int32_t exp_tid, uint32_t exp_pos)
+{
+    if (dist2_decode(E->aln_ac, &E->d_ext_placed)) {
+        *tid = exp_tid < 0 ? -1 : exp_tid;
+        *pos = exp_tid < 0 ? 0 : exp_pos;
+        return;
+    }
+
+    *tid = (int32_t) uint32_enc_decode(E->aln_ac, &E->d_ext_tid) - 1;
+    *pos = *tid >= 0 ?
+        uint32_enc_decode(E->aln_ac, &E->d_ext_pos[get_tid_idx(E, *tid)]) : 0;
+}
+
+
+void seqenc_encode_extras(seqenc_t* E, const short_read_t* x)
+{
+    uint8_t sig = sig_cache_size;
+    if (E->quip_version >= 5) {
+        sig = find_sig(E, x);
+        cond_dist16_encode(E->aln_ac, &E->d_ext_sig, E->last_sig, sig);
+        E->last_sig = sig;
+    }
+
+    if (sig < sig_cache_size) {
+        use_sig(E, sig);
+    }
+    else {
+        uint32_enc_encode(E->aln_ac, &E->d_ext_flags, x->flags);
+        dist256_encode(E->aln_ac, &E->d_ext_map_qual, x->map_qual);
+    }
+
+    if (E->quip_version < 5) {
+        uint32_enc_encode(E->aln_ac, &E->d_ext_tlen, x->tlen);
+    }
 
     uint32_t seqidx = 0;
     if ((x->flags & BAM_FUNMAP) == 0) {
-        encode_seqname(E, &x->seqname);
-        seqidx = get_seq_idx(E, &x->seqname);
+        if (E->quip_version >= 5) {
+            if (x->tid == E->last_tid) {
+                dist2_encode(E->aln_ac, &E->d_ext_tid_same, 1);
+            }
+            else {
+                dist2_encode(E->aln_ac, &E->d_ext_tid_same, 0);
+                uint32_enc_encode(E->aln_ac, &E->d_ext_tid, (uint32_t) (x->tid + 1));
+            }
+            seqidx = get_tid_idx(E, x->tid);
+            E->last_tid = x->tid;
+        }
+        else {
+            encode_seqname(E, target_name(E, x->tid));
+            seqidx = get_seq_idx(E, target_name(E, x->tid));
+        }
 
         if (x->pos < E->last_ref_pos || x->pos - E->last_ref_pos >= 256) {
-            dist2_encode(E->ac, &E->d_ext_pos_off_flag, 0);
-            uint32_enc_encode(E->ac, &E->d_ext_pos[seqidx], x->pos);
+            dist2_encode(E->aln_ac, &E->d_ext_pos_off_flag, 0);
+            uint32_enc_encode(E->aln_ac, &E->d_ext_pos[seqidx], x->pos);
         }
         else {
-            dist2_encode(E->ac, &E->d_ext_pos_off_flag, 1);
-            dist256_encode(E->ac, &E->d_ext_pos_off, x->pos - E->last_ref_pos);
+            dist2_encode(E->aln_ac, &E->d_ext_pos_off_flag, 1);
+            dist256_encode(E->aln_ac, &E->d_ext_pos_off, x->pos - E->last_ref_pos);
         }
 
         E->last_ref_pos = x->pos;
 
-        uint32_t cigarlen = 0;
-        uint8_t last_op = 9;
-        size_t i;
+        if (sig == sig_cache_size) {
+            uint8_t last_op = 9;
+            size_t i;
 
-        uint32_enc_encode(E->ac, &E->d_ext_cigar_n, x->cigar.n);
-        for (i = 0; i < x->cigar.n; ++i) {
-            cond_dist16_encode(E->ac, &E->d_ext_cigar_op, last_op, x->cigar.ops[i]);
-            uint32_enc_encode(E->ac, &E->d_ext_cigar_len[x->cigar.ops[i]], x->cigar.lens[i]);
-            last_op = x->cigar.ops[i];
-
-            if (x->cigar.ops[i] != BAM_CDEL &&
-                x->cigar.ops[i] != BAM_CREF_SKIP &&
-                x->cigar.ops[i] != BAM_CHARD_CLIP)
-            {
-                cigarlen += x->cigar.lens[i];
+            uint32_enc_encode(E->aln_ac, &E->d_ext_cigar_n, x->cigar.n);
+            for (i = 0; i < x->cigar.n; ++i) {
+                cond_dist16_encode(E->aln_ac, &E->d_ext_cigar_op, last_op, x->cigar.ops[i]);
+                uint32_enc_encode(E->aln_ac, &E->d_ext_cigar_len[x->cigar.ops[i]], x->cigar.lens[i]);
+                last_op = x->cigar.ops[i];
             }
         }
 
-        if (cigarlen != x->seq.n) {
+        /* SAM allows the sequence to be omitted, as it often is for
+         * secondary alignments. */
+        if (x->seq.n > 0 && cigar_read_len(&x->cigar) != x->seq.n) {
             quip_error("Cigar operations do not account for full read length.");
         }
     }
 
+    if (E->quip_version >= 5 && sig == sig_cache_size) add_sig(E, x);
+
+    bool aligned_mate = has_aligned_mate(E, x->flags);
+    pending_mate_t* mate =
+        aligned_mate ? find_pending_mate(E, x->tid, x->pos) : NULL;
+    if (mate != NULL) {
+        bool match = mate->tid == x->mate_tid && mate->pos == x->mate_pos &&
+                     (int64_t) mate->tlen == -(int64_t) x->tlen;
+        dist2_encode(E->aln_ac, &E->d_ext_mate_match, match);
+        if (match) {
+            mate->used = false;
+            return;
+        }
+    }
+
     if ((x->flags & BAM_FMUNMAP) == 0) {
-        if (quip_version >= 4) {
+        if (E->quip_version >= 5) {
+            if ((x->flags & BAM_FUNMAP) == 0 && x->mate_tid == x->tid) {
+                dist2_encode(E->aln_ac, &E->d_ext_mate_sameseq, 1);
+            }
+            else {
+                if ((x->flags & BAM_FUNMAP) == 0) {
+                    dist2_encode(E->aln_ac, &E->d_ext_mate_sameseq, 0);
+                }
+                uint32_enc_encode(E->aln_ac, &E->d_ext_tid, (uint32_t) (x->mate_tid + 1));
+            }
+            seqidx = get_tid_idx(E, x->mate_tid);
+        }
+        else if (E->quip_version >= 4) {
             if ((x->flags & BAM_FUNMAP) == 0) {
-                if (strcmp((char*) x->seqname.s, (char*) x->mate_seqname.s) == 0) {
-                    dist2_encode(E->ac, &E->d_ext_mate_sameseq, 1);
+                if (x->mate_tid == x->tid) {
+                    dist2_encode(E->aln_ac, &E->d_ext_mate_sameseq, 1);
                 }
                 else {
-                    dist2_encode(E->ac, &E->d_ext_mate_sameseq, 0);
-                    encode_seqname(E, &x->mate_seqname);
+                    dist2_encode(E->aln_ac, &E->d_ext_mate_sameseq, 0);
+                    encode_seqname(E, target_name(E, x->mate_tid));
                 }
             }
             else {
-                encode_seqname(E, &x->mate_seqname);
+                encode_seqname(E, target_name(E, x->mate_tid));
             }
-            seqidx = get_seq_idx(E, &x->mate_seqname);
+            seqidx = get_seq_idx(E, target_name(E, x->mate_tid));
         }
         else {
-            if ((x->mate_seqname.n == 1 && x->mate_seqname.s[0] == '=') ||
-                ((x->flags & BAM_FUNMAP) == 0 && strcmp((char*) x->seqname.s, (char*) x->mate_seqname.s) == 0))
-            {
-                dist2_encode(E->ac, &E->d_ext_mate_sameseq, 1);
+            if ((x->flags & BAM_FUNMAP) == 0 && x->mate_tid == x->tid) {
+                dist2_encode(E->aln_ac, &E->d_ext_mate_sameseq, 1);
             }
             else {
-                dist2_encode(E->ac, &E->d_ext_mate_sameseq, 0);
-                encode_seqname(E, &x->mate_seqname);
-                seqidx = get_seq_idx(E, &x->mate_seqname);
+                dist2_encode(E->aln_ac, &E->d_ext_mate_sameseq, 0);
+                encode_seqname(E, target_name(E, x->mate_tid));
+                seqidx = get_seq_idx(E, target_name(E, x->mate_tid));
             }
         }
 
-        uint32_enc_encode(E->ac, &E->d_ext_pos[seqidx], x->mate_pos);
+        uint32_enc_encode(E->aln_ac, &E->d_ext_pos[seqidx], x->mate_pos);
     }
+
+    if (E->quip_version >= 5) {
+        uint32_enc_encode(E->aln_ac, &E->d_ext_tlen, x->tlen);
+
+        if (x->flags & BAM_FUNMAP) {
+            bool mate_placed = (x->flags & BAM_FMUNMAP) == 0;
+            encode_placement(E, x->tid, x->pos,
+                             mate_placed ? x->mate_tid : -1, x->mate_pos);
+        }
+
+        if (x->flags & BAM_FMUNMAP) {
+            encode_placement(E, x->mate_tid, x->mate_pos, x->tid, x->pos);
+        }
+    }
+
+    if (aligned_mate) add_pending_mate(E, x);
 }
 
 
-void seqenc_decode_extras(seqenc_t* E, short_read_t* x, size_t seqlen,
-                          uint8_t quip_version)
+/* Decode a sequence name, as coded by versions 4 and earlier, returning its
+ * tid and setting *seqidx to the index of its position model. */
+static int32_t decode_tid_by_name(seqenc_t* E, uint32_t* seqidx)
 {
-    x->flags    = uint32_enc_decode(E->ac, &E->d_ext_flags);
-    x->strand   = (x->flags & BAM_FREVERSE) ? 1 : 0;
-    x->map_qual = dist256_decode(E->ac, &E->d_ext_map_qual);
-    x->tlen     = uint32_enc_decode(E->ac, &E->d_ext_tlen);
+    decode_seqname(E, &E->tmpname);
+    *seqidx = get_seq_idx(E, (const char*) E->tmpname.s);
+
+    if (E->header == NULL) return -1;
+    else return bam_get_tid(E->header, (const char*) E->tmpname.s);
+}
+
+
+void seqenc_decode_extras(seqenc_t* E, short_read_t* x, size_t seqlen)
+{
+    uint8_t sig = sig_cache_size;
+    if (E->quip_version >= 5) {
+        sig = cond_dist16_decode(E->aln_ac, &E->d_ext_sig, E->last_sig);
+        E->last_sig = sig;
+    }
+
+    if (sig < sig_cache_size) {
+        use_sig(E, sig);
+        x->flags    = E->sigs[0].flags;
+        x->map_qual = E->sigs[0].map_qual;
+    }
+    else {
+        x->flags    = uint32_enc_decode(E->aln_ac, &E->d_ext_flags);
+        x->map_qual = dist256_decode(E->aln_ac, &E->d_ext_map_qual);
+    }
+    x->strand = (x->flags & BAM_FREVERSE) ? 1 : 0;
+
+    if (E->quip_version < 5) {
+        x->tlen = uint32_enc_decode(E->aln_ac, &E->d_ext_tlen);
+    }
 
     x->cigar.n = 0;
+    x->tid = x->mate_tid = -1;
+    x->pos = x->mate_pos = 0;
     uint32_t seqidx = 0;
     if ((x->flags & BAM_FUNMAP) == 0) {
-        decode_seqname(E, &x->seqname);
-        seqidx = get_seq_idx(E, &x->seqname);
+        if (E->quip_version >= 5) {
+            if (dist2_decode(E->aln_ac, &E->d_ext_tid_same)) {
+                x->tid = E->last_tid;
+            }
+            else {
+                x->tid = (int32_t) uint32_enc_decode(E->aln_ac, &E->d_ext_tid) - 1;
+            }
+            seqidx = get_tid_idx(E, x->tid);
+            E->last_tid = x->tid;
+        }
+        else {
+            x->tid = decode_tid_by_name(E, &seqidx);
+        }
 
-        if (dist2_decode(E->ac, &E->d_ext_pos_off_flag)) {
+        if (dist2_decode(E->aln_ac, &E->d_ext_pos_off_flag)) {
             x->pos =
-                E->last_ref_pos + dist256_decode(E->ac, &E->d_ext_pos_off);
+                E->last_ref_pos + dist256_decode(E->aln_ac, &E->d_ext_pos_off);
         }
         else {
-            x->pos = uint32_enc_decode(E->ac, &E->d_ext_pos[seqidx]);
+            x->pos = uint32_enc_decode(E->aln_ac, &E->d_ext_pos[seqidx]);
         }
 
         E->last_ref_pos = x->pos;
 
-        uint8_t last_op = 9;
-        size_t i = 0;
-        uint32_t cigarlen = 0;
-        x->cigar.n = uint32_enc_decode(E->ac, &E->d_ext_cigar_n);
-        cigar_reserve(&x->cigar, x->cigar.n);
-
-        for (i = 0; i < x->cigar.n; ++i) {
-            x->cigar.ops[i] = cond_dist16_decode(E->ac, &E->d_ext_cigar_op, last_op);
-            x->cigar.lens[i] = uint32_enc_decode(E->ac, &E->d_ext_cigar_len[x->cigar.ops[i]]);
-
-            if (x->cigar.ops[i] != BAM_CDEL &&
-                x->cigar.ops[i] != BAM_CREF_SKIP &&
-                x->cigar.ops[i] != BAM_CHARD_CLIP)
-            {
-                cigarlen += x->cigar.lens[i];
+        if (sig < sig_cache_size) {
+            cigar_copy(&x->cigar, &E->sigs[0].cigar);
+        }
+        else {
+            uint8_t last_op = 9;
+            size_t i = 0;
+            x->cigar.n = uint32_enc_decode(E->aln_ac, &E->d_ext_cigar_n);
+            cigar_reserve(&x->cigar, x->cigar.n);
+
+            for (i = 0; i < x->cigar.n; ++i) {
+                x->cigar.ops[i] = cond_dist16_decode(E->aln_ac, &E->d_ext_cigar_op, last_op);
+                x->cigar.lens[i] = uint32_enc_decode(E->aln_ac, &E->d_ext_cigar_len[x->cigar.ops[i]]);
+                last_op = x->cigar.ops[i];
             }
-
-            last_op = x->cigar.ops[i];
         }
 
-        if (cigarlen != seqlen) {
+        if (seqlen > 0 && cigar_read_len(&x->cigar) != seqlen) {
             quip_error("Cigar operations do not account for full read length.");
         }
     }
 
+    if (E->quip_version >= 5 && sig == sig_cache_size) add_sig(E, x);
+
+    bool aligned_mate = has_aligned_mate(E, x->flags);
+    pending_mate_t* mate =
+        aligned_mate ? find_pending_mate(E, x->tid, x->pos) : NULL;
+    if (mate != NULL && dist2_decode(E->aln_ac, &E->d_ext_mate_match)) {
+        x->mate_tid = mate->tid;
+        x->mate_pos = mate->pos;
+        x->tlen     = -mate->tlen;
+        mate->used  = false;
+        return;
+    }
+
     if ((x->flags & BAM_FMUNMAP) == 0) {
-        if (quip_version >= 4) {
-            if ((x->flags & BAM_FUNMAP) == 0) {
-                if (dist2_decode(E->ac, &E->d_ext_mate_sameseq)) {
-                    str_copy(&x->mate_seqname, &x->seqname);
-                }
-                else {
-                    decode_seqname(E, &x->mate_seqname);
-                }
+        if (E->quip_version >= 5) {
+            if ((x->flags & BAM_FUNMAP) == 0 &&
+                dist2_decode(E->aln_ac, &E->d_ext_mate_sameseq)) {
+                x->mate_tid = x->tid;
             }
             else {
-                decode_seqname(E, &x->mate_seqname);
+                x->mate_tid = (int32_t) uint32_enc_decode(E->aln_ac, &E->d_ext_tid) - 1;
             }
+            seqidx = get_tid_idx(E, x->mate_tid);
+        }
+        else if (E->quip_version >= 4) {
+            if ((x->flags & BAM_FUNMAP) == 0 &&
+                dist2_decode(E->aln_ac, &E->d_ext_mate_sameseq)) {
+                x->mate_tid = x->tid;
+                seqidx = get_seq_idx(E, (const char*) E->tmpname.s);
+            }
+            else {
+                x->mate_tid = decode_tid_by_name(E, &seqidx);
 
-            seqidx = get_seq_idx(E, &x->mate_seqname);
+                /* Files of this version were written with "=" in place of
+                 * the name of the read's own sequence. */
+                if (strcmp((const char*) E->tmpname.s, "=") == 0) {
+                    x->mate_tid = x->tid;
+                }
+            }
         }
         else {
-            if (dist2_decode(E->ac, &E->d_ext_mate_sameseq)) {
-                str_copy(&x->mate_seqname, &x->seqname);
+            if (dist2_decode(E->aln_ac, &E->d_ext_mate_sameseq)) {
+                x->mate_tid = x->tid;
             }
             else {
-                decode_seqname(E, &x->mate_seqname);
-                seqidx = get_seq_idx(E, &x->mate_seqname);
+                x->mate_tid = decode_tid_by_name(E, &seqidx);
             }
         }
-        x->mate_pos = uint32_enc_decode(E->ac, &E->d_ext_pos[seqidx]);
+        x->mate_pos = uint32_enc_decode(E->aln_ac, &E->d_ext_pos[seqidx]);
     }
-}
 
+    if (E->quip_version >= 5) {
+        x->tlen = uint32_enc_decode(E->aln_ac, &E->d_ext_tlen);
 
-void seqenc_encode_twobit_seq(seqenc_t* E, const unsigned char* x_str, const twobit_t* x)
-{
-    dist2_encode(E->ac, &E->d_type, SEQENC_TYPE_SEQUENCE);
+        if (x->flags & BAM_FUNMAP) {
+            decode_placement(E, &x->tid, &x->pos, x->mate_tid, x->mate_pos);
+        }
 
-    size_t n = twobit_len(x);
-    if (n == 0) return;
+        if (x->flags & BAM_FMUNMAP) {
+            decode_placement(E, &x->mate_tid, &x->mate_pos, x->tid, x->pos);
+        }
+    }
 
+    if (aligned_mate) add_pending_mate(E, x);
+}
+
+
+static void encode_twobit_dinucs(seqenc_t* E, const twobit_t* x, size_t n)
+{
     kmer_t uv;
-    uint32_t ctx = 0;
+    kmer_t ctx = 0;
     size_t i;
 
     for (i = 0; i < n - 1 && i / 2 < prefix_len; i += 2) {
         uv = (twobit_get(x, i) << 2) | twobit_get(x, i + 1);
-        cond_dist16_encode(E->ac, &E->cs0[i/2], ctx, uv);
+        cond_dist16_encode(E->ac, &E->cs0[i/2], (uint32_t) ctx, uv);
         ctx = ((ctx << 4) | uv) & E->ctx_mask;
     }
 
     for (; i < n - 1; i += 2) {
         uv = (twobit_get(x, i) << 2) | twobit_get(x, i + 1);
-        cond_dist16_encode(E->ac, &E->cs, ctx, uv);
+        cond_dist16_encode(E->ac, &E->cs, ctx_idx(E, ctx), uv);
         ctx = ((ctx << 4) | uv) & E->ctx_mask;
     }
 
     /* handle odd read lengths */
     if (i < n) {
         uv = twobit_get(x, i);
-        cond_dist16_encode(E->ac, &E->cs, ctx, uv);
+        cond_dist16_encode(E->ac, &E->cs, ctx_idx(E, ctx), uv);
     }
+}
 
-    /* encode N mask */
-    reserve_nmask(E, n);
-    for (i = 0; i < n; ++i) {
-        dist2_encode(E->ac, &E->d_nmask[i],
-            x_str[i] == 'N' ? 1 : 0);
+
+/* Code four nucleotides per symbol, the first in the highest bits. A final
+ * partial symbol is padded with zeros. */
+static void encode_twobit_tetranucs(seqenc_t* E, const twobit_t* x, size_t n)
+{
+    kmer_t uvwx;
+    kmer_t ctx = 0;
+    size_t i, j;
+
+    for (i = 0; i + 4 <= n && i / 4 < tetra_prefix_len; i += 4) {
+        uvwx = (twobit_get(x, i)     << 6) | (twobit_get(x, i + 1) << 4) |
+               (twobit_get(x, i + 2) << 2) |  twobit_get(x, i + 3);
+        cond_dist256_encode(E->ac, &E->cs4_0[i/4], (uint32_t) ctx, uvwx);
+        ctx = ((ctx << 8) | uvwx) & E->ctx_mask;
+    }
+
+    for (; i + 4 <= n; i += 4) {
+        uvwx = (twobit_get(x, i)     << 6) | (twobit_get(x, i + 1) << 4) |
+               (twobit_get(x, i + 2) << 2) |  twobit_get(x, i + 3);
+        cond_dist256_encode(E->ac, &E->cs4, ctx_idx(E, ctx), uvwx);
+        ctx = ((ctx << 8) | uvwx) & E->ctx_mask;
+    }
+
+    if (i < n) {
+        uvwx = 0;
+        for (j = 0; i + j < n; ++j) {
+            uvwx |= twobit_get(x, i + j) << (6 - 2 * j);
+        }
+        cond_dist256_encode(E->ac, &E->cs4, ctx_idx(E, ctx), uvwx);
     }
 }
 
 
-void seqenc_encode_char_seq(seqenc_t* E, const uint8_t* x, size_t len)
+void seqenc_encode_twobit_seq(seqenc_t* E, const unsigned char* x_str, const twobit_t* x)
 {
     dist2_encode(E->ac, &E->d_type, SEQENC_TYPE_SEQUENCE);
 
+    size_t n = twobit_len(x);
+    if (n == 0) return;
+
+    if (E->params.symbol_len == 4) encode_twobit_tetranucs(E, x, n);
+    else                           encode_twobit_dinucs(E, x, n);
+
+    encode_nmask(E, E->ac, x_str, n);
+}
+
+
+static void encode_char_dinucs(seqenc_t* E, const uint8_t* x, size_t len)
+{
     kmer_t uv;
-    uint32_t ctx = 0;
+    kmer_t ctx = 0;
     size_t i;
 
     /* encode leading positions. */
     for (i = 0; i < len - 1 && i / 2 < prefix_len; i += 2) {
         uv = (chartokmer[x[i]] << 2) | chartokmer[x[i + 1]];
-        cond_dist16_encode(E->ac, &E->cs0[i/2], ctx, uv);
+        cond_dist16_encode(E->ac, &E->cs0[i/2], (uint32_t) ctx, uv);
         ctx = ((ctx << 4) | uv) & E->ctx_mask;
     }
 
     /* encode trailing positions. */
     for (; i < len - 1; i += 2) {
         uv = (chartokmer[x[i]] << 2) | chartokmer[x[i + 1]];
-        cond_dist16_encode(E->ac, &E->cs, ctx, uv);
+        cond_dist16_encode(E->ac, &E->cs, ctx_idx(E, ctx), uv);
         ctx = ((ctx << 4) | uv) & E->ctx_mask;
     }
 
-    /* handle odd read lengths */
-    if (i == len - 1) {
-        uv = chartokmer[x[i]];
-        cond_dist16_encode(E->ac, &E->cs, ctx, uv);
+    /* handle odd read lengths */
+    if (i == len - 1) {
+        uv = chartokmer[x[i]];
+        cond_dist16_encode(E->ac, &E->cs, ctx_idx(E, ctx), uv);
+    }
+}
+
+
+static void encode_char_tetranucs(seqenc_t* E, const uint8_t* x, size_t len)
+{
+    kmer_t uvwx;
+    kmer_t ctx = 0;
+    size_t i, j;
+
+    for (i = 0; i + 4 <= len && i / 4 < tetra_prefix_len; i += 4) {
+        uvwx = (chartokmer[x[i]]     << 6) | (chartokmer[x[i + 1]] << 4) |
+               (chartokmer[x[i + 2]] << 2) |  chartokmer[x[i + 3]];
+        cond_dist256_encode(E->ac, &E->cs4_0[i/4], (uint32_t) ctx, uvwx);
+        ctx = ((ctx << 8) | uvwx) & E->ctx_mask;
+    }
+
+    for (; i + 4 <= len; i += 4) {
+        uvwx = (chartokmer[x[i]]     << 6) | (chartokmer[x[i + 1]] << 4) |
+               (chartokmer[x[i + 2]] << 2) |  chartokmer[x[i + 3]];
+        cond_dist256_encode(E->ac, &E->cs4, ctx_idx(E, ctx), uvwx);
+        ctx = ((ctx << 8) | uvwx) & E->ctx_mask;
+    }
+
+    if (i < len) {
+        uvwx = 0;
+        for (j = 0; i + j < len; ++j) {
+            uvwx |= (kmer_t) chartokmer[x[i + j]] << (6 - 2 * j);
+        }
+        cond_dist256_encode(E->ac, &E->cs4, ctx_idx(E, ctx), uvwx);
+    }
+}
+
+
+/* The p-th symbol of a read of length n, in a group coded over lanes. A final
+ * partial symbol is padded with zeros. */
+static inline kmer_t lane_symbol(const uint8_t* x, size_t n, size_t w, size_t p)
+{
+    kmer_t u = 0;
+    size_t i = p * w, k;
+    for (k = 0; k < w; ++k) {
+        u <<= 2;
+        if (i + k < n) u |= chartokmer[x[i + k]];
+    }
+
+    return u;
+}
+
+
+static inline void lane_encode_symbol(seqenc_t* E, ac_t* ac, size_t p, bool full,
+                                      kmer_t ctx, kmer_t u)
+{
+    if (E->params.symbol_len == 4) {
+        if (full && p < tetra_prefix_len) {
+            cond_dist256_encode(ac, &E->cs4_0[p], (uint32_t) ctx, u);
+        }
+        else cond_dist256_encode(ac, &E->cs4, ctx_idx(E, ctx), u);
+    }
+    else {
+        if (full && p < prefix_len) {
+            cond_dist16_encode(ac, &E->cs0[p], (uint32_t) ctx, u);
+        }
+        else cond_dist16_encode(ac, &E->cs, ctx_idx(E, ctx), u);
+    }
+}
+
+
+static inline kmer_t lane_decode_symbol(seqenc_t* E, ac_t* ac, size_t p, bool full,
+                                        kmer_t ctx)
+{
+    if (E->params.symbol_len == 4) {
+        if (full && p < tetra_prefix_len) {
+            return cond_dist256_decode(ac, &E->cs4_0[p], (uint32_t) ctx);
+        }
+        else return cond_dist256_decode(ac, &E->cs4, ctx_idx(E, ctx));
+    }
+    else {
+        if (full && p < prefix_len) {
+            return cond_dist16_decode(ac, &E->cs0[p], (uint32_t) ctx);
+        }
+        else return cond_dist16_decode(ac, &E->cs, ctx_idx(E, ctx));
+    }
+}
+
+
+/* Fetch the distribution for a lane's next symbol while the others are
+ * coded. */
+static inline void lane_prefetch(const seqenc_t* E, kmer_t ctx)
+{
+    if (E->params.symbol_len == 4) cond_dist256_prefetch(&E->cs4, ctx_idx(E, ctx));
+    else                           cond_dist16_prefetch(&E->cs, ctx_idx(E, ctx));
+}
+
+
+/* Code the pending group of reads, the p-th symbol of every read before the
+ * (p+1)-th of any, then each read's N mask. */
+static void encode_lane_group(seqenc_t* E)
+{
+    size_t w = E->params.symbol_len;
+    kmer_t ctx[max_lanes];
+    kmer_t u;
+    size_t i, n, p, m = 0;
+
+    for (i = 0; i < E->lane_count; ++i) {
+        ctx[i] = 0;
+        n = (E->lane_seq[i].n + w - 1) / w;
+        if (n > m) m = n;
+    }
+
+    for (p = 0; p < m; ++p) {
+        for (i = 0; i < E->lane_count; ++i) {
+            n = E->lane_seq[i].n;
+            if (p * w >= n) continue;
+
+            u = lane_symbol(E->lane_seq[i].s, n, w, p);
+            lane_encode_symbol(E, E->lane_ac[i], p, (p + 1) * w <= n, ctx[i], u);
+            ctx[i] = ((ctx[i] << (2 * w)) | u) & E->ctx_mask;
+            lane_prefetch(E, ctx[i]);
+        }
+    }
+
+    for (i = 0; i < E->lane_count; ++i) {
+        encode_nmask(E, E->lane_ac[i], E->lane_seq[i].s, E->lane_seq[i].n);
+        if (E->params.dup_bits > 0) {
+            dup_insert(E, E->lane_dup_idx[i], E->lane_seq[i].s, E->lane_seq[i].n);
+        }
+    }
+
+    E->lane_count = 0;
+}
+
+
+void seqenc_encode_end_chunk(seqenc_t* E)
+{
+    if (E->lane_count > 0) encode_lane_group(E);
+}
+
+
+void seqenc_encode_char_seq(seqenc_t* E, const uint8_t* x, size_t len)
+{
+    dist2_encode(E->ac, &E->d_type, SEQENC_TYPE_SEQUENCE);
+
+    if (len == 0) return;
+
+    if (E->params.lanes > 1) {
+        E->lane_dup_idx[E->lane_count] = E->dup_cur;
+        str_memcpy(&E->lane_seq[E->lane_count], x, len);
+        if (++E->lane_count == E->params.lanes) encode_lane_group(E);
+        return;
     }
 
-    /* encode N mask */
-    reserve_nmask(E, len);
-    for (i = 0; i < len; ++i) {
-        dist2_encode(E->ac, &E->d_nmask[i],
-            x[i] == 'N' ? 1 : 0);
-    }
+    if (E->params.symbol_len == 4) encode_char_tetranucs(E, x, len);
+    else                           encode_char_dinucs(E, x, len);
 
+    encode_nmask(E, E->ac, x, len);
 }
 
 
@@ -545,28 +1790,23 @@ void seqenc_encode_alignment(
 
     dist2_encode(E->ac, &E->d_type, SEQENC_TYPE_ALIGNMENT);
 
-    /* encode N mask */
-    size_t i;
-    reserve_nmask(E, qlen);
-    for (i = 0; i < qlen; ++i) {
-        dist2_encode(E->ac, &E->d_nmask[i],
-            query_str[i] == 'N' ? 1 : 0);
-    }
+    encode_nmask(E, E->ac, query_str, qlen);
 
     dist2_encode(E->ac, &E->d_aln_strand, strand);
     uint32_enc_encode(E->ac, &E->d_contig_off, spos);
 
+    size_t i;
     kmer_t u;
     if (strand) {
         for (i = 0; i < qlen; ++i) {
-            if (query_str[i] == 'N') continue;
+            if (query_str[i] == 'N' && E->n_qual == 0) continue;
             u = kmer_comp1(twobit_get(query, i));
             cond_dist4_encode(E->ac, &E->supercontig_motif, slen - (spos + i) - 1, u);
         }
     }
     else {
         for (i = 0; i < qlen; ++i) {
-            if (query_str[i] == 'N') continue;
+            if (query_str[i] == 'N' && E->n_qual == 0) continue;
             u = twobit_get(query, i);
             cond_dist4_encode(E->ac, &E->supercontig_motif, spos + i, u);
         }
@@ -574,34 +1814,109 @@ void seqenc_encode_alignment(
 }
 
 
-void seqenc_encode_reference_alignment(
-        seqenc_t* E, const short_read_t* r)
+/* Code len nucleotides of a read (in E->tmpseq, and two bits per nucleotide in
+ * E->ref_query) beginning at read_pos against the reference beginning at
+ * ref_pos, continuing a run of matches, and coding it before each mismatch.
+ * If match_n is true, Ns are made to match, as is done when they are either
+ * coded explicitly or restored from qualities. Otherwise they are coded as
+ * 'A'. */
+static void encode_match_span(
+        seqenc_t* E, const twobit_t* refseq,
+        uint32_t ref_pos, uint32_t read_pos, size_t len,
+        bool match_n, uint32_t* run)
 {
-    const twobit_t* refseq = seqmap_get(E->ref, (const char*) r->seqname.s);
+    const uint8_t* npos;
+    size_t j, off;
+    kmer_t y;
+
+    if (match_n) {
+        npos = memchr(E->tmpseq.s + read_pos, 'N', len);
+        while (npos != NULL) {
+            j = npos - E->tmpseq.s;
+            twobit_set(E->ref_query, j, twobit_get(refseq, ref_pos + j - read_pos));
+            npos = memchr(npos + 1, 'N', read_pos + len - j - 1);
+        }
+    }
 
-    if (refseq == NULL) {
-        quip_error(
-            "A read was aligned to sequence %s, which was not found in the reference.\n",
-            r->seqname.s);
+    off = 0;
+    while (true) {
+        j = twobit_match_len(refseq, ref_pos + off,
+                             E->ref_query, read_pos + off, len - off);
+        *run += j;
+        off += j;
+        if (off == len) break;
+
+        uint32_enc_encode(E->ac, &E->d_ref_run, *run);
+        y = twobit_get(refseq, ref_pos + off);
+        cond_dist4_encode(E->ac, &E->d_ref_mismatch, y,
+                          chartokmer[E->tmpseq.s[read_pos + off]]);
+        *run = 0;
+        ++off;
+    }
+}
+
+
+/* Code the aligned bases of a read (in E->tmpseq), following the cigar
+ * string, as runs of matches to the reference, each but the last followed by
+ * a mismatch. */
+static void encode_reference_matches(
+        seqenc_t* E, const twobit_t* refseq, const short_read_t* r)
+{
+    if (E->ref_query == NULL) E->ref_query = twobit_alloc();
+    twobit_copy_str_n(E->ref_query, (const char*) E->tmpseq.s, E->tmpseq.n);
+
+    uint32_t ref_pos  = r->pos;
+    uint32_t read_pos = 0;
+    uint32_t run = 0;
+
+    size_t i, len;
+
+    for (i = 0; i < r->cigar.n; ++i) {
+        len = r->cigar.lens[i];
+        switch (r->cigar.ops[i]) {
+            case BAM_CEQUAL:
+            case BAM_CDIFF:
+            case BAM_CMATCH:
+                /* A derived N is as good as any base, and a match is
+                 * cheapest, while explicit Ns are not coded here at all. */
+                encode_match_span(E, refseq, ref_pos, read_pos, len, true, &run);
+                read_pos += len;
+                ref_pos  += len;
+                break;
+
+            case BAM_CINS:
+            case BAM_CSOFT_CLIP:
+                read_pos += len;
+                break;
+
+            case BAM_CDEL:
+            case BAM_CREF_SKIP:
+            case BAM_CHARD_CLIP:
+                ref_pos += len;
+                break;
+        }
     }
 
+    if (run > 0) uint32_enc_encode(E->ac, &E->d_ref_run, run);
+}
+
+
+void seqenc_encode_reference_alignment(
+        seqenc_t* E, const short_read_t* r)
+{
+    const twobit_t* refseq = get_target_seq(E, r->tid);
+
     str_copy(&E->tmpseq, &r->seq);
     if (r->strand) {
         str_revcomp(E->tmpseq.s, E->tmpseq.n);
     }
 
-    /* encode N mask */
-    size_t i;
-    reserve_nmask(E, r->seq.n);
-    for (i = 0; i < r->seq.n; ++i) {
-        dist2_encode(E->ac, &E->d_nmask[i],
-            E->tmpseq.s[i] == 'N' ? 1 : 0);
-    }
+    encode_nmask(E, E->ac, E->tmpseq.s, E->tmpseq.n);
 
     uint32_t ref_pos   = r->pos;
     uint32_t read_pos  = 0;
 
-    i = 0;    /* cigar operation */
+    size_t i; /* cigar operation */
     size_t j; /* position within the cigar op */
 
     kmer_t x; /* read nucleotide */
@@ -612,9 +1927,23 @@ void seqenc_encode_reference_alignment(
             case BAM_CEQUAL:
             case BAM_CDIFF:
             case BAM_CMATCH:
+                if (E->quip_version >= 5) {
+                    /* coded below */
+                    read_pos += r->cigar.lens[i];
+                    ref_pos  += r->cigar.lens[i];
+                    break;
+                }
+
                 for (j = 0; j < r->cigar.lens[i]; ++j, ++read_pos, ++ref_pos) {
-                    if (E->tmpseq.s[read_pos] == 'N') continue;
-                       
+                    if (E->tmpseq.s[read_pos] == 'N') {
+                        /* A derived N is as good as any base, and a match
+                         * is cheapest. */
+                        if (E->n_qual != 0) {
+                            dist2_encode(E->ac, &E->d_ref_match, SEQENC_REF_MATCH);
+                        }
+                        continue;
+                    }
+
                     x = chartokmer[E->tmpseq.s[read_pos]];
                     y = twobit_get(refseq, ref_pos);
 
@@ -630,7 +1959,7 @@ void seqenc_encode_reference_alignment(
 
             case BAM_CINS:
                 for (j = 0; j < r->cigar.lens[i]; ++j, ++read_pos) {
-                    if (E->tmpseq.s[read_pos] == 'N') continue;
+                    if (E->tmpseq.s[read_pos] == 'N' && E->n_qual == 0) continue;
                     dist4_encode(E->ac, &E->d_ref_ins_nuc, chartokmer[E->tmpseq.s[read_pos]]);
                 }
                 break;
@@ -645,7 +1974,7 @@ void seqenc_encode_reference_alignment(
 
             case BAM_CSOFT_CLIP:
                 for (j = 0; j < r->cigar.lens[i]; ++j, ++read_pos) {
-                    if (E->tmpseq.s[read_pos] == 'N') continue;
+                    if (E->tmpseq.s[read_pos] == 'N' && E->n_qual == 0) continue;
                     dist4_encode(E->ac, &E->d_ref_ins_nuc, chartokmer[E->tmpseq.s[read_pos]]);
                 }
                 break;
@@ -663,6 +1992,39 @@ void seqenc_encode_reference_alignment(
     if (read_pos != r->seq.n) {
         quip_error("Cigar operations do not account for full read length.");
     }
+
+    if (E->quip_version >= 5) encode_reference_matches(E, refseq, r);
+}
+
+
+void seqenc_encode_ref_mapping(seqenc_t* E, const short_read_t* x, bool mapped,
+                               uint32_t seq_idx, uint32_t pos, uint8_t strand)
+{
+    if (E->ref == NULL || E->quip_version < 5) return;
+
+    dist2_encode(E->ac, &E->d_refmap, mapped);
+    if (!mapped) return;
+
+    const twobit_t* refseq = seqmap_get_nth(E->ref, seq_idx);
+
+    uint32_enc_encode(E->ac, &E->d_refmap_seq, seq_idx);
+    uint32_enc_encode(E->ac, &E->d_refmap_pos, pos);
+    dist2_encode(E->ac, &E->d_refmap_strand, strand);
+
+    /* Ns to be restored from qualities are made 'A' in the read's own frame,
+     * before any reverse complement, as when checking for duplicates, so
+     * that the read is decoded just as it was checked. */
+    str_memcpy(&E->tmpseq, dup_normalize(E, x->seq.s, x->seq.n), x->seq.n);
+    if (strand) str_revcomp(E->tmpseq.s, E->tmpseq.n);
+
+    encode_nmask(E, E->ac, E->tmpseq.s, E->tmpseq.n);
+
+    if (E->ref_query == NULL) E->ref_query = twobit_alloc();
+    twobit_copy_str_n(E->ref_query, (const char*) E->tmpseq.s, E->tmpseq.n);
+
+    uint32_t run = 0;
+    encode_match_span(E, refseq, pos, 0, E->tmpseq.n, E->n_qual == 0, &run);
+    if (run > 0) uint32_enc_encode(E->ac, &E->d_ref_run, run);
 }
 
 
@@ -683,6 +2045,58 @@ void seqenc_set_supercontig(seqenc_t* E, const twobit_t* supercontig)
 }
 
 
+void seqenc_encode_supercontig(seqenc_t* E, const twobit_t* supercontig)
+{
+    size_t len = twobit_len(supercontig);
+
+    uint32_enc_t d_len;
+    uint32_enc_init(&d_len);
+    uint32_enc_encode(E->ac, &d_len, len);
+    uint32_enc_free(&d_len);
+
+    cond_dist4_t d;
+    cond_dist4_init(&d, 1 << (2 * contig_order));
+
+    const kmer_t mask = (1 << (2 * contig_order)) - 1;
+    kmer_t ctx = 0, u;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        u = twobit_get(supercontig, i);
+        cond_dist4_encode(E->ac, &d, ctx, u);
+        ctx = ((ctx << 2) | u) & mask;
+    }
+
+    cond_dist4_free(&d);
+}
+
+
+twobit_t* seqenc_decode_supercontig(seqenc_t* E)
+{
+    uint32_enc_t d_len;
+    uint32_enc_init(&d_len);
+    size_t len = uint32_enc_decode(E->ac, &d_len);
+    uint32_enc_free(&d_len);
+
+    twobit_t* supercontig = twobit_alloc_n(len);
+
+    cond_dist4_t d;
+    cond_dist4_init(&d, 1 << (2 * contig_order));
+
+    const kmer_t mask = (1 << (2 * contig_order)) - 1;
+    kmer_t ctx = 0, u;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        u = cond_dist4_decode(E->ac, &d, ctx);
+        twobit_append_kmer(supercontig, u, 1);
+        ctx = ((ctx << 2) | u) & mask;
+    }
+
+    cond_dist4_free(&d);
+
+    return supercontig;
+}
+
+
 void seqenc_get_supercontig_consensus(seqenc_t* E, twobit_t* supercontig)
 {
     size_t len = twobit_len(supercontig);
@@ -702,17 +2116,14 @@ void seqenc_get_supercontig_consensus(seqenc_t* E, twobit_t* supercontig)
 }
 
 
-static void seqenc_decode_seq(seqenc_t* E, short_read_t* x, size_t n)
+static void decode_dinucs(seqenc_t* E, short_read_t* x, size_t n)
 {
-    if (n == 0) return;
-    str_reserve(&x->seq, n + 1);
-
     kmer_t uv, u, v;
-    uint32_t ctx = 0;
+    kmer_t ctx = 0;
     size_t i;
 
     for (i = 0; i < n - 1 && i / 2 < prefix_len;) {
-        uv = cond_dist16_decode(E->ac, &E->cs0[i/2], ctx);
+        uv = cond_dist16_decode(E->ac, &E->cs0[i/2], (uint32_t) ctx);
         u = uv >> 2;
         v = uv & 0x3;
         x->seq.s[i++] = kmertochar[u];
@@ -721,7 +2132,7 @@ static void seqenc_decode_seq(seqenc_t* E, short_read_t* x, size_t n)
     }
 
     while (i < n - 1) {
-        uv = cond_dist16_decode(E->ac, &E->cs, ctx);
+        uv = cond_dist16_decode(E->ac, &E->cs, ctx_idx(E, ctx));
         u = uv >> 2;
         v = uv & 0x3;
         x->seq.s[i++] = kmertochar[u];
@@ -730,17 +2141,119 @@ static void seqenc_decode_seq(seqenc_t* E, short_read_t* x, size_t n)
     }
 
     if (i == n - 1) {
-        uv = cond_dist16_decode(E->ac, &E->cs, ctx);
+        uv = cond_dist16_decode(E->ac, &E->cs, ctx_idx(E, ctx));
         v = uv & 0x3;
         x->seq.s[i] = kmertochar[v];
     }
+}
 
-    /* decode N mask */
-    reserve_nmask(E, n);
-    for (i = 0; i < n; ++i) {
-        if (dist2_decode(E->ac, &E->d_nmask[i])) x->seq.s[i] = 'N';
+
+static void decode_tetranucs(seqenc_t* E, short_read_t* x, size_t n)
+{
+    kmer_t uvwx;
+    kmer_t ctx = 0;
+    size_t i, j;
+    uint8_t* s = x->seq.s;
+
+    for (i = 0; i + 4 <= n && i / 4 < tetra_prefix_len; i += 4) {
+        uvwx = cond_dist256_decode(E->ac, &E->cs4_0[i/4], (uint32_t) ctx);
+        s[i]     = kmertochar[uvwx >> 6];
+        s[i + 1] = kmertochar[(uvwx >> 4) & 0x3];
+        s[i + 2] = kmertochar[(uvwx >> 2) & 0x3];
+        s[i + 3] = kmertochar[uvwx & 0x3];
+        ctx = ((ctx << 8) | uvwx) & E->ctx_mask;
+    }
+
+    for (; i + 4 <= n; i += 4) {
+        uvwx = cond_dist256_decode(E->ac, &E->cs4, ctx_idx(E, ctx));
+        s[i]     = kmertochar[uvwx >> 6];
+        s[i + 1] = kmertochar[(uvwx >> 4) & 0x3];
+        s[i + 2] = kmertochar[(uvwx >> 2) & 0x3];
+        s[i + 3] = kmertochar[uvwx & 0x3];
+        ctx = ((ctx << 8) | uvwx) & E->ctx_mask;
+    }
+
+    if (i < n) {
+        uvwx = cond_dist256_decode(E->ac, &E->cs4, ctx_idx(E, ctx));
+        for (j = 0; i + j < n; ++j) {
+            s[i + j] = kmertochar[(uvwx >> (6 - 2 * j)) & 0x3];
+        }
+    }
+}
+
+
+static void decode_lane_group(seqenc_t* E)
+{
+    size_t w = E->params.symbol_len;
+    kmer_t ctx[max_lanes];
+    kmer_t u;
+    uint8_t* s;
+    size_t i, j, k, n, p, m = 0;
+
+    for (i = 0; i < E->lane_count; ++i) {
+        ctx[i] = 0;
+        n = (E->lane_len[i] + w - 1) / w;
+        if (n > m) m = n;
+    }
+
+    for (p = 0; p < m; ++p) {
+        for (i = 0; i < E->lane_count; ++i) {
+            n = E->lane_len[i];
+            j = p * w;
+            if (j >= n) continue;
+
+            u = lane_decode_symbol(E, E->lane_ac[i], p, j + w <= n, ctx[i]);
+            ctx[i] = ((ctx[i] << (2 * w)) | u) & E->ctx_mask;
+            lane_prefetch(E, ctx[i]);
+
+            s = E->lane_out[i];
+            for (k = 0; k < w && j + k < n; ++k) {
+                s[j + k] = kmertochar[(u >> (2 * (w - 1 - k))) & 0x3];
+            }
+        }
+    }
+
+    for (i = 0; i < E->lane_count; ++i) {
+        decode_nmask(E, E->lane_ac[i], E->lane_out[i], E->lane_len[i]);
+        if (E->params.dup_bits > 0) {
+            dup_insert(E, E->lane_dup_idx[i], E->lane_out[i], E->lane_len[i]);
+        }
+    }
+
+    E->lane_count = 0;
+}
+
+
+void seqenc_decode_end_chunk(seqenc_t* E)
+{
+    if (E->lane_count > 0) decode_lane_group(E);
+}
+
+
+static void seqenc_decode_seq(seqenc_t* E, short_read_t* x, size_t n)
+{
+    if (n == 0) {
+        x->seq.n = 0;
+        return;
+    }
+    str_reserve(&x->seq, n + 1);
+
+    if (E->params.lanes > 1) {
+        x->seq.s[n] = '\0';
+        x->seq.n = n;
+
+        E->lane_dup_idx[E->lane_count] = E->dup_cur;
+        E->lane_out[E->lane_count] = x->seq.s;
+        E->lane_len[E->lane_count] = n;
+        if (++E->lane_count == E->params.lanes) decode_lane_group(E);
+        return;
     }
 
+    if (E->params.symbol_len == 4) decode_tetranucs(E, x, n);
+    else                           decode_dinucs(E, x, n);
+
+    decode_nmask(E, E->ac, x->seq.s, n);
+
     x->seq.s[n] = '\0';
     x->seq.n = n;
 }
@@ -752,12 +2265,7 @@ static void seqenc_decode_alignment(seqenc_t* E, short_read_t* x, size_t qlen)
     str_reserve(&x->seq, qlen + 1);
     memset(x->seq.s, '\0', qlen + 1);
 
-    /* decode N mask */
-    size_t i;
-    reserve_nmask(E, qlen);
-    for (i = 0; i < qlen; ++i) {
-        if (dist2_decode(E->ac, &E->d_nmask[i])) x->seq.s[i] = 'N';
-    }
+    decode_nmask(E, E->ac, x->seq.s, qlen);
 
     uint8_t  strand = dist2_decode(E->ac, &E->d_aln_strand);
     uint32_t spos   = uint32_enc_decode(E->ac, &E->d_contig_off);
@@ -765,6 +2273,7 @@ static void seqenc_decode_alignment(seqenc_t* E, short_read_t* x, size_t qlen)
    
     assert(spos < slen);
 
+    size_t i;
     kmer_t u;
     if (strand) {
         for (i = 0; i < qlen; ++i) {
@@ -786,31 +2295,131 @@ static void seqenc_decode_alignment(seqenc_t* E, short_read_t* x, size_t qlen)
 }
 
 
-static void seqenc_decode_reference_alignment(seqenc_t* E, short_read_t* r, size_t seqlen)
+/* Copy n nucleotides of the reference, beginning at pos, into a read, leaving
+ * any N in place. */
+static void copy_reference(uint8_t* dest, const twobit_t* refseq, size_t pos, size_t n)
 {
-    const twobit_t* refseq = seqmap_get(E->ref, (const char*) r->seqname.s);
+    const size_t k = 4 * sizeof(kmer_t);
+    kmer_t x;
+    size_t i, j, m;
+    for (i = 0; i < n; i += m) {
+        m = n - i < k ? n - i : k;
+        x = twobit_get_block(refseq, pos + i);
+        for (j = 0; j < m; ++j, x >>= 2) {
+            if (dest[i + j] != 'N') dest[i + j] = kmertochar[x & 0x3];
+        }
+    }
+}
 
-    if (refseq == NULL) {
-        quip_error(
-            "A read was aligned to sequence %s, which was not found in the reference.",
-            r->seqname.s);
+
+/* State of the decoding of runs of matches to the reference. */
+typedef struct match_runs_t_
+{
+    /* aligned positions not yet decoded */
+    uint32_t remaining;
+
+    /* matches left in the current run, and whether another run must be
+     * decoded before the next position */
+    uint32_t run;
+    bool need_run;
+} match_runs_t;
+
+
+/* Inverse of encode_match_span, decoding into dest. */
+static void decode_match_span(
+        seqenc_t* E, const twobit_t* refseq, uint8_t* dest,
+        uint32_t ref_pos, size_t len, match_runs_t* R)
+{
+    size_t off, m;
+    kmer_t y;
+
+    for (off = 0; off < len; ) {
+        if (R->need_run) {
+            R->run = uint32_enc_decode(E->ac, &E->d_ref_run);
+            if (R->run > R->remaining) {
+                quip_error("Reference alignment is corrupt.");
+            }
+            R->need_run = false;
+        }
+
+        if (R->run > 0) {
+            m = R->run < len - off ? R->run : len - off;
+            copy_reference(dest + off, refseq, ref_pos + off, m);
+            off += m;
+            R->run -= m;
+            R->remaining -= m;
+        }
+        else {
+            y = twobit_get(refseq, ref_pos + off);
+            dest[off] = kmertochar[cond_dist4_decode(E->ac, &E->d_ref_mismatch, y)];
+            ++off;
+            --R->remaining;
+            R->need_run = true;
+        }
+    }
+}
+
+
+/* Inverse of encode_reference_matches. */
+static void decode_reference_matches(
+        seqenc_t* E, const twobit_t* refseq, short_read_t* r)
+{
+    match_runs_t R;
+    R.remaining = 0;
+    R.run = 0;
+    R.need_run = true;
+
+    size_t i, len;
+    for (i = 0; i < r->cigar.n; ++i) {
+        if (r->cigar.ops[i] == BAM_CMATCH || r->cigar.ops[i] == BAM_CEQUAL ||
+            r->cigar.ops[i] == BAM_CDIFF) {
+            R.remaining += r->cigar.lens[i];
+        }
+    }
+
+    uint32_t ref_pos  = r->pos;
+    uint32_t read_pos = 0;
+
+    for (i = 0; i < r->cigar.n; ++i) {
+        len = r->cigar.lens[i];
+        switch (r->cigar.ops[i]) {
+            case BAM_CEQUAL:
+            case BAM_CDIFF:
+            case BAM_CMATCH:
+                decode_match_span(E, refseq, r->seq.s + read_pos, ref_pos, len, &R);
+                read_pos += len;
+                ref_pos  += len;
+                break;
+
+            case BAM_CINS:
+            case BAM_CSOFT_CLIP:
+                read_pos += len;
+                break;
+
+            case BAM_CDEL:
+            case BAM_CREF_SKIP:
+            case BAM_CHARD_CLIP:
+                ref_pos += len;
+                break;
+        }
     }
+}
+
+
+static void seqenc_decode_reference_alignment(seqenc_t* E, short_read_t* r, size_t seqlen)
+{
+    const twobit_t* refseq = get_target_seq(E, r->tid);
 
     str_reserve(&r->seq, seqlen + 1);
     r->seq.n = 0;
 
-    /* decode N mask */
-    size_t i;
-    reserve_nmask(E, seqlen);
     memset(r->seq.s, '\0', seqlen + 1);
-    for (i = 0; i < seqlen; ++i) {
-        if (dist2_decode(E->ac, &E->d_nmask[i])) r->seq.s[i] = 'N';
-    }
+    decode_nmask(E, E->ac, r->seq.s, seqlen);
 
     uint32_t ref_pos   = r->pos;
     uint32_t read_pos  = 0;
 
-    i = 0;    /* cigar operation */
+    size_t i; /* cigar operation */
     size_t j; /* position within the cigar op */
 
     kmer_t y; /* reference nucleotide */
@@ -820,6 +2429,13 @@ static void seqenc_decode_reference_alignment(seqenc_t* E, short_read_t* r, size
             case BAM_CEQUAL:
             case BAM_CDIFF:
             case BAM_CMATCH:
+                if (E->quip_version >= 5) {
+                    /* decoded below */
+                    read_pos += r->cigar.lens[i];
+                    ref_pos  += r->cigar.lens[i];
+                    break;
+                }
+
                 for (j = 0; j < r->cigar.lens[i]; ++j, ++read_pos, ++ref_pos) {
                     if (r->seq.s[read_pos] == 'N') continue;
 
@@ -864,52 +2480,175 @@ static void seqenc_decode_reference_alignment(seqenc_t* E, short_read_t* r, size
                 break;
         }
     }
-    r->seq.s[seqlen] = '\0';
-    r->seq.n = seqlen;
-
     if (read_pos != seqlen) {
         quip_error("Cigar operations do not account for full read length.");
     }
 
+    if (E->quip_version >= 5) decode_reference_matches(E, refseq, r);
+
+    r->seq.s[seqlen] = '\0';
+    r->seq.n = seqlen;
+
     if (r->strand) str_revcomp(r->seq.s, r->seq.n);
 }
 
 
-void seqenc_decode(seqenc_t* E, short_read_t* x, size_t n)
+/* Decode an unaligned read mapped to the reference, returning false if it
+ * was not. */
+static bool seqenc_decode_ref_mapping(seqenc_t* E, short_read_t* x, size_t n)
+{
+    if (E->ref == NULL || E->quip_version < 5) return false;
+
+    if (!dist2_decode(E->ac, &E->d_refmap)) return false;
+
+    uint32_t seq_idx = uint32_enc_decode(E->ac, &E->d_refmap_seq);
+    uint32_t pos     = uint32_enc_decode(E->ac, &E->d_refmap_pos);
+    uint8_t  strand  = dist2_decode(E->ac, &E->d_refmap_strand);
+
+    const twobit_t* refseq = seqmap_get_nth(E->ref, seq_idx);
+    if (refseq == NULL || pos + n > twobit_len(refseq)) {
+        quip_error("Reference alignment is corrupt.");
+    }
+
+    str_reserve(&x->seq, n + 1);
+    memset(x->seq.s, '\0', n + 1);
+    decode_nmask(E, E->ac, x->seq.s, n);
+
+    match_runs_t R;
+    R.remaining = n;
+    R.run = 0;
+    R.need_run = true;
+    decode_match_span(E, refseq, x->seq.s, pos, n, &R);
+
+    x->seq.n = n;
+    if (strand) str_revcomp(x->seq.s, x->seq.n);
+
+    return true;
+}
+
+
+bool seqenc_decode(seqenc_t* E, short_read_t* x, size_t n)
 {
-    if (E->ref != NULL && (x->flags & BAM_FUNMAP) == 0) {
+    if (E->ref != NULL && (x->flags & BAM_FUNMAP) == 0 && n > 0) {
         seqenc_decode_reference_alignment(E, x, n);
+        return true;
     }
-    else {
-        uint32_t type = dist2_decode(E->ac, &E->d_type);
 
-        if (type == SEQENC_TYPE_SEQUENCE) seqenc_decode_seq(E, x, n);
-        else                              seqenc_decode_alignment(E, x, n);
+    bool mapped = false;
+    if (!seqenc_decode_dup(E, x, n)) {
+        mapped = seqenc_decode_ref_mapping(E, x, n);
+        if (!mapped) {
+            uint32_t type = dist2_decode(E->ac, &E->d_type);
+
+            if (type == SEQENC_TYPE_SEQUENCE) seqenc_decode_seq(E, x, n);
+            else                              seqenc_decode_alignment(E, x, n);
+        }
+
+        if (E->params.dup_bits > 0 && n > 0 && E->params.lanes == 1) {
+            dup_insert(E, E->dup_cur, x->seq.s, n);
+        }
     }
+
+    return mapped;
 }
 
 
+/* With more than one lane, the compressed sequence data begins with the length
+ * of each lane's sub-stream, followed by the sub-streams themselves and then
+ * the main stream. */
+
 size_t seqenc_finish(seqenc_t* E)
 {
-    return ac_finish_encoder(E->ac);
+    seqenc_encode_end_chunk(E);
+
+    size_t bytes = 0;
+    size_t i;
+    if (E->params.lanes > 1) {
+        for (i = 0; i < E->params.lanes; ++i) {
+            bytes += 4 + ac_finish_encoder(E->lane_ac[i]);
+        }
+    }
+
+    return bytes + ac_finish_encoder(E->ac);
 }
 
 
 void seqenc_flush(seqenc_t* E)
 {
+    size_t i;
+    if (E->params.lanes > 1) {
+        for (i = 0; i < E->params.lanes; ++i) {
+            write_uint32(E->ac->writer, E->ac->writer_data, E->lane_ac[i]->bufpos);
+        }
+
+        for (i = 0; i < E->params.lanes; ++i) {
+            ac_flush_encoder(E->lane_ac[i]);
+        }
+    }
+
     ac_flush_encoder(E->ac);
 }
 
 
+size_t seqenc_finish_alignments(seqenc_t* E)
+{
+    return ac_finish_encoder(E->aln_ac);
+}
+
+
+void seqenc_flush_alignments(seqenc_t* E)
+{
+    ac_flush_encoder(E->aln_ac);
+}
+
+
 void seqenc_start_decoder(seqenc_t* E)
 {
+    size_t i;
+    lane_buf_t* in;
+    if (E->params.lanes > 1) {
+        for (i = 0; i < E->params.lanes; ++i) {
+            E->lane_in[i].len = read_uint32(E->ac->reader, E->ac->reader_data);
+        }
+
+        for (i = 0; i < E->params.lanes; ++i) {
+            in = &E->lane_in[i];
+            if (in->len > in->size) {
+                in->size = in->len;
+                in->buf = realloc_or_die(in->buf, in->size);
+            }
+
+            if (E->ac->reader(E->ac->reader_data, in->buf, in->len) < in->len) {
+                quip_error("Unexpected end of sequence data.");
+            }
+            in->pos = 0;
+
+            ac_start_decoder(E->lane_ac[i]);
+        }
+    }
+
     ac_start_decoder(E->ac);
 }
 
 
+void seqenc_start_alignment_decoder(seqenc_t* E)
+{
+    ac_start_decoder(E->aln_ac);
+}
+
+
 void seqenc_reset_decoder(seqenc_t* E)
 {
+    size_t i;
+    if (E->params.lanes > 1) {
+        for (i = 0; i < E->params.lanes; ++i) {
+            ac_reset_decoder(E->lane_ac[i]);
+        }
+    }
+
+    E->lane_count = 0;
     ac_reset_decoder(E->ac);
+    if (E->aln_ac != E->ac) ac_reset_decoder(E->aln_ac);
 }
 
 
@@ -17,12 +17,62 @@
 #include "quip.h"
 #include "twobit.h"
 #include "dist.h"
+#include "sam/bam.h"
 #include <stdlib.h>
 
 typedef struct seqenc_t_ seqenc_t;
 
-seqenc_t* seqenc_alloc_encoder(quip_writer_t writer, void* writer_data, const seqmap_t* ref);
-seqenc_t* seqenc_alloc_decoder(quip_reader_t writer, void* reader_data, const seqmap_t* ref);
+/* Parameters of the nucleotide model, which are fixed for a file and stored
+ * in its header. */
+typedef struct seqenc_params_t_
+{
+    /* number of preceding nucleotides the model is conditioned on */
+    uint8_t order;
+
+    /* base 2 logarithm of the number of contexts, which are hashed if this
+     * is less than 2 * order */
+    uint8_t ctx_bits;
+
+    /* number of nucleotides coded per symbol: 2 or 4 */
+    uint8_t symbol_len;
+
+    /* Number of interleaved sub-streams (1, 2, or 4) the nucleotides of
+     * unaligned reads are coded to, so that groups of consecutive reads can be
+     * decoded in lockstep. */
+    uint8_t lanes;
+
+    /* base 2 logarithm of the number of recent reads searched for an exact
+     * duplicate of each unaligned read, or 0 if duplicates are not sought */
+    uint8_t dup_bits;
+} seqenc_params_t;
+
+/* Choose parameters for a model of the given order, coding symbol_len
+ * nucleotides at a time over the given number of lanes, searching 2^dup_bits
+ * recent reads for duplicates, using roughly no more than mem bytes. */
+void seqenc_params_init(seqenc_params_t*, size_t order, size_t symbol_len,
+                        size_t lanes, size_t dup_bits, size_t mem);
+
+/* The parameters implied by files of version 4 and earlier. */
+void seqenc_params_init_v4(seqenc_params_t*);
+
+void seqenc_write_params(quip_writer_t, void* writer_data, const seqenc_params_t*);
+void seqenc_read_params(quip_reader_t, void* reader_data, seqenc_params_t*);
+
+/* Reads aligned to a reference give the sequence by its index (tid) in
+ * header, which, like ref, may be NULL, and must outlive the encoder. */
+seqenc_t* seqenc_alloc_encoder(quip_writer_t writer, void* writer_data,
+                               uint8_t quip_version,
+                               const seqenc_params_t* params,
+                               const seqmap_t* ref,
+                               const bam_header_t* header);
+/* Since version 5, alignments are decoded from aln_reader, and otherwise
+ * from reader, with the sequences. */
+seqenc_t* seqenc_alloc_decoder(quip_reader_t reader, void* reader_data,
+                               quip_reader_t aln_reader, void* aln_reader_data,
+                               uint8_t quip_version,
+                               const seqenc_params_t* params,
+                               const seqmap_t* ref,
+                               const bam_header_t* header);
 void      seqenc_free(seqenc_t*);
 
 /* This is called to initialized the sequence motifs used when
@@ -30,13 +80,58 @@ void      seqenc_free(seqenc_t*);
  * calls to seqenc_encode_alignment. */
 void seqenc_set_supercontig(seqenc_t*, const twobit_t* supercontig);
 
+/* Encode/decode the contigs themselves, so that they need not be assembled
+ * again when decoding. */
+void      seqenc_encode_supercontig(seqenc_t*, const twobit_t* supercontig);
+twobit_t* seqenc_decode_supercontig(seqenc_t*);
+
 /* Update the contig sequences to the current maximum-likelihood
  * consensus sequence. */
 void seqenc_get_supercontig_consensus(seqenc_t*, twobit_t* supercontig);
 
-/* Encode/decode additional members of short_read. */
-void seqenc_encode_extras(seqenc_t* E, const short_read_t* x, uint8_t quip_version);
-void seqenc_decode_extras(seqenc_t* E, short_read_t* x, size_t seqlen, uint8_t quip_version);
+/* Encode/decode, at the start of a chunk, the quality score that every N in
+ * the chunk carries, or 0 if Ns are coded explicitly. When nonzero, N
+ * positions are not coded and are left to be restored from qualities after
+ * decoding. */
+void    seqenc_encode_n_qual(seqenc_t* E, uint8_t n_qual);
+uint8_t seqenc_decode_n_qual(seqenc_t* E);
+
+/* Encode/decode, at the start of a chunk, the number of its reads whose
+ * sequence and qualities are copied from a recent primary alignment, followed
+ * by each copy: the number of reads skipped since the last copy (or the start
+ * of the chunk), how many primary alignments back (at least 1) it is copied
+ * from, and where in the primary it starts. */
+void     seqenc_encode_copy_count(seqenc_t* E, uint32_t n);
+uint32_t seqenc_decode_copy_count(seqenc_t* E);
+void     seqenc_encode_copy(seqenc_t* E, uint32_t skip, uint32_t back, uint32_t offset);
+void     seqenc_decode_copy(seqenc_t* E, uint32_t* skip, uint32_t* back, uint32_t* offset);
+
+/* Encode/decode, at the start of a chunk of reordered reads, where each read
+ * stood in its window of the input: whether it shares its minimizer with the
+ * read before it, and if so, how many of the window's reads lie between
+ * them, and otherwise its index in the window. */
+void seqenc_encode_read_order(seqenc_t* E, bool same, uint32_t x);
+void seqenc_decode_read_order(seqenc_t* E, bool* same, uint32_t* x);
+
+/* Mark the end of a chunk. With more than one lane, reads are coded in
+ * groups, and this codes the last, possibly partial, group. While decoding,
+ * a read's sequence is not complete until its group is, so reads must remain
+ * valid until this is called. */
+void seqenc_encode_end_chunk(seqenc_t* E);
+void seqenc_decode_end_chunk(seqenc_t* E);
+
+/* If duplicates are sought, code whether the sequence of an unaligned read is
+ * an exact duplicate of a recent read, returning true if so, in which case
+ * nothing more need be coded for it. This must precede any other coding of
+ * the sequence. (Decoding is handled by seqenc_decode.) */
+bool seqenc_encode_dup(seqenc_t* E, const uint8_t* x, size_t n);
+
+/* Encode/decode additional members of short_read: the alignment of a read
+ * from a SAM/BAM file. Since version 5, these are coded to a stream of their
+ * own, and may be coded concurrently with anything but each other, which
+ * must precede the decoding of a read's sequence when there is a reference. */
+void seqenc_encode_extras(seqenc_t* E, const short_read_t* x);
+void seqenc_decode_extras(seqenc_t* E, short_read_t* x, size_t seqlen);
 
 void seqenc_encode_char_seq(seqenc_t*, const uint8_t*, size_t len);
 void seqenc_encode_twobit_seq(seqenc_t*, const unsigned char* seq_str, const twobit_t* seq);
@@ -45,6 +140,14 @@ void seqenc_encode_reference_alignment(
         seqenc_t* E,
         const short_read_t*);
 
+/* When there is a reference, code whether an unaligned read is mapped to it
+ * (as by refindex_map) and if so, where, along with its sequence, coded
+ * against the reference. This follows seqenc_encode_dup, for reads that are
+ * not duplicates, and if the read is mapped, nothing more need be coded for
+ * it. (Decoding is handled by seqenc_decode.) */
+void seqenc_encode_ref_mapping(seqenc_t* E, const short_read_t* x, bool mapped,
+                               uint32_t seq_idx, uint32_t pos, uint8_t strand);
+
 void seqenc_encode_alignment(
         seqenc_t* E,
         uint32_t spos, uint8_t strand,
@@ -54,9 +157,16 @@ void seqenc_encode_alignment(
 size_t seqenc_finish(seqenc_t* E);
 void   seqenc_flush(seqenc_t* E);
 
-void seqenc_decode(seqenc_t* E, short_read_t* seq, size_t n);
+/* The same, for the alignment stream, since version 5. */
+size_t seqenc_finish_alignments(seqenc_t* E);
+void   seqenc_flush_alignments(seqenc_t* E);
+
+/* Decode a read's sequence, returning true if it was coded against the
+ * reference, either by its alignment or by mapping it there. */
+bool seqenc_decode(seqenc_t* E, short_read_t* seq, size_t n);
 
 void seqenc_start_decoder(seqenc_t* E);
+void seqenc_start_alignment_decoder(seqenc_t* E);
 void seqenc_reset_decoder(seqenc_t* E);
 
 
@@ -6,6 +6,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 
 typedef struct named_seq_t_
@@ -37,6 +43,15 @@ struct seqmap_t_
 
     /* file name from which the set of sequences was read */
     char* fn;
+
+    /* checksum of the sequences, computed once */
+    uint64_t crc;
+    bool crc_valid;
+
+    /* If the sequences were read from a cache, the mapped file, which holds
+     * their names and nucleotides. */
+    void*  cache;
+    size_t cache_size;
 };
 
 
@@ -47,6 +62,10 @@ seqmap_t* seqmap_alloc()
     M->size = 0;
     M->n    = 0;
     M->fn   = NULL;
+    M->crc  = 0;
+    M->crc_valid  = false;
+    M->cache      = NULL;
+    M->cache_size = 0;
 
     return M;
 }
@@ -57,10 +76,17 @@ void seqmap_clear(seqmap_t* M)
     size_t i;
     for (i = 0; i < M->n; ++i) {
         twobit_free(M->seqs[i].seq);
-        free(M->seqs[i].seqname);
+        if (M->cache == NULL) free(M->seqs[i].seqname);
     }
 
+#if HAVE_MMAP
+    if (M->cache != NULL) munmap(M->cache, M->cache_size);
+#endif
+    M->cache = NULL;
+    M->cache_size = 0;
+
     M->n = 0;
+    M->crc_valid = false;
 }
 
 
@@ -105,8 +131,10 @@ static void check_unique(const seqmap_t* M)
 }
 
 
-void seqmap_read_fasta(seqmap_t* M, const char* fn)
+static void read_fasta(seqmap_t* M, const char* fn)
 {
+    M->crc_valid = false;
+
     const char* prev_quip_in_fname = quip_in_fname;
     quip_in_fname = fn;
 
@@ -166,7 +194,7 @@ void seqmap_read_fasta(seqmap_t* M, const char* fn)
                 seq = twobit_alloc();
 
                 if (M->n >= M->size) {
-                    M->size += 16;
+                    M->size = M->size == 0 ? 16 : 2 * M->size;
                     M->seqs = realloc_or_die(M->seqs, M->size * sizeof(named_seq_t));
                 }
 
@@ -223,12 +251,292 @@ void seqmap_read_fasta(seqmap_t* M, const char* fn)
 }
 
 
+/*
+ * Reference cache.
+ *
+ * Parsing a large FASTA file, and checksumming it, takes a long time, so after
+ * doing so we write the sequences to "<fn>.qpref" in a form that can be mapped
+ * directly into memory next time (and shared between processes doing so at
+ * once). The cache is in native byte order, and consists of a header,
+ *
+ *     magic, byte order mark, FASTA size, FASTA mtime (seconds and
+ *     nanoseconds), FASTA device and inode, checksum, number of sequences,
+ *     size of the name table
+ *
+ * each an 8-byte integer (but the magic, which is 8 characters), followed by
+ * an entry for each sequence, in sorted order,
+ *
+ *     name offset, length, offset of nucleotides
+ *
+ * then the NUL-terminated names, padded to a multiple of eight bytes, and
+ * then the packed nucleotides of each sequence, in kmer_t words. Offsets are
+ * in bytes, from the start of the name table and of the nucleotides,
+ * respectively.
+ *
+ * The cache is used only if the FASTA file's size, modification time, device,
+ * and inode match those recorded, so that an edit, even one keeping the size
+ * within the same second, or a file replaced by another, is noticed.
+ */
+
+#if HAVE_MMAP
+
+static const char     seqmap_cache_magic[8] = {'Q', 'P', 'R', 'E', 'F', '\0', '\0', '\2'};
+static const uint64_t seqmap_cache_bom = 0x0102030405060708ULL;
+
+typedef struct seqmap_cache_header_t_
+{
+    char     magic[8];
+    uint64_t bom;
+    uint64_t fasta_size;
+    uint64_t fasta_mtime;
+    uint64_t fasta_mtime_nsec;
+    uint64_t fasta_dev;
+    uint64_t fasta_ino;
+    uint64_t crc;
+    uint64_t n;
+    uint64_t names_size;
+} seqmap_cache_header_t;
+
+
+typedef struct seqmap_cache_entry_t_
+{
+    uint64_t name_off;
+    uint64_t len;
+    uint64_t seq_off;
+} seqmap_cache_entry_t;
+
+
+/* Nanoseconds of a file's modification time, where they are known. */
+static uint64_t mtime_nsec(const struct stat* st)
+{
+#if HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    return (uint64_t) st->st_mtim.tv_nsec;
+#elif HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC
+    return (uint64_t) st->st_mtimespec.tv_nsec;
+#else
+    (void) st;
+    return 0;
+#endif
+}
+
+
+static char* cache_fn(const char* fn)
+{
+    size_t n = strlen(fn);
+    char* cfn = malloc_or_die(n + 7);
+    memcpy(cfn, fn, n);
+    memcpy(cfn + n, ".qpref", 7);
+    return cfn;
+}
+
+
+/* Try to read sequences from the cache of the given FASTA file, returning
+ * false if there is no usable cache. */
+static bool read_cache(seqmap_t* M, const char* fn, const struct stat* fasta_st)
+{
+    char* cfn = cache_fn(fn);
+    int fd = open(cfn, O_RDONLY);
+    free(cfn);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(seqmap_cache_header_t)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* cache = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) return false;
+
+    const seqmap_cache_header_t* h = cache;
+    const seqmap_cache_entry_t* entries = (const seqmap_cache_entry_t*) (h + 1);
+    const char* names;
+    const kmer_t* seqs;
+    uint64_t seqs_size, words;
+    size_t i;
+
+    if (memcmp(h->magic, seqmap_cache_magic, sizeof(seqmap_cache_magic)) != 0 ||
+        h->bom != seqmap_cache_bom ||
+        h->fasta_size  != (uint64_t) fasta_st->st_size ||
+        h->fasta_mtime != (uint64_t) fasta_st->st_mtime ||
+        h->fasta_mtime_nsec != mtime_nsec(fasta_st) ||
+        h->fasta_dev != (uint64_t) fasta_st->st_dev ||
+        h->fasta_ino != (uint64_t) fasta_st->st_ino ||
+        h->n > (size - sizeof(seqmap_cache_header_t)) / sizeof(seqmap_cache_entry_t) ||
+        h->names_size % sizeof(kmer_t) != 0 ||
+        h->names_size > size - sizeof(seqmap_cache_header_t)
+                             - h->n * sizeof(seqmap_cache_entry_t)) {
+        munmap(cache, size);
+        return false;
+    }
+
+    names = (const char*) (entries + h->n);
+    seqs  = (const kmer_t*) (names + h->names_size);
+    seqs_size = size - ((const char*) seqs - (const char*) cache);
+
+    /* check that every entry lies within the file */
+    for (i = 0; i < h->n; ++i) {
+        words = (entries[i].len + 4 * sizeof(kmer_t) - 1) / (4 * sizeof(kmer_t));
+        if (entries[i].name_off >= h->names_size ||
+            memchr(names + entries[i].name_off, '\0',
+                   h->names_size - entries[i].name_off) == NULL ||
+            entries[i].seq_off % sizeof(kmer_t) != 0 ||
+            entries[i].seq_off > seqs_size ||
+            words > (seqs_size - entries[i].seq_off) / sizeof(kmer_t)) {
+            munmap(cache, size);
+            return false;
+        }
+    }
+
+    M->cache = cache;
+    M->cache_size = size;
+    M->size = M->n = h->n;
+    M->seqs = realloc_or_die(M->seqs, M->size * sizeof(named_seq_t));
+    for (i = 0; i < h->n; ++i) {
+        M->seqs[i].seqname = (char*) names + entries[i].name_off;
+        M->seqs[i].seq = twobit_alloc_view(
+            (const kmer_t*) ((const char*) seqs + entries[i].seq_off),
+            entries[i].len);
+    }
+
+    M->crc = h->crc;
+    M->crc_valid = true;
+
+    return true;
+}
+
+
+/* Write a cache of the sequences just read from a FASTA file. Failing to do so
+ * (e.g., for lack of permission) is not an error. */
+static void write_cache(seqmap_t* M, const char* fn, const struct stat* fasta_st)
+{
+    char* cfn = cache_fn(fn);
+    char* tmp_fn = malloc_or_die(strlen(cfn) + 8);
+    sprintf(tmp_fn, "%s.XXXXXX", cfn);
+
+    /* write to a temporary file, which is renamed once complete, so a cache
+     * is never seen partially written */
+    int fd = mkstemp(tmp_fn);
+
+    /* mkstemp makes the file private, but others may use the same reference */
+    if (fd >= 0) fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    FILE* f = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (f == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_fn);
+        }
+
+        if (quip_verbose) fprintf(stderr, "\tunable to write %s\n", cfn);
+        free(tmp_fn);
+        free(cfn);
+        return;
+    }
+
+    seqmap_cache_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, seqmap_cache_magic, sizeof(seqmap_cache_magic));
+    h.bom         = seqmap_cache_bom;
+    h.fasta_size  = fasta_st->st_size;
+    h.fasta_mtime = fasta_st->st_mtime;
+    h.fasta_mtime_nsec = mtime_nsec(fasta_st);
+    h.fasta_dev   = fasta_st->st_dev;
+    h.fasta_ino   = fasta_st->st_ino;
+    h.crc         = seqmap_crc64(M);
+    h.n           = M->n;
+
+    size_t i;
+    for (i = 0; i < M->n; ++i) {
+        h.names_size += strlen(M->seqs[i].seqname) + 1;
+    }
+    h.names_size = (h.names_size + sizeof(kmer_t) - 1) / sizeof(kmer_t) * sizeof(kmer_t);
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    seqmap_cache_entry_t e;
+    uint64_t name_off = 0, seq_off = 0;
+    size_t words;
+    for (i = 0; i < M->n && ok; ++i) {
+        twobit_data(M->seqs[i].seq, &words);
+        e.name_off = name_off;
+        e.len      = twobit_len(M->seqs[i].seq);
+        e.seq_off  = seq_off;
+        ok = fwrite(&e, sizeof(e), 1, f) == 1;
+
+        name_off += strlen(M->seqs[i].seqname) + 1;
+        seq_off  += words * sizeof(kmer_t);
+    }
+
+    for (i = 0; i < M->n && ok; ++i) {
+        ok = fwrite(M->seqs[i].seqname, strlen(M->seqs[i].seqname) + 1, 1, f) == 1;
+    }
+
+    const char padding[sizeof(kmer_t)] = {0};
+    if (ok && h.names_size > name_off) {
+        ok = fwrite(padding, h.names_size - name_off, 1, f) == 1;
+    }
+
+    const kmer_t* data;
+    for (i = 0; i < M->n && ok; ++i) {
+        data = twobit_data(M->seqs[i].seq, &words);
+        ok = words == 0 || fwrite(data, sizeof(kmer_t), words, f) == words;
+    }
+
+    if (fclose(f) != 0) ok = false;
+
+    if (ok && rename(tmp_fn, cfn) == 0) {
+        if (quip_verbose) fprintf(stderr, "\twrote %s\n", cfn);
+    }
+    else {
+        unlink(tmp_fn);
+        if (quip_verbose) fprintf(stderr, "\tunable to write %s\n", cfn);
+    }
+
+    free(tmp_fn);
+    free(cfn);
+}
+
+#endif
+
+
+void seqmap_read_fasta(seqmap_t* M, const char* fn)
+{
+#if HAVE_MMAP
+    struct stat st;
+    bool have_stat = M->n == 0 && stat(fn, &st) == 0;
+
+    if (have_stat && read_cache(M, fn, &st)) {
+        if (quip_verbose) fprintf(stderr, "\tread cached reference %s.qpref\n", fn);
+
+        M->fn = realloc_or_die(M->fn, strlen(fn) + 1);
+        memcpy(M->fn, fn, strlen(fn) + 1);
+        return;
+    }
+#endif
+
+    read_fasta(M, fn);
+
+#if HAVE_MMAP
+    if (have_stat) write_cache(M, fn, &st);
+#endif
+}
+
+
 size_t seqmap_size(const seqmap_t* M)
 {
     return M->n;
 }
 
 
+const char* seqmap_fn(const seqmap_t* M)
+{
+    return M->fn;
+}
+
+
 const twobit_t* seqmap_get(const seqmap_t* M, const char* seqname)
 {
     if (M->n == 0) return NULL;
@@ -258,8 +566,18 @@ const twobit_t* seqmap_get(const seqmap_t* M, const char* seqname)
 }
 
 
-uint64_t seqmap_crc64(const seqmap_t* M)
+const twobit_t* seqmap_get_nth(const seqmap_t* M, size_t i)
+{
+    return i < M->n ? M->seqs[i].seq : NULL;
+}
+
+
+uint64_t seqmap_crc64(const seqmap_t* M_)
 {
+    /* the checksum is cached, so this is logically const */
+    seqmap_t* M = (seqmap_t*) M_;
+    if (M->crc_valid) return M->crc;
+
     uint64_t crc = 0;
     size_t i;
     for (i = 0; i < M->n; ++i) {
@@ -267,6 +585,9 @@ uint64_t seqmap_crc64(const seqmap_t* M)
         crc = twobit_crc64_update(M->seqs[i].seq, crc);
     }
 
+    M->crc = crc;
+    M->crc_valid = true;
+
     return crc;
 }
 
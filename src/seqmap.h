@@ -24,7 +24,14 @@ void      seqmap_clear(seqmap_t*);
 void      seqmap_free(seqmap_t*);
 void      seqmap_read_fasta(seqmap_t*, const char* fn);
 size_t    seqmap_size(const seqmap_t*);
+
+/* The FASTA file the sequences were read from, or NULL. */
+const char* seqmap_fn(const seqmap_t*);
+
 const twobit_t* seqmap_get(const seqmap_t*, const char* seqname);
+
+/* The i-th sequence, in the order they are listed in quip headers. */
+const twobit_t* seqmap_get_nth(const seqmap_t*, size_t i);
 uint64_t        seqmap_crc64(const seqmap_t*);
 
 void seqmap_write_quip_header_info(quip_writer_t writer, void* writer_data, const seqmap_t* M);
@@ -10,6 +10,9 @@ struct twobit_t_
     size_t len; /* length of stored sequence */
     size_t n;   /* space (number of kmers) allocated in seq */
     kmer_t* seq;
+
+    /* false if seq belongs to someone else, as with twobit_alloc_view */
+    bool owns_seq;
 };
 
 
@@ -48,6 +51,19 @@ twobit_t* twobit_alloc_n(size_t len)
     s->n   = kmers_needed(len);
     s->seq = malloc_or_die(s->n * sizeof(kmer_t));
     memset(s->seq, 0, s->n * sizeof(kmer_t));
+    s->owns_seq = true;
+
+    return s;
+}
+
+
+twobit_t* twobit_alloc_view(const kmer_t* seq, size_t len)
+{
+    twobit_t* s = malloc_or_die(sizeof(twobit_t));
+    s->len = len;
+    s->n   = kmers_needed(len);
+    s->seq = (kmer_t*) seq;
+    s->owns_seq = false;
 
     return s;
 }
@@ -62,7 +78,7 @@ twobit_t* twobit_alloc()
 void twobit_free(twobit_t* s)
 {
     if (s != NULL) {
-        free(s->seq);
+        if (s->owns_seq) free(s->seq);
         free(s);
     }
 }
@@ -244,6 +260,38 @@ kmer_t twobit_get(const twobit_t* s, size_t i)
     return (s->seq[idx] >> (2 * off)) & 0x3;
 }
 
+kmer_t twobit_get_block(const twobit_t* s, size_t i)
+{
+    const size_t k = 4 * sizeof(kmer_t);
+    size_t idx = i / k;
+    size_t off = i % k;
+
+    kmer_t x = s->seq[idx] >> (2 * off);
+    if (off > 0 && idx + 1 < kmers_needed(s->len)) {
+        x |= s->seq[idx + 1] << (2 * (k - off));
+    }
+
+    return x;
+}
+
+
+size_t twobit_match_len(const twobit_t* subject, size_t spos,
+                        const twobit_t* query, size_t qpos, size_t n)
+{
+    const size_t k = 4 * sizeof(kmer_t);
+    kmer_t d;
+    size_t i, m;
+    for (i = 0; i < n; i += m) {
+        m = n - i < k ? n - i : k;
+        d = twobit_get_block(subject, spos + i) ^ twobit_get_block(query, qpos + i);
+        if (m < k) d &= ((kmer_t) 1 << (2 * m)) - 1;
+        if (d != 0) return i + ctz64(d) / 2;
+    }
+
+    return n;
+}
+
+
 kmer_t twobit_get_kmer_rev(const twobit_t* s, size_t i, size_t k)
 {
     kmer_t x = 0;
@@ -307,6 +355,13 @@ void twobit_revcomp(twobit_t* dest, const twobit_t* src)
 }
 
 
+const kmer_t* twobit_data(const twobit_t* s, size_t* n)
+{
+    *n = kmers_needed(s->len);
+    return s->seq;
+}
+
+
 uint64_t twobit_crc64_update(const twobit_t* s, uint64_t crc)
 {
     return crc64_update((uint8_t*) s->seq, kmers_needed(s->len) * sizeof(kmer_t), crc);
@@ -319,49 +374,54 @@ uint32_t twobit_hash(const twobit_t* s)
 }
 
 
+/* Number of the first n nucleotides of two blocks that differ. */
+static inline uint32_t block_mismatches(kmer_t x, kmer_t y, size_t n)
+{
+    kmer_t d = x ^ y;
+    d = (d | (d >> 1)) & 0x5555555555555555ULL;
+    if (n < 4 * sizeof(kmer_t)) d &= ((kmer_t) 1 << (2 * n)) - 1;
+    return popcount64(d);
+}
+
+
 uint32_t twobit_mismatch_count(const twobit_t* subject,
                                const twobit_t* query,
                                size_t spos, uint32_t max_miss)
 {
-    /* This is made a bit tricky because the query's
-     * limbs are probably not aligned with the subjects.
-     * We have to compare each query limb to the end of
-     * one subject limb and the beginning of the following.
-     */
-
+    const size_t k = 4 * sizeof(kmer_t);
     size_t m = query->len;
     uint32_t mismatches = 0;
 
+    size_t i, n;
+    for (i = 0; i < m && mismatches < max_miss; i += k) {
+        n = m - i < k ? m - i : k;
+        mismatches += block_mismatches(twobit_get_block(subject, spos + i),
+                                       query->seq[i / k], n);
+    }
+
+    return mismatches;
+}
+
+
+uint32_t twobit_mismatch_count_rc(const twobit_t* subject,
+                                  const twobit_t* query,
+                                  size_t spos, uint32_t max_miss)
+{
     const size_t k = 4 * sizeof(kmer_t);
-    const size_t l = spos % k;
-
-    size_t subj_idx  = spos / k;
-    size_t query_idx = 0;
-
-    kmer_t x, y;
-
-    x = subject->seq[subj_idx] >> (2 * l);
-    y = query->seq[query_idx];
-
-    size_t i = 0; /* nucleotide position within query sequence */
-    size_t j;     /* position within the 'section' */
-    while (i < m) {
-        for (j = 0; j < (k - l) && i < m; ++j, ++i) {
-            if ((x & 0x3) != (y & 0x3)) ++mismatches;
-            x >>= 2;
-            y >>= 2;
-        }
-        if (i >= m || mismatches >= max_miss) break;
-
-        x = subject->seq[++subj_idx];
-        for (j = 0; j < l && i < m; ++j, ++i) {
-            if ((x & 0x3) != (y & 0x3)) ++mismatches;
-            x >>= 2;
-            y >>= 2;
-        }
-        if (i >= m || mismatches >= max_miss) break;
-
-        y = query->seq[++query_idx];
+    size_t m = query->len;
+    uint32_t mismatches = 0;
+
+    /* The i-th block of the reverse complement is that of the n nucleotides
+     * ending m - i from the end of the query, reversed and complemented. */
+    kmer_t y;
+    size_t i, n;
+    for (i = 0; i < m && mismatches < max_miss; i += k) {
+        n = m - i < k ? m - i : k;
+        y = twobit_get_block(query, m - i - n);
+        if (n < k) y &= ((kmer_t) 1 << (2 * n)) - 1;
+        y = kmer_revcomp(y, k) >> (2 * (k - n));
+
+        mismatches += block_mismatches(twobit_get_block(subject, spos + i), y, n);
     }
 
     return mismatches;
@@ -22,6 +22,10 @@ typedef struct twobit_t_ twobit_t;
 
 twobit_t* twobit_alloc();
 twobit_t* twobit_alloc_n(size_t n);
+
+/* A read-only sequence of the given length stored in seq, which must outlive
+ * it, as returned by twobit_data. */
+twobit_t* twobit_alloc_view(const kmer_t* seq, size_t len);
 void      twobit_free(twobit_t*);
 twobit_t* twobit_dup(const twobit_t*);
 void      twobit_clear(twobit_t*);
@@ -44,20 +48,39 @@ void   twobit_setc(twobit_t*, size_t i, char);
 void   twobit_set(twobit_t*, size_t i, kmer_t);
 kmer_t twobit_get(const twobit_t*, size_t i);
 kmer_t twobit_get_kmer(const twobit_t*, size_t i, size_t k);
+
+/* The (up to) 32 nucleotides starting at position i, nucleotide i + j in bits
+ * 2j and 2j + 1. Bits past the end of the sequence are unspecified. */
+kmer_t twobit_get_block(const twobit_t*, size_t i);
 kmer_t twobit_get_kmer_rev(const twobit_t* s, size_t i, size_t k);
 void   twobit_print(const twobit_t*, FILE*);
 void   twobit_print_stdout(const twobit_t*);
 int    twobit_cmp(const twobit_t*, const twobit_t*);
 void   twobit_revcomp(twobit_t* dest, const twobit_t* src);
 
+/* The packed sequence, setting *n to its length in kmer_t words. */
+const kmer_t* twobit_data(const twobit_t*, size_t* n);
+
 uint32_t twobit_hash(const twobit_t*);
 uint64_t twobit_crc64_update(const twobit_t*, uint64_t crc);
 
-/* Count mismatches (i.e. hamming distange) between a query and subject,
- * with the query places at the given offset in the subject. */
+/* Number of leading nucleotides, of the n beginning at qpos in the query, that
+ * match the subject beginning at spos, comparing 32 at a time. */
+size_t twobit_match_len(const twobit_t* subject, size_t spos,
+                        const twobit_t* query, size_t qpos, size_t n);
+
+/* Count mismatches (i.e. hamming distance) between a query and subject,
+ * with the query placed at the given offset in the subject, 32 nucleotides at
+ * a time. Counting stops once there are at least max_miss. */
 uint32_t twobit_mismatch_count(const twobit_t* subject,
                                const twobit_t* query,
                                size_t spos, uint32_t max_miss);
 
+/* The same, for the reverse complement of the query, which is taken a block
+ * at a time rather than stored. */
+uint32_t twobit_mismatch_count_rc(const twobit_t* subject,
+                                  const twobit_t* query,
+                                  size_t spos, uint32_t max_miss);
+
 #endif
 
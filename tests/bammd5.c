@@ -73,14 +73,14 @@ int main(int argc, char* argv[])
         li_MD5_Update(&md5ctx, r->seq.s,             r->seq.n);
         li_MD5_Update(&md5ctx, r->qual.s,            r->qual.n);
         li_MD5_Update(&md5ctx, (void*) &r->flags,    sizeof(uint32_t));
-        li_MD5_Update(&md5ctx, r->seqname.s,         r->seqname.n);
+        li_MD5_Update(&md5ctx, (void*) &r->tid,      sizeof(int32_t));
         li_MD5_Update(&md5ctx, (void*) &r->strand,   sizeof(uint8_t));
         li_MD5_Update(&md5ctx, (void*) &r->pos,      sizeof(uint32_t));
         li_MD5_Update(&md5ctx, (void*) &r->map_qual, sizeof(uint8_t));
         li_MD5_Update(&md5ctx, (void*) &r->cigar.n,  sizeof(uint32_t));
         li_MD5_Update(&md5ctx, r->cigar.ops,         r->cigar.n * sizeof(uint8_t));
         li_MD5_Update(&md5ctx, r->cigar.lens,        r->cigar.n * sizeof(uint32_t));
-        li_MD5_Update(&md5ctx, r->mate_seqname.s,    r->mate_seqname.n);
+        li_MD5_Update(&md5ctx, (void*) &r->mate_tid, sizeof(int32_t));
         li_MD5_Update(&md5ctx, &r->mate_pos,         sizeof(uint32_t));
         li_MD5_Update(&md5ctx, &r->tlen,             sizeof(uint32_t));
 
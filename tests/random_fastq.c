@@ -7,6 +7,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 
 static void print_help()
@@ -15,7 +16,22 @@ static void print_help()
 "Usage: random_fastq [option]...\n"
 "Generate an endless stream of random FASTQ data to standard out.\n\n"
 "Options:\n"
-"    TODO\n\n"
+"    -m, --min-length=N   minimum read length (default: 100)\n"
+"    -M, --max-length=N   maximum read length (default: 100)\n"
+"    -l, --length=N       read length\n"
+"    -i, --id-length=N    read id length (default: 50)\n"
+"    -r, --reference=FILE write a random reference sequence to FILE, in\n"
+"                         FASTA format, and draw reads from either strand\n"
+"                         of it, with substitutions and Ns\n"
+"        --ref-length=N   length of the reference (default: 200000)\n"
+"        --error-rate=P   substitution rate of reads drawn from the\n"
+"                         reference (default: 0.01)\n"
+"        --n-rate=P       rate of Ns in reads drawn from the reference\n"
+"                         (default: 0.01)\n"
+"        --dup-rate=P     proportion of reads repeating the sequence of a\n"
+"                         recent read (default: 0)\n"
+"        --n-qual         give every N, and nothing else, the quality '#'\n"
+"    -s, --seed=N         seed the random number generator\n\n"
 "Beware: the only purpose of this program is test quip.\n"
 "No particular guarantees are made.\n\n");
 }
@@ -50,16 +66,27 @@ int main(int argc, char* argv[])
         {"max-length", required_argument, NULL, 'M'},
         {"length",     required_argument, NULL, 'l'},
         {"id-length",  required_argument, NULL, 'i'},
+        {"reference",  required_argument, NULL, 'r'},
+        {"ref-length", required_argument, NULL, 'L'},
+        {"error-rate", required_argument, NULL, 'e'},
+        {"n-rate",     required_argument, NULL, 'n'},
+        {"dup-rate",   required_argument, NULL, 'd'},
+        {"n-qual",     no_argument,       NULL, 'q'},
+        {"seed",       required_argument, NULL, 's'},
         {"help",       no_argument,       NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
     size_t min_len = 100, max_len = 100;
     size_t id_len = 50;
+    const char* ref_fn = NULL;
+    size_t ref_len = 200000;
+    double error_rate = 0.01, n_rate = 0.01, dup_rate = 0.0;
+    int n_qual = 0;
 
     int opt, opt_idx;
     while (1) {
-        opt = getopt_long(argc, argv, "h", long_options, &opt_idx);
+        opt = getopt_long(argc, argv, "m:M:l:i:r:s:h", long_options, &opt_idx);
 
         if (opt == -1) break;
 
@@ -80,6 +107,34 @@ int main(int argc, char* argv[])
                 id_len = (size_t) strtoul(optarg, NULL, 10);
                 break;
 
+            case 'r':
+                ref_fn = optarg;
+                break;
+
+            case 'L':
+                ref_len = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
+            case 'e':
+                error_rate = strtod(optarg, NULL);
+                break;
+
+            case 'n':
+                n_rate = strtod(optarg, NULL);
+                break;
+
+            case 'd':
+                dup_rate = strtod(optarg, NULL);
+                break;
+
+            case 'q':
+                n_qual = 1;
+                break;
+
+            case 's':
+                srand48(strtol(optarg, NULL, 10));
+                break;
+
             case 'h':
                 print_help();
                 return EXIT_SUCCESS;
@@ -95,6 +150,9 @@ int main(int argc, char* argv[])
     char nucleotides[5] = {'A', 'C', 'G', 'T', 'N'};
     double nuc_cs[5] = {0.28, 0.49, 0.70, 0.90, 1.00};
 
+    /* without Ns, for the reference and substitutions */
+    double ref_cs[4] = {0.25, 0.50, 0.75, 1.00};
+
     char qualities[64];
     double qual_cs[64];
     size_t i;
@@ -112,23 +170,82 @@ int main(int argc, char* argv[])
         last_c = id_cs[i] = last_c + 1.0 / 94.0;
     }
 
+    /* the reference, and the complement of each nucleotide */
+    char* ref = NULL;
+    char comp[256];
+    comp['A'] = 'T'; comp['C'] = 'G'; comp['G'] = 'C'; comp['T'] = 'A';
+
+    if (ref_fn != NULL) {
+        if (ref_len < max_len) ref_len = max_len;
+
+        ref = malloc(ref_len + 1);
+        randcat(nucleotides, ref_cs, 4, ref, ref_len);
+        ref[ref_len] = '\0';
+
+        FILE* f = fopen(ref_fn, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Can not open %s for writing.\n", ref_fn);
+            return EXIT_FAILURE;
+        }
+
+        fprintf(f, ">random\n");
+        for (i = 0; i < ref_len; i += 60) {
+            fprintf(f, "%.60s\n", ref + i);
+        }
+        fclose(f);
+    }
+
+    /* recent reads' sequences, from which duplicates are drawn */
+    const size_t hist_size = 1024;
+    char** hist = malloc(hist_size * sizeof(char*));
+    for (i = 0; i < hist_size; ++i) hist[i] = malloc(max_len + 1);
+    size_t hist_n = 0;
+
     char* id   = malloc(id_len + 1);
     char* seq  = malloc(max_len + 1);
     char* qual = malloc(max_len + 1);
     size_t len = min_len;
+    size_t pos, j;
+    int strand;
 
     while (1) {
-        if (max_len > min_len) {
-            len = min_len + (size_t) (drand48() * (double) (1 + max_len - min_len));
-        }
-
         randcat(id_chars, id_cs, 94, id, id_len);
         id[id_len] = '\0';
 
-        randcat(nucleotides, nuc_cs, 5, seq, len);
-        seq[len] = '\0';
+        if (hist_n > 0 && drand48() < dup_rate) {
+            j = (size_t) (drand48() * (double) (hist_n < hist_size ? hist_n : hist_size));
+            strcpy(seq, hist[j]);
+            len = strlen(seq);
+        }
+        else {
+            if (max_len > min_len) {
+                len = min_len + (size_t) (drand48() * (double) (1 + max_len - min_len));
+            }
+
+            if (ref != NULL) {
+                pos = (size_t) (drand48() * (double) (ref_len - len + 1));
+                strand = drand48() < 0.5;
+                for (j = 0; j < len; ++j) {
+                    seq[j] = strand ? comp[(unsigned char) ref[pos + len - j - 1]]
+                                    : ref[pos + j];
+
+                    if (drand48() < n_rate) seq[j] = 'N';
+                    else if (drand48() < error_rate) {
+                        randcat(nucleotides, ref_cs, 4, seq + j, 1);
+                    }
+                }
+            }
+            else randcat(nucleotides, nuc_cs, 5, seq, len);
+            seq[len] = '\0';
+        }
+
+        strcpy(hist[hist_n++ % hist_size], seq);
 
         randcat(qualities, qual_cs, 64, qual, len);
+        for (j = 0; n_qual && j < len; ++j) {
+            if (seq[j] == 'N')        qual[j] = '#';
+            else if (qual[j] == '#') qual[j] = '$';
+        }
         qual[len] = '\0';
 
         printf(
@@ -140,6 +257,9 @@ int main(int argc, char* argv[])
     free(id);
     free(seq);
     free(qual);
+    free(ref);
+    for (i = 0; i < hist_size; ++i) free(hist[i]);
+    free(hist);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,383 @@
+/*
+    random_sam
+    ----------
+    Generate random data in SAM format.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+static void print_help()
+{
+    printf(
+"Usage: random_sam [option]...\n"
+"Generate random read pairs aligned to a random reference, in SAM format,\n"
+"to standard out.\n\n"
+"Options:\n"
+"    -n, --count=N        stop after N alignments (default: never)\n"
+"    -l, --length=N       read length (default: 100)\n"
+"    -r, --reference=FILE write the reference sequences to FILE, in FASTA\n"
+"                         format\n"
+"        --ref-count=N    number of reference sequences (default: 3)\n"
+"        --ref-length=N   length of each reference sequence (default: 100000)\n"
+"        --error-rate=P   substitution rate (default: 0.01)\n"
+"        --dup-rate=P     proportion of pairs repeating the one before\n"
+"                         (default: 0.05)\n"
+"    -s, --seed=N         seed the random number generator\n\n"
+"Besides pairs of mates on the same or different sequences, this includes\n"
+"secondary and supplementary alignments, unmapped mates, and unmapped pairs.\n\n"
+"Beware: the only purpose of this program is test quip.\n"
+"No particular guarantees are made.\n\n");
+}
+
+
+static const char nucleotides[4] = {'A', 'C', 'G', 'T'};
+
+static char random_nuc()
+{
+    return nucleotides[(size_t) (drand48() * 4.0)];
+}
+
+
+static char random_qual()
+{
+    return (char) ('#' + (int) (drand48() * 39.0));
+}
+
+
+static size_t random_index(size_t n)
+{
+    return (size_t) (drand48() * (double) n);
+}
+
+
+/* An alignment of one read. */
+typedef struct aln_t_
+{
+    int mapped;
+    size_t tid, pos; /* 0-based */
+    int reverse;
+    char cigar[64];
+    size_t span;     /* reference positions covered */
+    int nm;
+    char* seq;
+    char* qual;
+} aln_t;
+
+
+/* Draw a read of length len from a random position of sequence a->tid of the
+ * reference, with substitutions, and possibly an insertion, deletion, or soft
+ * clip. */
+static void draw_read(char** ref, size_t ref_len, size_t len, double error_rate,
+                      aln_t* a)
+{
+    size_t i, j, k, m;
+    int kind = (int) (drand48() * 8.0);
+
+    a->mapped = 1;
+    a->nm = 0;
+    if (kind == 0) {
+        /* insertion */
+        k = 1 + random_index(3);
+        m = 10 + random_index(len - k - 20);
+        snprintf(a->cigar, sizeof(a->cigar), "%zuM%zuI%zuM", m, k, len - m - k);
+        a->span = len - k;
+        a->nm += (int) k;
+    }
+    else if (kind == 1) {
+        /* deletion */
+        k = 1 + random_index(3);
+        m = 10 + random_index(len - 20);
+        snprintf(a->cigar, sizeof(a->cigar), "%zuM%zuD%zuM", m, k, len - m);
+        a->span = len + k;
+        a->nm += (int) k;
+    }
+    else if (kind == 2) {
+        /* soft clip */
+        k = 1 + random_index(20);
+        snprintf(a->cigar, sizeof(a->cigar), "%zuS%zuM", k, len - k);
+        a->span = len - k;
+        m = 0;
+    }
+    else {
+        snprintf(a->cigar, sizeof(a->cigar), "%zuM", len);
+        a->span = len;
+        k = m = 0;
+    }
+
+    a->pos = random_index(ref_len - a->span);
+
+    /* walk the cigar, drawing from the reference where it aligns */
+    const char* r = ref[a->tid] + a->pos;
+    for (i = 0, j = 0; i < len; ++i) {
+        if (kind == 0 && i >= m && i < m + k) a->seq[i] = random_nuc();
+        else if (kind == 2 && i < k)          a->seq[i] = random_nuc();
+        else {
+            if (kind == 1 && j == m) j += k;
+            a->seq[i] = r[j++];
+            if (drand48() < error_rate) {
+                a->seq[i] = random_nuc();
+                if (a->seq[i] != r[j - 1]) a->nm++;
+            }
+        }
+        a->qual[i] = random_qual();
+    }
+    a->seq[len] = a->qual[len] = '\0';
+}
+
+
+static unsigned int pair_flags(const aln_t* a, const aln_t* mate, int first)
+{
+    unsigned int flags = 0x1 | (first ? 0x40 : 0x80);
+    if (a->mapped && mate->mapped && a->tid == mate->tid) flags |= 0x2;
+    if (!a->mapped)    flags |= 0x4;
+    if (!mate->mapped) flags |= 0x8;
+    if (a->reverse)    flags |= 0x10;
+    if (mate->reverse) flags |= 0x20;
+    return flags;
+}
+
+
+static void print_aln(const char* qname, unsigned int flags, const aln_t* a,
+                      const aln_t* mate, int mapq, const char* seq,
+                      const char* qual, const char* cigar, size_t pos,
+                      const char* extra)
+{
+    char rnext[32];
+    size_t pnext;
+    long tlen = 0;
+
+    if (!a->mapped && !mate->mapped) {
+        printf("%s\t%u\t*\t0\t0\t*\t*\t0\t0\t%s\t%s\tRG:Z:grp1\n",
+               qname, flags, seq, qual);
+        return;
+    }
+
+    /* an unmapped read is placed with its mate, and vice versa */
+    const aln_t* p = a->mapped ? a : mate;
+    const aln_t* q = mate->mapped ? mate : a;
+    size_t mate_pos = mate->mapped ? mate->pos : p->pos;
+
+    if (q->tid == p->tid) {
+        strcpy(rnext, "=");
+        if (a->mapped && mate->mapped) {
+            size_t start = a->pos < mate->pos ? a->pos : mate->pos;
+            size_t end = a->pos + a->span > mate->pos + mate->span ?
+                         a->pos + a->span : mate->pos + mate->span;
+            tlen = (long) (end - start);
+            if (a->pos > mate->pos || (a->pos == mate->pos && !(flags & 0x40))) {
+                tlen = -tlen;
+            }
+        }
+    }
+    else snprintf(rnext, sizeof(rnext), "seq%zu", q->tid + 1);
+    pnext = mate_pos + 1;
+
+    printf("%s\t%u\tseq%zu\t%zu\t%d\t%s\t%s\t%zu\t%ld\t%s\t%s\tRG:Z:grp1",
+           qname, flags, p->tid + 1, pos + 1, a->mapped ? mapq : 0,
+           a->mapped ? cigar : "*", rnext, pnext, tlen, seq, qual);
+    if (a->mapped) printf("\tNM:i:%d", a->nm);
+    if (extra != NULL) printf("\t%s", extra);
+    printf("\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    static struct option long_options[] =
+    {
+        {"count",      required_argument, NULL, 'n'},
+        {"length",     required_argument, NULL, 'l'},
+        {"reference",  required_argument, NULL, 'r'},
+        {"ref-count",  required_argument, NULL, 'C'},
+        {"ref-length", required_argument, NULL, 'L'},
+        {"error-rate", required_argument, NULL, 'e'},
+        {"dup-rate",   required_argument, NULL, 'd'},
+        {"seed",       required_argument, NULL, 's'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    size_t count = 0, len = 100;
+    const char* ref_fn = NULL;
+    size_t ref_count = 3, ref_len = 100000;
+    double error_rate = 0.01, dup_rate = 0.05;
+
+    int opt, opt_idx;
+    while (1) {
+        opt = getopt_long(argc, argv, "n:l:r:s:h", long_options, &opt_idx);
+
+        if (opt == -1) break;
+
+        switch (opt) {
+            case 'n':
+                count = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
+            case 'l':
+                len = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                ref_fn = optarg;
+                break;
+
+            case 'C':
+                ref_count = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
+            case 'L':
+                ref_len = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
+            case 'e':
+                error_rate = strtod(optarg, NULL);
+                break;
+
+            case 'd':
+                dup_rate = strtod(optarg, NULL);
+                break;
+
+            case 's':
+                srand48(strtol(optarg, NULL, 10));
+                break;
+
+            case 'h':
+                print_help();
+                return EXIT_SUCCESS;
+
+            case '?':
+                return EXIT_FAILURE;
+
+            default:
+                abort();
+        }
+    }
+
+    if (len < 64 || ref_count == 0 || ref_len < 2 * len) {
+        fprintf(stderr, "Reads must be at least 64 long, and the reference "
+                        "sequences twice that.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t i, j;
+    char** ref = malloc(ref_count * sizeof(char*));
+    for (i = 0; i < ref_count; ++i) {
+        ref[i] = malloc(ref_len + 1);
+        for (j = 0; j < ref_len; ++j) ref[i][j] = random_nuc();
+        ref[i][ref_len] = '\0';
+    }
+
+    if (ref_fn != NULL) {
+        FILE* f = fopen(ref_fn, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Can not open %s for writing.\n", ref_fn);
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < ref_count; ++i) {
+            fprintf(f, ">seq%zu\n", i + 1);
+            for (j = 0; j < ref_len; j += 60) {
+                fprintf(f, "%.60s\n", ref[i] + j);
+            }
+        }
+        fclose(f);
+    }
+
+    printf("@HD\tVN:1.4\tSO:unsorted\n");
+    for (i = 0; i < ref_count; ++i) {
+        printf("@SQ\tSN:seq%zu\tLN:%zu\n", i + 1, ref_len);
+    }
+    printf("@RG\tID:grp1\tSM:random\n");
+
+    aln_t pair[2];
+    for (i = 0; i < 2; ++i) {
+        pair[i].seq  = malloc(len + 1);
+        pair[i].qual = malloc(len + 1);
+    }
+
+    char qname[32];
+    char extra[160];
+    char cigar[64];
+    size_t n = 0, num = 0, h, m;
+    int k, mapq, dup = 0;
+    double u;
+    aln_t* a;
+
+    while (count == 0 || n < count) {
+        snprintf(qname, sizeof(qname), "read%zu", ++num);
+        mapq = (int) (drand48() * 61.0);
+
+        /* PCR duplicates repeat the last pair, as sorted files would have it */
+        dup = num > 1 && drand48() < dup_rate;
+        u = drand48();
+        for (k = 0; !dup && k < 2; ++k) {
+            a = &pair[k];
+            a->tid = k == 1 && ref_count > 1 && drand48() < 0.1 ?
+                        (pair[0].tid + 1 + random_index(ref_count - 1)) % ref_count :
+                        (k == 1 ? pair[0].tid : random_index(ref_count));
+            a->reverse = k == 0 ? drand48() < 0.5 : !pair[0].reverse;
+            draw_read(ref, ref_len, len, error_rate, a);
+
+            /* mates on the same sequence lie near each other */
+            if (k == 1 && a->tid == pair[0].tid) {
+                a->pos = pair[0].pos + 100 + random_index(300);
+                if (a->pos + a->span > ref_len) a->pos = ref_len - a->span;
+            }
+
+            if ((u < 0.04) || (k == 1 && u < 0.08)) {
+                a->mapped = 0;
+                for (j = 0; j < len; ++j) a->seq[j] = random_nuc();
+            }
+        }
+
+        for (k = 0; k < 2 && (count == 0 || n < count); ++k, ++n) {
+            a = &pair[k];
+            print_aln(qname, pair_flags(a, &pair[1 - k], k == 0),
+                      a, &pair[1 - k], mapq, a->seq, a->qual, a->cigar,
+                      a->mapped ? a->pos : pair[1 - k].pos, NULL);
+        }
+
+        if (!pair[0].mapped) continue;
+        a = &pair[0];
+
+        /* a secondary alignment elsewhere, giving the sequence or not */
+        if (drand48() < 0.1 && (count == 0 || n < count)) {
+            aln_t s = *a;
+            s.pos = random_index(ref_len - s.span);
+            int given = drand48() < 0.5;
+            print_aln(qname, pair_flags(a, &pair[1], 1) | 0x100, &s, &pair[1],
+                      0, given ? a->seq : "*", given ? a->qual : "*",
+                      a->cigar, s.pos, "HI:i:2");
+            ++n;
+        }
+
+        /* a supplementary alignment of part of the read, hard clipped */
+        if (drand48() < 0.1 && (count == 0 || n < count)) {
+            h = 1 + random_index(len / 2);
+            m = len - h;
+            snprintf(cigar, sizeof(cigar), "%zuH%zuM", h, m);
+            snprintf(extra, sizeof(extra), "SA:Z:seq%zu,%zu,%c,%s,%d,%d;",
+                     a->tid + 1, a->pos + 1, a->reverse ? '-' : '+',
+                     a->cigar, mapq, a->nm);
+            aln_t s = *a;
+            s.tid = random_index(ref_count);
+            s.pos = random_index(ref_len - m);
+            s.span = m;
+            print_aln(qname, pair_flags(a, &pair[1], 1) | 0x800, &s, &pair[1],
+                      mapq, a->seq + h, a->qual + h, cigar, s.pos, extra);
+            ++n;
+        }
+    }
+
+    for (i = 0; i < 2; ++i) {
+        free(pair[i].seq);
+        free(pair[i].qual);
+    }
+    for (i = 0; i < ref_count; ++i) free(ref[i]);
+    free(ref);
+
+    return EXIT_SUCCESS;
+}